@@ -15,6 +15,13 @@
 #define TINYOBJLOADER_USE_MAPBOX_EARCUT
 #include "tiny_obj_loader.h"
 
+#define TINYGLTF_IMPLEMENTATION
+// Images are loaded through TextureCache, which already carries the stb_image implementation
+#define TINYGLTF_NO_STB_IMAGE
+#define TINYGLTF_NO_STB_IMAGE_WRITE
+#define TINYGLTF_NO_EXTERNAL_IMAGE
+#include "tiny_gltf.h"
+
 int main(void) {
     if (!glfwInit()) {
         printf("Failed initing GLFW\n");
@@ -101,6 +108,26 @@ int main(void) {
                 ImGui::Text("     Avg");
                 ImGui::Text("CPU: % 11.6f msec", avgFrameTime * 1000.f);
                 ImGui::Text("     % 11.6f Hz", 1.0 / avgFrameTime);
+                ImGui::Separator();
+
+                const CullingStats& culling = backend.scene->cullingStats;
+                ImGui::Text("Draws: %d / %d visible", culling.visible, culling.tested);
+                ImGui::Text("Occluded: %d", culling.occluded);
+                ImGui::Text("Calls: %d", culling.drawCalls);
+                ImGui::Checkbox("GPU culling", &backend.scene->gpuCulling);
+                ImGui::Checkbox("Occlusion culling", &backend.scene->occlusionCulling);
+                ImGui::Checkbox("Hierarchical culling", &backend.scene->hierarchicalCulling);
+                ImGui::Separator();
+
+                // Whatever is in the middle of the screen
+                const Camera& camera = backend.scene->mainCamera;
+                float distance;
+                uint32_t picked = backend.scene->pick(camera.pos, glm::vec3(camera.rotation * glm::vec4(0.f, 0.f, -1.f, 0.f)), distance);
+                if (picked != UINT32_MAX) {
+                    ImGui::Text("Looking at: object %d, %.1f away", picked, distance);
+                } else {
+                    ImGui::Text("Looking at: nothing");
+                }
             }
             ImGui::End();
         }
@@ -0,0 +1,168 @@
+#version 460
+
+// GPUCulling::WORKGROUP_SIZE, specialized at pipeline creation
+layout (local_size_x_id = 0) in;
+
+struct ObjectData {
+    mat4 modelMatrix;
+};
+
+layout (std140, set = 0, binding = 0) readonly buffer ObjectDataBuffer {
+    ObjectData[] data;
+} objectBuffer;
+
+// Has to match GPUCullDraw
+struct CullDraw {
+    vec4 meshBounds; // Mesh space sphere, w radius
+    uint objectIndex;
+    uint batchIndex;
+    uint materialIndex;
+    uint padding;
+};
+
+layout (std430, set = 0, binding = 1) readonly buffer CullDrawBuffer {
+    CullDraw draws[];
+} cullBuffer;
+
+// VkDrawIndexedIndirectCommand, one per batch and phase. instanceCount starts out at 0
+struct DrawCommand {
+    uint indexCount;
+    uint instanceCount;
+    uint firstIndex;
+    int vertexOffset;
+    uint firstInstance;
+};
+
+layout (std430, set = 0, binding = 2) buffer DrawCommandBuffer {
+    DrawCommand commands[];
+} commandBuffer;
+
+// Has to match GPUInstanceData
+struct InstanceData {
+    uint objectIndex;
+    uint materialIndex;
+};
+
+layout (std430, set = 0, binding = 3) writeonly buffer InstanceBuffer {
+    InstanceData instances[];
+} instanceBuffer;
+
+layout (std430, set = 0, binding = 4) buffer StatsBuffer {
+    uint visibleCount;
+    uint occludedCount;
+} stats;
+
+// Farthest depth, see DepthPyramid
+layout (set = 0, binding = 5) uniform sampler2D depthPyramid;
+
+// Has to match GPUCullView
+struct CullView {
+    mat4 viewProjection; // The one the pyramid was rendered with
+    vec4 frustumPlanes[6];
+    vec2 pyramidSize;
+    uint occlusion;
+    uint padding;
+};
+
+layout (std140, set = 0, binding = 6) uniform CullViewBuffer {
+    CullView views[2];
+} cullViews;
+
+// Draws the early phase found occluded, retested by the late phase
+layout (std430, set = 0, binding = 7) buffer LateDrawBuffer {
+    uint count;
+    uint drawIndices[];
+} lateDraws;
+
+#define PHASE_EARLY 0
+#define PHASE_LATE 1
+
+// Has to match GPUCullConstants
+layout (push_constant) uniform CullConstants {
+    uint drawCount;
+    uint phase;
+    // Of the phase's commands, the late phase's follow the early phase's
+    uint commandOffset;
+} cull;
+
+// True if the sphere is behind the pyramid everywhere it covers on screen
+bool isOccluded(vec3 center, float radius, CullView view)
+{
+    vec2 minUv = vec2(1.0f);
+    vec2 maxUv = vec2(0.0f);
+    float minDepth = 1.0f;
+    for (int corner = 0; corner < 8; ++corner) {
+        vec3 offset = vec3((corner & 1) != 0 ? radius : -radius, (corner & 2) != 0 ? radius : -radius, (corner & 4) != 0 ? radius : -radius);
+        vec4 clip = view.viewProjection * vec4(center + offset, 1.0f);
+        // Crosses the near plane, the screen bounds are meaningless
+        if (clip.w <= 1e-4f) {
+            return false;
+        }
+
+        vec3 ndc = clip.xyz / clip.w;
+        minUv = min(minUv, ndc.xy * 0.5f + 0.5f);
+        maxUv = max(maxUv, ndc.xy * 0.5f + 0.5f);
+        minDepth = min(minDepth, ndc.z);
+    }
+    minUv = clamp(minUv, 0.0f, 1.0f);
+    maxUv = clamp(maxUv, 0.0f, 1.0f);
+
+    // The level where the bounds span at most 2x2 texels, so the 4 corners cover all of them
+    vec2 size = (maxUv - minUv) * view.pyramidSize;
+    float level = ceil(log2(max(max(size.x, size.y), 1.0f)));
+
+    float depth = max(max(textureLod(depthPyramid, vec2(minUv.x, minUv.y), level).r, textureLod(depthPyramid, vec2(maxUv.x, minUv.y), level).r),
+        max(textureLod(depthPyramid, vec2(minUv.x, maxUv.y), level).r, textureLod(depthPyramid, vec2(maxUv.x, maxUv.y), level).r));
+
+    return minDepth > depth;
+}
+
+void main()
+{
+    uint drawIndex = gl_GlobalInvocationID.x;
+    if (cull.phase == PHASE_EARLY) {
+        if (drawIndex >= cull.drawCount) {
+            return;
+        }
+    } else {
+        if (drawIndex >= lateDraws.count) {
+            return;
+        }
+        drawIndex = lateDraws.drawIndices[drawIndex];
+    }
+
+    CullDraw draw = cullBuffer.draws[drawIndex];
+    mat4 modelMatrix = objectBuffer.data[draw.objectIndex].modelMatrix;
+    CullView view = cullViews.views[cull.phase];
+
+    // Same as transformSphere()
+    vec3 center = (modelMatrix * vec4(draw.meshBounds.xyz, 1.0f)).xyz;
+    float maxScale = max(length(modelMatrix[0].xyz), max(length(modelMatrix[1].xyz), length(modelMatrix[2].xyz)));
+    float radius = draw.meshBounds.w * maxScale;
+
+    // The late phase only gets draws that were in the frustum already
+    if (cull.phase == PHASE_EARLY) {
+        for (int plane = 0; plane < 6; ++plane) {
+            if (dot(view.frustumPlanes[plane].xyz, center) + view.frustumPlanes[plane].w < -radius) {
+                return;
+            }
+        }
+    }
+
+    if (view.occlusion != 0 && isOccluded(center, radius, view)) {
+        if (cull.phase == PHASE_EARLY) {
+            // Might have been uncovered since the last frame
+            lateDraws.drawIndices[atomicAdd(lateDraws.count, 1)] = drawIndex;
+        } else {
+            atomicAdd(stats.occludedCount, 1);
+        }
+        return;
+    }
+
+    // The batch's instance range is big enough for all of its draws
+    uint commandIndex = cull.commandOffset + draw.batchIndex;
+    uint instanceIndex = atomicAdd(commandBuffer.commands[commandIndex].instanceCount, 1);
+    instanceBuffer.instances[commandBuffer.commands[commandIndex].firstInstance + instanceIndex] = InstanceData(draw.objectIndex, draw.materialIndex);
+
+    atomicAdd(stats.visibleCount, 1);
+}
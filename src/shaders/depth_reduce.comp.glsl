@@ -0,0 +1,32 @@
+#version 460
+
+// DepthPyramid::WORKGROUP_SIZE, specialized at pipeline creation
+layout (local_size_x_id = 0, local_size_y_id = 1) in;
+
+// The depth attachment for level 0, the level above otherwise
+layout (set = 0, binding = 0) uniform sampler2D inputDepth;
+layout (set = 0, binding = 1, r32f) uniform writeonly image2D outputDepth;
+
+void main()
+{
+    ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+    ivec2 outputSize = imageSize(outputDepth);
+    if (texel.x >= outputSize.x || texel.y >= outputSize.y) {
+        return;
+    }
+
+    // Sizes round up, so an output texel covers 2 or 3 input texels per axis when the input is odd.
+    // All of them go into the max, the pyramid can't ever be nearer than the depth it came from
+    ivec2 inputSize = textureSize(inputDepth, 0);
+    ivec2 first = (texel * inputSize) / outputSize;
+    ivec2 last = min(((texel + 1) * inputSize + outputSize - 1) / outputSize - 1, inputSize - 1);
+
+    float depth = 0.0f;
+    for (int y = first.y; y <= last.y; ++y) {
+        for (int x = first.x; x <= last.x; ++x) {
+            depth = max(depth, texelFetch(inputDepth, ivec2(x, y), 0).r);
+        }
+    }
+
+    imageStore(outputDepth, texel, vec4(depth));
+}
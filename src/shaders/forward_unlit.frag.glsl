@@ -2,6 +2,8 @@
 
 layout (location = 0) in vec3 inColor;
 layout (location = 1) in vec2 inUv;
+// Into the material table, the same for all invocations of a draw
+layout (location = 2) flat in uint inMaterialIndex;
 
 layout (location = 0) out vec4 outColor;
 
@@ -13,12 +15,27 @@ layout (set = 0, binding = 1) uniform SceneParams {
     vec4 sunlightColor;
 } sceneParams;
 
-// TEMP: move to bindless
-layout (set = 2, binding = 0) uniform sampler2D albedoTex;
+// Bindless set, has to match BindlessResources
+#define MAX_TEXTURES 4096
+layout (set = 2, binding = 0) uniform sampler2D textures[MAX_TEXTURES];
+
+// Texture fields are indices into textures
+struct MaterialData {
+    uint albedoTexture;
+    uint normalTexture;
+    uint padding0;
+    uint padding1;
+};
+
+layout (std430, set = 2, binding = 1) readonly buffer MaterialBuffer {
+    MaterialData data[];
+} materialBuffer;
 
 void main()
 {
-    vec3 color = texture(albedoTex, inUv).rgb;
+    // Instances of a draw share their material, so no need for nonuniformEXT
+    MaterialData material = materialBuffer.data[inMaterialIndex];
+    vec3 color = texture(textures[material.albedoTexture], inUv).rgb;
     outColor = vec4(color.rgb, 1.0f);
 }
 
@@ -7,6 +7,7 @@ layout (location = 3) in vec2 uv;
 
 layout (location = 0) out vec3 outColor;
 layout (location = 1) out vec2 outUv;
+layout (location = 2) flat out uint outMaterialIndex;
 
 layout (set = 0, binding = 0) uniform CameraBuffer {
     mat4 view;
@@ -22,9 +23,22 @@ layout (std140, set = 1, binding = 0) readonly buffer ObjectDataBuffer {
     ObjectData[] data;
 } objectBuffer;
 
+// Has to match GPUInstanceData
+struct InstanceData {
+    uint objectIndex;
+    uint materialIndex;
+};
+
+// Filled per frame by DrawList::record or cull_draws.comp.glsl, one entry per instance of each draw
+layout (std430, set = 1, binding = 1) readonly buffer InstanceBuffer {
+    InstanceData instances[];
+} instanceBuffer;
+
 void main()
 {
-    gl_Position = objectBuffer.data[gl_BaseInstance].modelMatrix * vec4(position, 1.0f);
+    InstanceData instance = instanceBuffer.instances[gl_InstanceIndex];
+    gl_Position = objectBuffer.data[instance.objectIndex].modelMatrix * vec4(position, 1.0f);
     outColor = color;
     outUv = uv;
+    outMaterialIndex = instance.materialIndex;
 }
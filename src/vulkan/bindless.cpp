@@ -0,0 +1,135 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vulkan/bindless.h"
+#include "vulkan/engine.h"
+#include "vulkan/samplers.h"
+#include "vulkan/texture.h"
+#include "vulkan/upload.h"
+#include "vulkan/vk_init_helpers.h"
+
+void BindlessResources::init() {
+    VkDescriptorPoolSize poolSizes[] = {
+        { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, MAX_TEXTURES },
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 },
+    };
+
+    VkDescriptorPoolCreateInfo poolCreateInfo = {};
+    poolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolCreateInfo.pNext = nullptr;
+    poolCreateInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
+    poolCreateInfo.maxSets = 1;
+    poolCreateInfo.poolSizeCount = sizeof(poolSizes) / sizeof(VkDescriptorPoolSize);
+    poolCreateInfo.pPoolSizes = poolSizes;
+    VK_CHECK(vkCreateDescriptorPool(backend.device, &poolCreateInfo, nullptr, &pool));
+
+    VkDescriptorSetLayoutBinding bindings[] = {
+        descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, TEXTURES_BINDING),
+        descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, MATERIALS_BINDING),
+    };
+    bindings[0].descriptorCount = MAX_TEXTURES;
+
+    VkDescriptorBindingFlagsEXT bindingFlags[] = {
+        VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT
+            | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT
+            | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT_EXT,
+        0,
+    };
+    VkDescriptorSetLayoutBindingFlagsCreateInfoEXT bindingFlagsInfo = {};
+    bindingFlagsInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+    bindingFlagsInfo.pNext = nullptr;
+    bindingFlagsInfo.bindingCount = sizeof(bindingFlags) / sizeof(VkDescriptorBindingFlagsEXT);
+    bindingFlagsInfo.pBindingFlags = bindingFlags;
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.pNext = &bindingFlagsInfo;
+    layoutInfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT;
+    layoutInfo.bindingCount = sizeof(bindings) / sizeof(VkDescriptorSetLayoutBinding);
+    layoutInfo.pBindings = bindings;
+    VK_CHECK(vkCreateDescriptorSetLayout(backend.device, &layoutInfo, nullptr, &layout));
+
+    VkDescriptorSetAllocateInfo allocInfo = descriptorSetAllocate(pool, 1, &layout);
+    VK_CHECK(vkAllocateDescriptorSets(backend.device, &allocInfo, &set));
+
+    materialBuffer = backend.createBuffer(sizeof(GPUMaterialData) * MAX_MATERIALS, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+
+    VkDescriptorBufferInfo materialBufferInfo = descriptorBufferInfo(materialBuffer.buffer, 0, sizeof(GPUMaterialData) * MAX_MATERIALS);
+    VkWriteDescriptorSet write = writeDescriptorBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, set, &materialBufferInfo, MATERIALS_BINDING);
+    vkUpdateDescriptorSets(backend.device, 1, &write, 0, nullptr);
+
+    textureCount = DEFAULT_TEXTURE + 1;
+    GPUMaterialData defaultMaterial = {};
+    defaultMaterial.albedoTexture = DEFAULT_TEXTURE;
+    defaultMaterial.normalTexture = DEFAULT_TEXTURE;
+    registerMaterial(defaultMaterial);
+}
+
+void BindlessResources::initDefaultTexture() {
+    DecodedImage image;
+    image.width = 1;
+    image.height = 1;
+    // Owned by the texture cache from here on, which frees it like anything stb decoded
+    image.pixels = (unsigned char*)malloc(4);
+    memset(image.pixels, 0xff, 4);
+
+    CacheLoadResult<Texture> texture = backend.textureCache->create("bindless_default_white", image, false);
+    if (!texture.success) {
+        printf("Failed creating the default bindless texture\n");
+        assert(false);
+        return;
+    }
+    VkSampler sampler = *backend.samplerCache->load(samplerCreateInfo(VK_FILTER_NEAREST, VK_SAMPLER_ADDRESS_MODE_REPEAT)).data;
+
+    // Materials point at it without waiting for its ticket
+    backend.uploads->flush();
+
+    VkDescriptorImageInfo imageInfo = {};
+    imageInfo.sampler = sampler;
+    imageInfo.imageView = texture.data->view;
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    VkWriteDescriptorSet write = writeDescriptorImage(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, set, &imageInfo, TEXTURES_BINDING);
+    write.dstArrayElement = DEFAULT_TEXTURE;
+    vkUpdateDescriptorSets(backend.device, 1, &write, 0, nullptr);
+}
+
+void BindlessResources::deinit() {
+    vmaDestroyBuffer(backend.allocator, materialBuffer.buffer, materialBuffer.allocation);
+    vkDestroyDescriptorSetLayout(backend.device, layout, nullptr);
+    vkDestroyDescriptorPool(backend.device, pool, nullptr);
+}
+
+uint32_t BindlessResources::registerTexture(VkImageView view, VkSampler sampler) {
+    if (textureCount >= MAX_TEXTURES) {
+        printf("Bindless texture table full\n");
+        return DEFAULT_TEXTURE;
+    }
+    uint32_t slot = textureCount++;
+
+    VkDescriptorImageInfo imageInfo = {};
+    imageInfo.sampler = sampler;
+    imageInfo.imageView = view;
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    VkWriteDescriptorSet write = writeDescriptorImage(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, set, &imageInfo, TEXTURES_BINDING);
+    write.dstArrayElement = slot;
+    vkUpdateDescriptorSets(backend.device, 1, &write, 0, nullptr);
+
+    return slot;
+}
+
+uint32_t BindlessResources::registerMaterial(const GPUMaterialData& material) {
+    if (materialCount >= MAX_MATERIALS) {
+        printf("Bindless material table full\n");
+        return DEFAULT_MATERIAL;
+    }
+    uint32_t slot = materialCount++;
+
+    // Nothing in flight reads this entry yet
+    backend.uploadData(&material, sizeof(GPUMaterialData), sizeof(GPUMaterialData) * slot, materialBuffer.allocation);
+
+    return slot;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "vulkan/types.h"
+
+// Per material instance entry of the material table. Texture fields are slots in the texture array
+struct GPUMaterialData {
+    uint32_t albedoTexture;
+    uint32_t normalTexture;
+    uint32_t padding[2];
+};
+
+struct VulkanBackend;
+// A single descriptor set holding every sampled texture in one big array plus the material table
+// indexing into it. It's bound once per pass instead of a set per material instance -- shaders find
+// their textures through the material index in the object data.
+// Slots are written as textures get created. The array is partially bound and update-after-bind, so
+// that is fine while earlier frames using other slots are still in flight.
+// Slot 0 of both tables is taken by defaults, a white texture and a material using it. Missing textures
+// and full tables fall back to them, so shaders never index past what's written
+struct BindlessResources {
+    // Have to match forward_unlit.frag.glsl
+    static constexpr uint32_t SET_INDEX = 2;
+    static constexpr uint32_t TEXTURES_BINDING = 0;
+    static constexpr uint32_t MATERIALS_BINDING = 1;
+    static constexpr uint32_t MAX_TEXTURES = 4096;
+    static constexpr uint32_t MAX_MATERIALS = 4096;
+
+    static constexpr uint32_t DEFAULT_TEXTURE = 0;
+    static constexpr uint32_t DEFAULT_MATERIAL = 0;
+
+    VulkanBackend& backend;
+
+    VkDescriptorPool pool;
+    VkDescriptorSetLayout layout;
+    VkDescriptorSet set;
+
+    // Host visible, entries are written once on registration
+    AllocatedBuffer materialBuffer;
+
+    // Nothing gets unregistered yet, slots are handed out linearly
+    uint32_t textureCount = 0;
+    uint32_t materialCount = 0;
+
+    BindlessResources(VulkanBackend& backend) : backend(backend) {}
+
+    // Reserves the default slots, the texture is written by initDefaultTexture()
+    void init();
+    // Needs the texture and sampler caches, which come up after the descriptor sets
+    void initDefaultTexture();
+    void deinit();
+
+    // The defaults once the table is full
+    uint32_t registerTexture(VkImageView view, VkSampler sampler);
+    uint32_t registerMaterial(const GPUMaterialData& material);
+};
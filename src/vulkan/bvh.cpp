@@ -0,0 +1,282 @@
+#include <algorithm>
+#include <cmath>
+
+#include "vulkan/bvh.h"
+
+void BVH::update(uint32_t item, const Aabb& bounds) {
+    if (itemBounds.size() <= item) {
+        itemBounds.resize(item + 1);
+        itemLeaves.resize(item + 1, INVALID);
+    }
+    itemBounds[item] = bounds;
+    ++updatesSinceBuild;
+
+    // Coming or going changes the leaves' item ranges, refitting can't do that
+    uint32_t leaf = itemLeaves[item];
+    if ((leaf == INVALID) != bounds.empty()) {
+        rebuildNeeded = true;
+    } else if (leaf != INVALID) {
+        dirtyLeaves.push_back(leaf);
+    }
+}
+
+void BVH::refit() {
+    // Moved items keep their leaves, however far they went. Once about every item moved a few times the
+    // tree is likely worse than a fresh one
+    if (rebuildNeeded || updatesSinceBuild > 4 * items.size() + 64) {
+        build();
+        return;
+    }
+
+    for (uint32_t leaf : dirtyLeaves) {
+        refitLeaf(leaf);
+    }
+    dirtyLeaves.clear();
+}
+
+void BVH::refitLeaf(uint32_t leaf) {
+    Node& node = nodes[leaf];
+    Aabb bounds;
+    for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+        bounds.grow(itemBounds[items[i]]);
+    }
+    if (bounds == node.bounds) {
+        return;
+    }
+    node.bounds = bounds;
+
+    // Up until a node comes out the same, everything above it does as well
+    for (uint32_t parent = node.parent; parent != INVALID; parent = nodes[parent].parent) {
+        Aabb parentBounds = nodes[nodes[parent].first].bounds;
+        parentBounds.grow(nodes[nodes[parent].first + 1].bounds);
+        if (parentBounds == nodes[parent].bounds) {
+            break;
+        }
+        nodes[parent].bounds = parentBounds;
+    }
+}
+
+void BVH::build() {
+    nodes.clear();
+    items.clear();
+    dirtyLeaves.clear();
+    rebuildNeeded = false;
+    updatesSinceBuild = 0;
+
+    std::fill(itemLeaves.begin(), itemLeaves.end(), INVALID);
+    for (uint32_t item = 0; item < itemBounds.size(); ++item) {
+        if (!itemBounds[item].empty()) {
+            items.push_back(item);
+        }
+    }
+    if (items.empty()) {
+        return;
+    }
+
+    // Every split leaves both sides with items, so there are never more than 2n - 1 nodes. Reserving
+    // them keeps references valid while splitting
+    nodes.reserve(items.size() * 2);
+    nodes.push_back(Node{ Aabb(), INVALID, 0, (uint32_t)items.size() });
+
+    std::vector<uint32_t> stack = { 0 };
+    while (!stack.empty()) {
+        uint32_t nodeIndex = stack.back();
+        stack.pop_back();
+
+        Node& node = nodes[nodeIndex];
+        for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+            node.bounds.grow(itemBounds[items[i]]);
+        }
+
+        if (split(nodeIndex)) {
+            stack.push_back(nodes[nodeIndex].first + 1);
+            stack.push_back(nodes[nodeIndex].first);
+        } else {
+            for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                itemLeaves[items[i]] = nodeIndex;
+            }
+        }
+    }
+}
+
+bool BVH::split(uint32_t nodeIndex) {
+    Node& node = nodes[nodeIndex];
+    if (node.count <= 1) {
+        return false;
+    }
+
+    // Binned by centroid, whose bounds can be a lot smaller than the node's
+    Aabb centroidBounds;
+    for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+        centroidBounds.grow(itemBounds[items[i]].center());
+    }
+
+    struct Bin {
+        Aabb bounds;
+        uint32_t count = 0;
+    };
+
+    // A split costs a traversal step, scaled like the items' cost. Leaves cost all of their items
+    const float leafCost = node.count * node.bounds.surfaceArea();
+    float bestCost = INFINITY;
+    int bestAxis = -1;
+    uint32_t bestBin = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+        float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+        if (extent <= 0.f) {
+            continue;
+        }
+        float scale = BIN_COUNT / extent;
+
+        Bin bins[BIN_COUNT];
+        for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+            const Aabb& bounds = itemBounds[items[i]];
+            uint32_t bin = std::min(BIN_COUNT - 1, (uint32_t)((bounds.center()[axis] - centroidBounds.min[axis]) * scale));
+            bins[bin].bounds.grow(bounds);
+            ++bins[bin].count;
+        }
+
+        // Right side areas and counts for every split, then sweep the left side against them
+        float rightCosts[BIN_COUNT];
+        Aabb right;
+        uint32_t rightCount = 0;
+        for (uint32_t bin = BIN_COUNT - 1; bin > 0; --bin) {
+            right.grow(bins[bin].bounds);
+            rightCount += bins[bin].count;
+            rightCosts[bin] = rightCount * right.surfaceArea();
+        }
+
+        Aabb left;
+        uint32_t leftCount = 0;
+        for (uint32_t bin = 0; bin < BIN_COUNT - 1; ++bin) {
+            left.grow(bins[bin].bounds);
+            leftCount += bins[bin].count;
+            if (leftCount == 0 || leftCount == node.count) {
+                continue;
+            }
+
+            // Items to the left of bin + 1
+            float cost = node.bounds.surfaceArea() + leftCount * left.surfaceArea() + rightCosts[bin + 1];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = bin + 1;
+            }
+        }
+    }
+
+    // All centroids in the same spot
+    if (bestAxis == -1) {
+        return false;
+    }
+    // Worth it anyway once a leaf gets too big to test item by item
+    if (bestCost >= leafCost && node.count <= MAX_LEAF_ITEMS) {
+        return false;
+    }
+
+    float scale = BIN_COUNT / (centroidBounds.max[bestAxis] - centroidBounds.min[bestAxis]);
+    uint32_t* middle = std::partition(items.data() + node.first, items.data() + node.first + node.count, [&](uint32_t item) {
+        uint32_t bin = std::min(BIN_COUNT - 1, (uint32_t)((itemBounds[item].center()[bestAxis] - centroidBounds.min[bestAxis]) * scale));
+        return bin < bestBin;
+    });
+    uint32_t leftCount = middle - (items.data() + node.first);
+
+    uint32_t first = node.first;
+    uint32_t count = node.count;
+    uint32_t left = nodes.size();
+    nodes.push_back(Node{ Aabb(), nodeIndex, first, leftCount });
+    nodes.push_back(Node{ Aabb(), nodeIndex, first + leftCount, count - leftCount });
+
+    nodes[nodeIndex].first = left;
+    nodes[nodeIndex].count = 0;
+    return true;
+}
+
+// Distance along the ray to where it enters the box, INFINITY if it misses
+static float intersectRay(const Aabb& box, const glm::vec3& origin, const glm::vec3& inverseDirection) {
+    glm::vec3 t0 = (box.min - origin) * inverseDirection;
+    glm::vec3 t1 = (box.max - origin) * inverseDirection;
+    glm::vec3 tMin = glm::min(t0, t1);
+    glm::vec3 tMax = glm::max(t0, t1);
+
+    float enter = std::max(std::max(tMin.x, tMin.y), std::max(tMin.z, 0.f));
+    float exit = std::min(std::min(tMax.x, tMax.y), tMax.z);
+    return enter <= exit ? enter : INFINITY;
+}
+
+uint32_t BVH::raycast(const glm::vec3& origin, const glm::vec3& direction, float& distance) const {
+    distance = INFINITY;
+    uint32_t hit = INVALID;
+    if (nodes.empty()) {
+        return hit;
+    }
+
+    // Divisions by 0 come out infinite, which the slab test handles
+    glm::vec3 inverseDirection = 1.f / direction;
+
+    std::vector<uint32_t> stack;
+    stack.reserve(64);
+    if (intersectRay(nodes[0].bounds, origin, inverseDirection) < INFINITY) {
+        stack.push_back(0);
+    }
+    while (!stack.empty()) {
+        const Node& node = nodes[stack.back()];
+        stack.pop_back();
+
+        if (node.isLeaf()) {
+            for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                float t = intersectRay(itemBounds[items[i]], origin, inverseDirection);
+                if (t < distance) {
+                    distance = t;
+                    hit = items[i];
+                }
+            }
+            continue;
+        }
+
+        // Nearer child on top, so that its hits prune the farther one
+        uint32_t closer = node.first;
+        uint32_t farther = node.first + 1;
+        float tCloser = intersectRay(nodes[closer].bounds, origin, inverseDirection);
+        float tFarther = intersectRay(nodes[farther].bounds, origin, inverseDirection);
+        if (tFarther < tCloser) {
+            std::swap(closer, farther);
+            std::swap(tCloser, tFarther);
+        }
+        if (tFarther < distance) {
+            stack.push_back(farther);
+        }
+        if (tCloser < distance) {
+            stack.push_back(closer);
+        }
+    }
+
+    return hit;
+}
+
+void BVH::query(const Aabb& range, std::vector<uint32_t>& result) const {
+    if (nodes.empty()) {
+        return;
+    }
+
+    std::vector<uint32_t> stack = { 0 };
+    while (!stack.empty()) {
+        const Node& node = nodes[stack.back()];
+        stack.pop_back();
+
+        if (!node.bounds.overlaps(range)) {
+            continue;
+        }
+        if (!node.isLeaf()) {
+            stack.push_back(node.first);
+            stack.push_back(node.first + 1);
+            continue;
+        }
+
+        for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+            if (itemBounds[items[i]].overlaps(range)) {
+                result.push_back(items[i]);
+            }
+        }
+    }
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "vulkan/culling.h"
+
+// Bounding volume hierarchy over items with a box each, the scene's objects. Built top down with a binned
+// surface area heuristic. Items that move only get their leaves and the nodes above refit, the tree is
+// rebuilt once items came or went, or enough of them moved that the refits loosened it.
+struct BVH {
+    static constexpr uint32_t INVALID = UINT32_MAX;
+    static constexpr uint32_t MAX_LEAF_ITEMS = 4;
+    static constexpr uint32_t BIN_COUNT = 16;
+
+    struct Node {
+        Aabb bounds;
+        uint32_t parent;
+        // Into items for leaves, the left child otherwise. The right child follows it
+        uint32_t first;
+        // 0 for inner nodes
+        uint32_t count;
+
+        bool isLeaf() const { return count > 0; }
+    };
+    // The root is the first one, empty if no item has bounds
+    std::vector<Node> nodes;
+    // Ranges of these belong to the leaves
+    std::vector<uint32_t> items;
+
+    // Indexed by item
+    std::vector<Aabb> itemBounds;
+    std::vector<uint32_t> itemLeaves;
+
+    // Picked up by the next refit(). Items with empty bounds are left out of the tree
+    void update(uint32_t item, const Aabb& bounds);
+    // Brings the tree up to date with the updates, rebuilding it if needed
+    void refit();
+    void build();
+
+    // Calls visit(item, inside) for every item whose box intersects the frustum. Inside is true when the box
+    // is fully in it, so whatever the item holds doesn't need to be tested any further
+    template<typename Visit>
+    void cull(const Frustum& frustum, Visit visit) const {
+        if (nodes.empty()) {
+            return;
+        }
+
+        struct Entry {
+            uint32_t node;
+            uint8_t planeMask;
+        };
+        std::vector<Entry> stack;
+        stack.reserve(64);
+        stack.push_back({ 0, Frustum::ALL_PLANES });
+        while (!stack.empty()) {
+            Entry entry = stack.back();
+            stack.pop_back();
+
+            const Node& node = nodes[entry.node];
+            // Whole subtrees inside the frustum come out with an empty mask, and aren't tested any further
+            if (frustum.testBox(node.bounds, entry.planeMask) == Frustum::OUTSIDE) {
+                continue;
+            }
+            if (!node.isLeaf()) {
+                stack.push_back({ node.first + 1, entry.planeMask });
+                stack.push_back({ node.first, entry.planeMask });
+                continue;
+            }
+
+            for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                uint8_t planeMask = entry.planeMask;
+                Frustum::Containment containment = frustum.testBox(itemBounds[items[i]], planeMask);
+                if (containment != Frustum::OUTSIDE) {
+                    visit(items[i], containment == Frustum::INSIDE);
+                }
+            }
+        }
+    }
+
+    // Nearest item whose box the ray hits, INVALID if none. Distance is along direction, which doesn't
+    // have to be normalized. Starts at 0 for rays from inside a box
+    uint32_t raycast(const glm::vec3& origin, const glm::vec3& direction, float& distance) const;
+    // Appends every item whose box overlaps range
+    void query(const Aabb& range, std::vector<uint32_t>& result) const;
+
+private:
+    // Leaves of updated items, might contain duplicates
+    std::vector<uint32_t> dirtyLeaves;
+    bool rebuildNeeded = false;
+    uint32_t updatesSinceBuild = 0;
+
+    void refitLeaf(uint32_t leaf);
+    // Splits the node's items if the SAH says so, returns false to keep it a leaf
+    bool split(uint32_t nodeIndex);
+};
@@ -0,0 +1,259 @@
+#include <fcntl.h>
+#include <fstream>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glm/gtc/type_ptr.hpp>
+
+#include "vulkan/cooked_model.h"
+#include "vulkan/hash.h"
+#include "vulkan/mesh.h"
+
+struct SourceFileInfo {
+    uint64_t size;
+    int64_t modifiedTime;
+};
+
+static bool sourceFileInfo(const char* path, SourceFileInfo& info) {
+    struct stat fileStat;
+    if (stat(path, &fileStat) != 0) {
+        return false;
+    }
+
+    info.size = fileStat.st_size;
+    info.modifiedTime = (int64_t)fileStat.st_mtim.tv_sec * 1000000000ll + fileStat.st_mtim.tv_nsec;
+
+    return true;
+}
+
+static bool hashFile(const char* path, uint64_t& hash) {
+    MappedFile file;
+    if (!file.open(path)) {
+        return false;
+    }
+
+    hash = hashBytes(file.data, file.size);
+    return true;
+}
+
+static uint64_t hashString(const char* str) {
+    return hashBytes(str, strlen(str));
+}
+
+static uint64_t alignUp(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+bool Model::loadCooked(const char* cookedPath, const char* sourcePath, const char* materialDir) {
+    MappedFile file;
+    if (!file.open(cookedPath)) {
+        return false;
+    }
+
+    if (file.size < sizeof(CookedModelHeader)) {
+        printf("Ignoring cooked model %s - truncated\n", cookedPath);
+        return false;
+    }
+    const CookedModelHeader& header = *(const CookedModelHeader*)file.data;
+    if (memcmp(header.magic, COOKED_MODEL_MAGIC, sizeof(COOKED_MODEL_MAGIC)) != 0
+        || header.version != COOKED_MODEL_VERSION
+        || header.vertexSize != sizeof(Vertex)
+        || header.materialDirHash != hashString(materialDir)) {
+        printf("Ignoring cooked model %s - incompatible\n", cookedPath);
+        return false;
+    }
+
+    // A missing source is fine -- we might be shipping cooked assets only
+    SourceFileInfo source;
+    if (sourceFileInfo(sourcePath, source) && (source.size != header.sourceSize || source.modifiedTime != header.sourceModifiedTime)) {
+        uint64_t sourceHash;
+        if (source.size != header.sourceSize || !hashFile(sourcePath, sourceHash) || sourceHash != header.sourceHash) {
+            printf("Ignoring cooked model %s - stale\n", cookedPath);
+            return false;
+        }
+
+        // Only got touched. Refresh the timestamp so that we don't hash it again next time. The cache is
+        // still good if that fails, it just gets hashed again
+        int fd = open(cookedPath, O_WRONLY);
+        ssize_t written = -1;
+        if (fd >= 0) {
+            written = pwrite(fd, &source.modifiedTime, sizeof(source.modifiedTime), offsetof(CookedModelHeader, sourceModifiedTime));
+            close(fd);
+        }
+        if (written != (ssize_t)sizeof(source.modifiedTime)) {
+            printf("Failed refreshing timestamp of cooked model %s\n", cookedPath);
+        }
+    }
+
+    if (header.meshesOffset + header.meshCount * sizeof(CookedMesh) > file.size
+        || header.nodesOffset + header.nodeCount * sizeof(CookedNode) > file.size
+        || header.stringsOffset + header.stringsSize > file.size
+        || header.verticesOffset + header.vertexCount * sizeof(Vertex) > file.size
+        || header.indicesOffset + header.indexCount * sizeof(uint32_t) > file.size) {
+        printf("Ignoring cooked model %s - corrupt\n", cookedPath);
+        return false;
+    }
+
+    const CookedMesh* cookedMeshes = (const CookedMesh*)(file.data + header.meshesOffset);
+    const CookedNode* cookedNodes = (const CookedNode*)(file.data + header.nodesOffset);
+    const char* strings = file.data + header.stringsOffset;
+    const Vertex* cookedVertices = (const Vertex*)(file.data + header.verticesOffset);
+    const uint32_t* cookedIndices = (const uint32_t*)(file.data + header.indicesOffset);
+
+    auto cookedString = [&](CookedString str) {
+        if (str.offset + str.length > header.stringsSize) {
+            return std::string();
+        }
+        return std::string(strings + str.offset, str.length);
+    };
+
+    name = sourcePath;
+    meshes.clear();
+    meshes.reserve(header.meshCount);
+    for (uint32_t i = 0; i < header.meshCount; ++i) {
+        const CookedMesh& cookedMesh = cookedMeshes[i];
+        if (cookedMesh.firstVertex + cookedMesh.vertexCount > header.vertexCount
+            || cookedMesh.firstIndex + cookedMesh.indexCount > header.indexCount) {
+            printf("Ignoring cooked model %s - corrupt mesh %d\n", cookedPath, i);
+            meshes.clear();
+            return false;
+        }
+
+        Mesh& mesh = meshes.emplace_back();
+        mesh.name = cookedString(cookedMesh.name);
+        mesh.material.name = cookedString(cookedMesh.materialName);
+        mesh.material.albedoTexture = cookedString(cookedMesh.albedoTexture);
+        mesh.material.normalTexture = cookedString(cookedMesh.normalTexture);
+
+        // Straight into the mapping, no copies
+        mesh.vertices = cookedVertices + cookedMesh.firstVertex;
+        mesh.vertexCount = cookedMesh.vertexCount;
+        mesh.indices = cookedIndices + cookedMesh.firstIndex;
+        mesh.indexCount = cookedMesh.indexCount;
+        mesh.bounds.min = glm::make_vec3(cookedMesh.boundsMin);
+        mesh.bounds.max = glm::make_vec3(cookedMesh.boundsMax);
+    }
+
+    nodes.clear();
+    nodes.reserve(header.nodeCount);
+    for (uint32_t i = 0; i < header.nodeCount; ++i) {
+        const CookedNode& cookedNode = cookedNodes[i];
+        if ((uint64_t)cookedNode.firstMesh + cookedNode.meshCount > header.meshCount) {
+            printf("Ignoring cooked model %s - corrupt node %d\n", cookedPath, i);
+            meshes.clear();
+            nodes.clear();
+            return false;
+        }
+
+        ModelNode& node = nodes.emplace_back();
+        node.position = glm::make_vec3(cookedNode.position);
+        node.scale = glm::make_vec3(cookedNode.scale);
+        node.rotation = glm::make_mat4(cookedNode.rotation);
+        node.firstMesh = cookedNode.firstMesh;
+        node.meshCount = cookedNode.meshCount;
+    }
+
+    vertices.clear();
+    indices.clear();
+    cookedFile = std::move(file);
+
+    return true;
+}
+
+bool Model::writeCooked(const char* cookedPath, const char* sourcePath, const char* materialDir) const {
+    CookedModelHeader header = {};
+    memcpy(header.magic, COOKED_MODEL_MAGIC, sizeof(COOKED_MODEL_MAGIC));
+    header.version = COOKED_MODEL_VERSION;
+    header.vertexSize = sizeof(Vertex);
+    header.meshCount = meshes.size();
+    header.nodeCount = nodes.size();
+
+    SourceFileInfo source;
+    if (!sourceFileInfo(sourcePath, source) || !hashFile(sourcePath, header.sourceHash)) {
+        return false;
+    }
+    header.sourceSize = source.size;
+    header.sourceModifiedTime = source.modifiedTime;
+    header.materialDirHash = hashString(materialDir);
+
+    // Meshes might point into a mapping or into our vectors and need not be laid out contiguously
+    // anymore, so repack them
+    std::vector<CookedMesh> cookedMeshes(meshes.size());
+    std::string strings;
+    auto addString = [&](const std::string& str) {
+        CookedString cookedString { (uint32_t)strings.size(), (uint32_t)str.size() };
+        strings += str;
+        return cookedString;
+    };
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        const Mesh& mesh = meshes[i];
+        CookedMesh& cookedMesh = cookedMeshes[i];
+
+        cookedMesh.name = addString(mesh.name);
+        cookedMesh.materialName = addString(mesh.material.name);
+        cookedMesh.albedoTexture = addString(mesh.material.albedoTexture);
+        cookedMesh.normalTexture = addString(mesh.material.normalTexture);
+
+        cookedMesh.firstVertex = header.vertexCount;
+        cookedMesh.vertexCount = mesh.vertexCount;
+        cookedMesh.firstIndex = header.indexCount;
+        cookedMesh.indexCount = mesh.indexCount;
+        memcpy(cookedMesh.boundsMin, glm::value_ptr(mesh.bounds.min), sizeof(cookedMesh.boundsMin));
+        memcpy(cookedMesh.boundsMax, glm::value_ptr(mesh.bounds.max), sizeof(cookedMesh.boundsMax));
+
+        header.vertexCount += mesh.vertexCount;
+        header.indexCount += mesh.indexCount;
+    }
+    header.stringsSize = strings.size();
+
+    std::vector<CookedNode> cookedNodes(nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const ModelNode& node = nodes[i];
+        CookedNode& cookedNode = cookedNodes[i];
+
+        memcpy(cookedNode.position, glm::value_ptr(node.position), sizeof(cookedNode.position));
+        memcpy(cookedNode.scale, glm::value_ptr(node.scale), sizeof(cookedNode.scale));
+        memcpy(cookedNode.rotation, glm::value_ptr(node.rotation), sizeof(cookedNode.rotation));
+        cookedNode.firstMesh = node.firstMesh;
+        cookedNode.meshCount = node.meshCount;
+    }
+
+    header.meshesOffset = sizeof(CookedModelHeader);
+    header.nodesOffset = header.meshesOffset + cookedMeshes.size() * sizeof(CookedMesh);
+    header.stringsOffset = header.nodesOffset + cookedNodes.size() * sizeof(CookedNode);
+    header.verticesOffset = alignUp(header.stringsOffset + header.stringsSize, COOKED_MODEL_DATA_ALIGNMENT);
+    header.indicesOffset = alignUp(header.verticesOffset + header.vertexCount * sizeof(Vertex), COOKED_MODEL_DATA_ALIGNMENT);
+
+    // Write into a temporary and rename, so that a crash mid-write never leaves a broken cache behind
+    std::string tmpPath = std::string(cookedPath) + ".tmp";
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    const char padding[COOKED_MODEL_DATA_ALIGNMENT] = {};
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)cookedMeshes.data(), cookedMeshes.size() * sizeof(CookedMesh));
+    file.write((const char*)cookedNodes.data(), cookedNodes.size() * sizeof(CookedNode));
+    file.write(strings.data(), strings.size());
+    file.write(padding, header.verticesOffset - (header.stringsOffset + header.stringsSize));
+    for (const Mesh& mesh : meshes) {
+        file.write((const char*)mesh.vertices, mesh.vertexCount * sizeof(Vertex));
+    }
+    file.write(padding, header.indicesOffset - (header.verticesOffset + header.vertexCount * sizeof(Vertex)));
+    for (const Mesh& mesh : meshes) {
+        file.write((const char*)mesh.indices, mesh.indexCount * sizeof(uint32_t));
+    }
+    file.close();
+
+    if (file.fail() || rename(tmpPath.c_str(), cookedPath) != 0) {
+        unlink(tmpPath.c_str());
+        return false;
+    }
+
+    printf("Cooked %s into %s\n", sourcePath, cookedPath);
+    return true;
+}
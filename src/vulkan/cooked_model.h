@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+
+// Binary cache of a loaded Model, written next to the source asset as "<source>.cooked" and
+// memory-mapped on subsequent loads. Layout:
+//   CookedModelHeader
+//   CookedMesh[meshCount]
+//   CookedNode[nodeCount]
+//   char strings[stringsSize]
+//   Vertex vertices[vertexCount]    (COOKED_MODEL_DATA_ALIGNMENT aligned)
+//   uint32_t indices[indexCount]    (mesh local, i.e. relative to the mesh's first vertex)
+
+static constexpr char COOKED_MODEL_MAGIC[4] = { 'T', 'R', 'G', 'M' };
+// Bump whenever the layout below or the way models get loaded changes
+static constexpr uint32_t COOKED_MODEL_VERSION = 4;
+static constexpr uint64_t COOKED_MODEL_DATA_ALIGNMENT = 16;
+
+struct CookedString {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct CookedModelHeader {
+    char magic[4];
+    uint32_t version;
+    // Catches Vertex layout changes that were not accompanied by a version bump
+    uint32_t vertexSize;
+    uint32_t meshCount;
+
+    // Used to detect stale caches. Timestamp and size are checked first, the content
+    // hash only if the timestamp doesn't match
+    uint64_t sourceSize;
+    int64_t sourceModifiedTime;
+    uint64_t sourceHash;
+    // Texture paths get resolved against the material dir, so it's part of the cache key
+    uint64_t materialDirHash;
+
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t stringsSize;
+    uint32_t nodeCount;
+
+    uint64_t meshesOffset;
+    uint64_t nodesOffset;
+    uint64_t stringsOffset;
+    uint64_t verticesOffset;
+    uint64_t indicesOffset;
+};
+
+struct CookedMesh {
+    CookedString name;
+    CookedString materialName;
+    CookedString albedoTexture;
+    CookedString normalTexture;
+
+    uint32_t firstVertex;
+    uint32_t vertexCount;
+    uint32_t firstIndex;
+    uint32_t indexCount;
+
+    float boundsMin[3];
+    float boundsMax[3];
+};
+
+struct CookedNode {
+    float position[3];
+    float scale[3];
+    float rotation[16];
+
+    uint32_t firstMesh;
+    uint32_t meshCount;
+};
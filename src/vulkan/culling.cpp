@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "vulkan/culling.h"
+
+/*static*/ Frustum Frustum::fromViewProjection(const glm::mat4& viewProjection) {
+    // Gribb/Hartmann, glm is column major so rows are gathered across columns
+    auto row = [&](int i) {
+        return glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+    };
+
+    Frustum frustum;
+    frustum.planes[LEFT] = row(3) + row(0);
+    frustum.planes[RIGHT] = row(3) - row(0);
+    frustum.planes[BOTTOM] = row(3) + row(1);
+    frustum.planes[TOP] = row(3) - row(1);
+    frustum.planes[NEAR] = row(2);
+    frustum.planes[FAR] = row(3) - row(2);
+
+    for (glm::vec4& plane : frustum.planes) {
+        plane /= glm::length(glm::vec3(plane));
+    }
+
+    return frustum;
+}
+
+bool Frustum::intersectsSphere(const glm::vec3& center, float radius) const {
+    for (const glm::vec4& plane : planes) {
+        if (glm::dot(glm::vec3(plane), center) + plane.w < -radius) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Frustum::Containment Frustum::testBox(const Aabb& box, uint8_t& planeMask) const {
+    glm::vec3 center = box.center();
+    glm::vec3 halfExtent = (box.max - box.min) * 0.5f;
+
+    Containment result = INSIDE;
+    for (int p = 0; p < PLANE_COUNT; ++p) {
+        if ((planeMask & (1 << p)) == 0) {
+            continue;
+        }
+
+        // Distance of the center, and how far the box reaches along the plane's normal
+        glm::vec3 normal = glm::vec3(planes[p]);
+        float distance = glm::dot(normal, center) + planes[p].w;
+        float reach = glm::dot(glm::abs(normal), halfExtent);
+        if (distance < -reach) {
+            return OUTSIDE;
+        }
+        if (distance < reach) {
+            result = INTERSECTING;
+        } else {
+            planeMask &= ~(1 << p);
+        }
+    }
+    return result;
+}
+
+float Aabb::surfaceArea() const {
+    if (empty()) {
+        return 0.f;
+    }
+    glm::vec3 extent = max - min;
+    return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+}
+
+void Aabb::grow(const glm::vec3& point) {
+    min = glm::min(min, point);
+    max = glm::max(max, point);
+}
+
+void Aabb::grow(const Aabb& box) {
+    min = glm::min(min, box.min);
+    max = glm::max(max, box.max);
+}
+
+bool Aabb::overlaps(const Aabb& box) const {
+    return min.x <= box.max.x && max.x >= box.min.x
+        && min.y <= box.max.y && max.y >= box.min.y
+        && min.z <= box.max.z && max.z >= box.min.z;
+}
+
+Aabb transformBox(const glm::mat4& modelMatrix, const glm::vec3& min, const glm::vec3& max) {
+    // Arvo, every output axis picks whichever end of each input axis pushes it further
+    Aabb box;
+    box.min = glm::vec3(modelMatrix[3]);
+    box.max = box.min;
+    for (int column = 0; column < 3; ++column) {
+        glm::vec3 a = glm::vec3(modelMatrix[column]) * min[column];
+        glm::vec3 b = glm::vec3(modelMatrix[column]) * max[column];
+        box.min += glm::min(a, b);
+        box.max += glm::max(a, b);
+    }
+    return box;
+}
+
+void BoundingSpheres::resize(size_t count) {
+    count = (count + WIDTH - 1) / WIDTH * WIDTH;
+    if (count <= x.size()) {
+        return;
+    }
+
+    x.resize(count, 0.f);
+    y.resize(count, 0.f);
+    z.resize(count, 0.f);
+    radius.resize(count, -INFINITY);
+}
+
+void BoundingSpheres::set(size_t i, const glm::vec3& center, float sphereRadius) {
+    resize(i + 1);
+    x[i] = center.x;
+    y[i] = center.y;
+    z[i] = center.z;
+    radius[i] = sphereRadius;
+}
+
+void transformSphere(const glm::mat4& modelMatrix, const glm::vec3& center, float radius, glm::vec3& worldCenter, float& worldRadius) {
+    worldCenter = glm::vec3(modelMatrix * glm::vec4(center, 1.f));
+
+    float maxScale = std::max(glm::length(glm::vec3(modelMatrix[0])),
+        std::max(glm::length(glm::vec3(modelMatrix[1])), glm::length(glm::vec3(modelMatrix[2]))));
+    worldRadius = radius * maxScale;
+}
+
+void cullSpheres(const Frustum& frustum, const BoundingSpheres& spheres, uint8_t* visible) {
+    const size_t count = spheres.size();
+    size_t i = 0;
+
+#if defined(__AVX__)
+    __m256 planeX[Frustum::PLANE_COUNT], planeY[Frustum::PLANE_COUNT], planeZ[Frustum::PLANE_COUNT], planeW[Frustum::PLANE_COUNT];
+    for (int p = 0; p < Frustum::PLANE_COUNT; ++p) {
+        planeX[p] = _mm256_set1_ps(frustum.planes[p].x);
+        planeY[p] = _mm256_set1_ps(frustum.planes[p].y);
+        planeZ[p] = _mm256_set1_ps(frustum.planes[p].z);
+        planeW[p] = _mm256_set1_ps(frustum.planes[p].w);
+    }
+
+    for (; i + 8 <= count; i += 8) {
+        __m256 x = _mm256_loadu_ps(&spheres.x[i]);
+        __m256 y = _mm256_loadu_ps(&spheres.y[i]);
+        __m256 z = _mm256_loadu_ps(&spheres.z[i]);
+        __m256 negRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(&spheres.radius[i]));
+
+        // Inside as long as no plane has the center further than the radius behind it
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int p = 0; p < Frustum::PLANE_COUNT; ++p) {
+            __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, planeX[p]), _mm256_mul_ps(y, planeY[p])),
+                _mm256_add_ps(_mm256_mul_ps(z, planeZ[p]), planeW[p]));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negRadius, _CMP_GE_OQ));
+        }
+
+        int mask = _mm256_movemask_ps(inside);
+        for (int lane = 0; lane < 8; ++lane) {
+            visible[i + lane] = (mask >> lane) & 1;
+        }
+    }
+#elif defined(__SSE2__)
+    __m128 planeX[Frustum::PLANE_COUNT], planeY[Frustum::PLANE_COUNT], planeZ[Frustum::PLANE_COUNT], planeW[Frustum::PLANE_COUNT];
+    for (int p = 0; p < Frustum::PLANE_COUNT; ++p) {
+        planeX[p] = _mm_set1_ps(frustum.planes[p].x);
+        planeY[p] = _mm_set1_ps(frustum.planes[p].y);
+        planeZ[p] = _mm_set1_ps(frustum.planes[p].z);
+        planeW[p] = _mm_set1_ps(frustum.planes[p].w);
+    }
+
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_loadu_ps(&spheres.x[i]);
+        __m128 y = _mm_loadu_ps(&spheres.y[i]);
+        __m128 z = _mm_loadu_ps(&spheres.z[i]);
+        __m128 negRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&spheres.radius[i]));
+
+        // Inside as long as no plane has the center further than the radius behind it
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int p = 0; p < Frustum::PLANE_COUNT; ++p) {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, planeX[p]), _mm_mul_ps(y, planeY[p])),
+                _mm_add_ps(_mm_mul_ps(z, planeZ[p]), planeW[p]));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negRadius));
+        }
+
+        int mask = _mm_movemask_ps(inside);
+        for (int lane = 0; lane < 4; ++lane) {
+            visible[i + lane] = (mask >> lane) & 1;
+        }
+    }
+#endif
+
+    // Whatever the vector loop left, or everything without SSE
+    for (; i < count; ++i) {
+        visible[i] = frustum.intersectsSphere(glm::vec3(spheres.x[i], spheres.y[i], spheres.z[i]), spheres.radius[i]);
+    }
+}
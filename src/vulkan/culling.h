@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cmath>
+#include <stdint.h>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Empty until something grows it, min is above max then
+struct Aabb {
+    glm::vec3 min = glm::vec3(INFINITY);
+    glm::vec3 max = glm::vec3(-INFINITY);
+
+    bool empty() const { return min.x > max.x; }
+    glm::vec3 center() const { return (min + max) * 0.5f; }
+    // Half of the actual area, the SAH only ever compares them
+    float surfaceArea() const;
+
+    void grow(const glm::vec3& point);
+    void grow(const Aabb& box);
+    bool overlaps(const Aabb& box) const;
+
+    bool operator==(const Aabb& other) const { return min == other.min && max == other.max; }
+};
+
+// Box around the mesh space box transformed by the model matrix, tighter than going through a sphere
+Aabb transformBox(const glm::mat4& modelMatrix, const glm::vec3& min, const glm::vec3& max);
+
+// World space planes of the view volume, normals pointing inwards and normalized, so that dot(plane, point)
+// is the signed distance
+struct Frustum {
+    enum Plane { LEFT, RIGHT, BOTTOM, TOP, NEAR, FAR, PLANE_COUNT };
+    glm::vec4 planes[PLANE_COUNT];
+
+    // Expects Vulkan's [0, 1] clip space depth
+    static Frustum fromViewProjection(const glm::mat4& viewProjection);
+
+    bool intersectsSphere(const glm::vec3& center, float radius) const;
+
+    enum Containment { OUTSIDE, INTERSECTING, INSIDE };
+    static constexpr uint8_t ALL_PLANES = (1 << PLANE_COUNT) - 1;
+    // Only tests the planes set in planeMask, and clears the ones the box is fully inside of. Children
+    // of a box can then skip them, and with none left they're inside without a single test
+    Containment testBox(const Aabb& box, uint8_t& planeMask) const;
+};
+
+// Bounding spheres as separate arrays, so that the culling loop can load a register's worth of each.
+// Always padded to a multiple of WIDTH with spheres that never pass
+struct BoundingSpheres {
+    static constexpr uint32_t WIDTH = 8;
+
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    std::vector<float> radius;
+
+    size_t size() const { return x.size(); }
+    // Grows to at least count, keeping what's already there
+    void resize(size_t count);
+    void set(size_t i, const glm::vec3& center, float sphereRadius);
+};
+
+// Bounds of the mesh transformed by the model matrix. Non-uniform scale grows the sphere by the largest axis
+void transformSphere(const glm::mat4& modelMatrix, const glm::vec3& center, float radius, glm::vec3& worldCenter, float& worldRadius);
+
+// Writes 1 to visible for every sphere that intersects the frustum, 0 otherwise. visible needs space for
+// spheres.size(). Uses AVX or SSE, whatever the build targets
+void cullSpheres(const Frustum& frustum, const BoundingSpheres& spheres, uint8_t* visible);
+
+struct CullingStats {
+    // Live draws, and what's left of them after culling and skipping the ones still uploading
+    uint32_t tested = 0;
+    uint32_t visible = 0;
+    // In the frustum but behind the depth pyramid, GPU culling only
+    uint32_t occluded = 0;
+    // After instancing
+    uint32_t drawCalls = 0;
+};
@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <stdio.h>
+
+#include "vulkan/depth_pyramid.h"
+#include "vulkan/descriptors.h"
+#include "vulkan/engine.h"
+#include "vulkan/pipeline_cache.h"
+#include "vulkan/vk_init_helpers.h"
+#include "vulkan/vk_shader.h"
+
+bool DepthPyramid::init(VkImage depthImage, VkImageView depthView, VkExtent3D depthExtent) {
+    CacheLoadResult<ShaderPassInfo> infoResult = backend.shaderPassCache->loadInfo(ShaderPassCache::ShaderStageCreateInfos({
+        ShaderPassCache::ShaderStageCreateInfo(SHADER_PATH("depth_reduce.comp.glsl"), VK_SHADER_STAGE_COMPUTE_BIT, {
+            SpecializationConstant::ofUint(WORKGROUP_SIZE_X_CONSTANT_ID, WORKGROUP_SIZE),
+            SpecializationConstant::ofUint(WORKGROUP_SIZE_Y_CONSTANT_ID, WORKGROUP_SIZE),
+        }),
+    }));
+    if (!infoResult.success) {
+        printf("Failed loading the depth reduction shader\n");
+        return false;
+    }
+    info = infoResult.data;
+    this->depthImage = depthImage;
+
+    VkComputePipelineCreateInfo pipelineInfo = {};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.pNext = nullptr;
+    pipelineInfo.stage = shaderStageCreateInfo(info->stages[0]);
+    pipelineInfo.layout = info->layout;
+    VK_CHECK(vkCreateComputePipelines(backend.device, backend.pipelineCache->cache, 1, &pipelineInfo, nullptr, &pipeline));
+
+    VkExtent2D extent = { std::max(1u, (depthExtent.width + 1) / 2), std::max(1u, (depthExtent.height + 1) / 2) };
+    mipCount = 1;
+    while ((extent.width >> mipCount) > 0 || (extent.height >> mipCount) > 0) {
+        ++mipCount;
+    }
+
+    image.extent = { extent.width, extent.height, 1 };
+    VkImageCreateInfo imgInfo = imageCreateInfo(VK_FORMAT_R32_SFLOAT, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, image.extent, mipCount);
+    VmaAllocationCreateInfo imgAlloc = {};
+    imgAlloc.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+    imgAlloc.requiredFlags = VkMemoryPropertyFlags(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    VK_CHECK(vmaCreateImage(backend.allocator, &imgInfo, &imgAlloc, &image.image, &image.allocation, nullptr));
+
+    VkImageViewCreateInfo viewInfo = imageViewCreateInfo(VK_FORMAT_R32_SFLOAT, image.image, VK_IMAGE_ASPECT_COLOR_BIT, mipCount);
+    VK_CHECK(vkCreateImageView(backend.device, &viewInfo, nullptr, &view));
+
+    // Nearest in both directions, blending texels or levels would break the max
+    VkSamplerCreateInfo samplerInfo = samplerCreateInfo(VK_FILTER_NEAREST, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, (float)mipCount - 1);
+    samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    sampler = *backend.samplerCache->load(samplerInfo).data;
+
+    levels.resize(mipCount);
+    std::vector<VkDescriptorImageInfo> inputInfos(mipCount);
+    std::vector<VkDescriptorImageInfo> outputInfos(mipCount);
+    for (uint32_t mip = 0; mip < mipCount; ++mip) {
+        Level& level = levels[mip];
+        level.extent = { std::max(1u, extent.width >> mip), std::max(1u, extent.height >> mip) };
+
+        VkImageViewCreateInfo levelViewInfo = imageViewCreateInfo(VK_FORMAT_R32_SFLOAT, image.image, VK_IMAGE_ASPECT_COLOR_BIT);
+        levelViewInfo.subresourceRange.baseMipLevel = mip;
+        VK_CHECK(vkCreateImageView(backend.device, &levelViewInfo, nullptr, &level.view));
+
+        inputInfos[mip].sampler = sampler;
+        inputInfos[mip].imageView = mip == 0 ? depthView : levels[mip - 1].view;
+        inputInfos[mip].imageLayout = mip == 0 ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL;
+
+        outputInfos[mip].sampler = VK_NULL_HANDLE;
+        outputInfos[mip].imageView = level.view;
+        outputInfos[mip].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    }
+
+    std::vector<VkDescriptorSet> sets(mipCount);
+    DescriptorSetBuilder::begin(backend.device, *backend.descriptorSetLayoutCache, *backend.descriptorSetAllocator, mipCount)
+        .bindImages(inputInfos.data(), mipCount, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 0)
+        .bindImages(outputInfos.data(), mipCount, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 1)
+        .build(sets.data());
+    for (uint32_t mip = 0; mip < mipCount; ++mip) {
+        levels[mip].set = sets[mip];
+    }
+
+    return true;
+}
+
+void DepthPyramid::deinit() {
+    for (Level& level : levels) {
+        vkDestroyImageView(backend.device, level.view, nullptr);
+    }
+    vkDestroyImageView(backend.device, view, nullptr);
+    vmaDestroyImage(backend.allocator, image.image, image.allocation);
+    vkDestroyPipeline(backend.device, pipeline, nullptr);
+}
+
+void DepthPyramid::build(VkCommandBuffer cmd) {
+    VkImageMemoryBarrier depthBarrier = imageMemoryBarrier(VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        depthImage, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT);
+    depthBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+
+    // Whatever read the pyramid before is done by the time it gets overwritten
+    VkImageMemoryBarrier pyramidBarrier = imageMemoryBarrier(initialized ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
+        image.image, VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_SHADER_WRITE_BIT, mipCount);
+    initialized = true;
+
+    VkImageMemoryBarrier barriers[] = { depthBarrier, pyramidBarrier };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 2, barriers);
+
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    for (uint32_t mip = 0; mip < mipCount; ++mip) {
+        const Level& level = levels[mip];
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, info->layout, 0, 1, &level.set, 0, nullptr);
+        vkCmdDispatch(cmd, (level.extent.width + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, (level.extent.height + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1);
+
+        // The next level reads this one
+        VkImageMemoryBarrier levelBarrier = imageMemoryBarrier(VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL,
+            image.image, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT);
+        levelBarrier.subresourceRange.baseMipLevel = mip;
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+            0, nullptr, 0, nullptr, 1, &levelBarrier);
+    }
+
+    // Back for the passes drawing on top of it
+    depthBarrier = imageMemoryBarrier(VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+        depthImage, VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT);
+    depthBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, 0,
+        0, nullptr, 0, nullptr, 1, &depthBarrier);
+}
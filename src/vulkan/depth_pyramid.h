@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "vulkan/types.h"
+
+struct VulkanBackend;
+struct ShaderPassInfo;
+// Mip chain of the farthest depth of a depth attachment, reduced level by level in a compute shader. Anything
+// whose nearest depth is behind a texel covering its screen bounds is occluded. Level 0 is half the
+// attachment's size, levels round up so that no depth texel is left out. Always kept in the general layout
+struct DepthPyramid {
+    // Specialized into depth_reduce.comp.glsl as its local size in both dimensions
+    static constexpr uint32_t WORKGROUP_SIZE = 8;
+    static constexpr uint32_t WORKGROUP_SIZE_X_CONSTANT_ID = 0;
+    static constexpr uint32_t WORKGROUP_SIZE_Y_CONSTANT_ID = 1;
+
+    VulkanBackend& backend;
+
+    ShaderPassInfo* info = nullptr;
+    VkPipeline pipeline = VK_NULL_HANDLE;
+
+    AllocatedImage image;
+    uint32_t mipCount = 0;
+    // All levels, for sampling
+    VkImageView view = VK_NULL_HANDLE;
+    VkSampler sampler = VK_NULL_HANDLE;
+
+    struct Level {
+        VkImageView view;
+        VkExtent2D extent;
+        // Reads the level above, or the depth attachment for level 0
+        VkDescriptorSet set;
+    };
+    std::vector<Level> levels;
+
+    // The attachment the pyramid is built from
+    VkImage depthImage = VK_NULL_HANDLE;
+    bool initialized = false;
+
+    DepthPyramid(VulkanBackend& backend) : backend(backend) {}
+
+    // depthView has to be sampleable. False if the shader couldn't be loaded
+    bool init(VkImage depthImage, VkImageView depthView, VkExtent3D depthExtent);
+    void deinit();
+
+    // Outside of any render pass, right after the depth attachment got written. Leaves it in the depth
+    // attachment layout again
+    void build(VkCommandBuffer cmd);
+};
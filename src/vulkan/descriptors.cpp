@@ -1,14 +1,31 @@
+#include <algorithm>
 #include <assert.h>
 #include <alloca.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "engine.h"
 #include "descriptors.h"
+#include "hash.h"
 #include "vk_init_helpers.h"
 
-void DescriptorSetAllocator::alloc(VkDescriptorSet* descriptorSets, size_t setCount, VkDescriptorSetLayout layout) {
+// Floor for pools created before there's any usage to go by, per set
+static const VkDescriptorPoolSize DEFAULT_DESCRIPTORS_PER_SET[] = {
+    { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1 },
+    { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1 },
+    { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 },
+    { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2 },
+};
+
+bool DescriptorSetAllocator::alloc(VkDescriptorSet* descriptorSets, size_t setCount, VkDescriptorSetLayout layout,
+    const VkDescriptorSetLayoutBinding* bindings, size_t bindingCount) {
     assert(setCount > 0);
 
+    allocatedSets += setCount;
+    for (size_t i = 0; i < bindingCount; ++i) {
+        allocatedDescriptors[bindings[i].descriptorType] += (uint64_t)bindings[i].descriptorCount * setCount;
+    }
+
     // TODO: change alloca with allocation from arena?
     VkDescriptorSetLayout* layouts = (VkDescriptorSetLayout*) alloca(setCount * sizeof(VkDescriptorSetLayout));
     for (size_t i = 0; i < setCount; ++i) {
@@ -19,17 +36,194 @@ void DescriptorSetAllocator::alloc(VkDescriptorSet* descriptorSets, size_t setCo
     info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
     info.pNext = nullptr;
 
-    info.descriptorPool = pool;
     info.descriptorSetCount = setCount;
     info.pSetLayouts = layouts;
 
-    VK_CHECK(vkAllocateDescriptorSets(device, &info, descriptorSets));
+    // Recycled pools might not have enough left, but a freshly created one is sized to fit
+    while (true) {
+        bool freshPool = false;
+        if (currentPool == VK_NULL_HANDLE) {
+            if (!freePools.empty()) {
+                currentPool = freePools.back();
+                freePools.pop_back();
+            } else {
+                currentPool = createPool(setCount, bindings, bindingCount);
+                freshPool = true;
+                if (currentPool == VK_NULL_HANDLE) {
+                    return false;
+                }
+            }
+        }
+
+        info.descriptorPool = currentPool;
+        VkResult result = vkAllocateDescriptorSets(device, &info, descriptorSets);
+        if (result == VK_SUCCESS) {
+            return true;
+        }
+        if ((result != VK_ERROR_OUT_OF_POOL_MEMORY && result != VK_ERROR_FRAGMENTED_POOL) || freshPool) {
+            printf("Failed allocating %zu descriptor sets: %d\n", setCount, result);
+            return false;
+        }
+
+        usedPools.push_back(currentPool);
+        currentPool = VK_NULL_HANDLE;
+    }
+}
+
+VkDescriptorPool DescriptorSetAllocator::createPool(size_t setCount, const VkDescriptorSetLayoutBinding* bindings, size_t bindingCount) {
+    uint32_t maxSets = std::max<uint32_t>(nextPoolSets, setCount);
+    nextPoolSets = std::min(nextPoolSets * 2, MAX_POOL_SETS);
+
+    std::unordered_map<VkDescriptorType, uint64_t> descriptorCounts;
+    for (const VkDescriptorPoolSize& poolSize : DEFAULT_DESCRIPTORS_PER_SET) {
+        descriptorCounts[poolSize.type] = (uint64_t)poolSize.descriptorCount * maxSets;
+    }
+    // Same proportions as everything allocated so far
+    for (auto& allocated : allocatedDescriptors) {
+        uint64_t extrapolated = (allocated.second * maxSets + allocatedSets - 1) / allocatedSets;
+        descriptorCounts[allocated.first] = std::max(descriptorCounts[allocated.first], extrapolated);
+    }
+    // And at the very least the allocation that asked for the pool
+    std::unordered_map<VkDescriptorType, uint64_t> requested;
+    for (size_t i = 0; i < bindingCount; ++i) {
+        requested[bindings[i].descriptorType] += (uint64_t)bindings[i].descriptorCount * setCount;
+    }
+    for (auto& request : requested) {
+        descriptorCounts[request.first] = std::max(descriptorCounts[request.first], request.second);
+    }
+
+    std::vector<VkDescriptorPoolSize> poolSizes;
+    for (auto& descriptorCount : descriptorCounts) {
+        poolSizes.push_back({ descriptorCount.first, (uint32_t)descriptorCount.second });
+    }
+
+    VkDescriptorPoolCreateInfo poolCreateInfo = {};
+    poolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolCreateInfo.pNext = nullptr;
+    poolCreateInfo.flags = 0;
+    poolCreateInfo.maxSets = maxSets;
+    poolCreateInfo.poolSizeCount = poolSizes.size();
+    poolCreateInfo.pPoolSizes = poolSizes.data();
+
+    VkDescriptorPool pool;
+    if (vkCreateDescriptorPool(device, &poolCreateInfo, nullptr, &pool) != VK_SUCCESS) {
+        printf("Failed creating descriptor pool for %d sets\n", maxSets);
+        return VK_NULL_HANDLE;
+    }
+
+    return pool;
+}
+
+void DescriptorSetAllocator::reset() {
+    if (currentPool != VK_NULL_HANDLE) {
+        usedPools.push_back(currentPool);
+        currentPool = VK_NULL_HANDLE;
+    }
+
+    for (VkDescriptorPool pool : usedPools) {
+        vkResetDescriptorPool(device, pool, 0);
+        freePools.push_back(pool);
+    }
+    usedPools.clear();
+}
+
+void DescriptorSetAllocator::deinit() {
+    reset();
+
+    for (VkDescriptorPool pool : freePools) {
+        vkDestroyDescriptorPool(device, pool, nullptr);
+    }
+    freePools.clear();
+}
+
+DescriptorSetLayoutCache::DescriptorSetLayoutInfo::DescriptorSetLayoutInfo(const VkDescriptorSetLayoutCreateInfo& info) : flags(info.flags) {
+    bindings.assign(info.pBindings, info.pBindings + info.bindingCount);
+    std::sort(bindings.begin(), bindings.end(), [](const VkDescriptorSetLayoutBinding& a, const VkDescriptorSetLayoutBinding& b) {
+        return a.binding < b.binding;
+    });
+
+    for (VkDescriptorSetLayoutBinding& binding : bindings) {
+        if (binding.pImmutableSamplers != nullptr) {
+            immutableSamplers.insert(immutableSamplers.end(), binding.pImmutableSamplers, binding.pImmutableSamplers + binding.descriptorCount);
+            binding.pImmutableSamplers = nullptr;
+        }
+    }
+}
+
+bool DescriptorSetLayoutCache::DescriptorSetLayoutInfo::operator==(const DescriptorSetLayoutInfo& other) const {
+    if (flags != other.flags || bindings.size() != other.bindings.size() || immutableSamplers != other.immutableSamplers) {
+        return false;
+    }
+
+    for (size_t i = 0; i < bindings.size(); ++i) {
+        const VkDescriptorSetLayoutBinding& a = bindings[i];
+        const VkDescriptorSetLayoutBinding& b = other.bindings[i];
+        if (a.binding != b.binding || a.descriptorType != b.descriptorType
+            || a.descriptorCount != b.descriptorCount || a.stageFlags != b.stageFlags) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+size_t DescriptorSetLayoutCache::DescriptorSetLayoutInfo::hash() const {
+    uint64_t hash = hashBytes(&flags, sizeof(flags));
+    for (const VkDescriptorSetLayoutBinding& binding : bindings) {
+        uint32_t fields[] = { binding.binding, (uint32_t)binding.descriptorType, binding.descriptorCount, (uint32_t)binding.stageFlags };
+        hash = hashBytes(fields, sizeof(fields), hash);
+    }
+    hash = hashBytes(immutableSamplers.data(), immutableSamplers.size() * sizeof(VkSampler), hash);
+
+    return hash;
+}
+
+bool DescriptorSetLayoutCache::PipelineLayoutInfo::operator==(const PipelineLayoutInfo& other) const {
+    if (setLayouts != other.setLayouts || pushConstants.size() != other.pushConstants.size()) {
+        return false;
+    }
+
+    for (size_t i = 0; i < pushConstants.size(); ++i) {
+        const VkPushConstantRange& a = pushConstants[i];
+        const VkPushConstantRange& b = other.pushConstants[i];
+        if (a.stageFlags != b.stageFlags || a.offset != b.offset || a.size != b.size) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+size_t DescriptorSetLayoutCache::PipelineLayoutInfo::hash() const {
+    uint64_t hash = hashBytes(setLayouts.data(), setLayouts.size() * sizeof(VkDescriptorSetLayout));
+    for (const VkPushConstantRange& range : pushConstants) {
+        uint32_t fields[] = { (uint32_t)range.stageFlags, range.offset, range.size };
+        hash = hashBytes(fields, sizeof(fields), hash);
+    }
+
+    return hash;
 }
 
 std::optional<VkDescriptorSetLayout> DescriptorSetLayoutCache::getLayout(VkDescriptorSetLayoutCreateInfo* info) {
-    // TODO: actually cache it, fake it for the time being
-    VkDescriptorSetLayout& layout = layouts.emplace_back();
-    VK_CHECK(vkCreateDescriptorSetLayout(device, info, nullptr, &layout));
+    if (info->pNext != nullptr) {
+        VkDescriptorSetLayout& layout = uncachedLayouts.emplace_back();
+        VK_CHECK(vkCreateDescriptorSetLayout(device, info, nullptr, &layout));
+        return std::optional(layout);
+    }
+
+    DescriptorSetLayoutInfo layoutInfo(*info);
+    auto layoutFromCache = cache.find(layoutInfo);
+    if (layoutFromCache != cache.end()) {
+        return std::optional(layoutFromCache->second);
+    }
+
+    VkDescriptorSetLayout layout;
+    if (vkCreateDescriptorSetLayout(device, info, nullptr, &layout) != VK_SUCCESS) {
+        printf("Failed creating descriptor set layout\n");
+        return std::nullopt;
+    }
+    cache.emplace(std::move(layoutInfo), layout);
+
     return std::optional(layout);
 }
 
@@ -45,8 +239,80 @@ std::optional<VkDescriptorSetLayout> DescriptorSetLayoutCache::getLayout(VkDescr
     return getLayout(&info);
 }
 
+std::optional<VkPipelineLayout> DescriptorSetLayoutCache::getPipelineLayout(const VkDescriptorSetLayout* setLayouts, size_t setLayoutCount,
+    const VkPushConstantRange* pushConstants, size_t pushConstantCount) {
+    PipelineLayoutInfo layoutInfo;
+    layoutInfo.setLayouts.assign(setLayouts, setLayouts + setLayoutCount);
+    layoutInfo.pushConstants.assign(pushConstants, pushConstants + pushConstantCount);
+
+    auto layoutFromCache = pipelineLayouts.find(layoutInfo);
+    if (layoutFromCache != pipelineLayouts.end()) {
+        return std::optional(layoutFromCache->second);
+    }
+
+    VkPipelineLayoutCreateInfo info = layoutCreateInfo(layoutInfo.setLayouts.data(), layoutInfo.setLayouts.size());
+    info.pushConstantRangeCount = layoutInfo.pushConstants.size();
+    info.pPushConstantRanges = layoutInfo.pushConstants.data();
+
+    VkPipelineLayout layout;
+    if (vkCreatePipelineLayout(device, &info, nullptr, &layout) != VK_SUCCESS) {
+        printf("Failed creating pipeline layout\n");
+        return std::nullopt;
+    }
+    pipelineLayouts.emplace(std::move(layoutInfo), layout);
+
+    return std::optional(layout);
+}
+
+std::optional<VkDescriptorUpdateTemplate> DescriptorSetLayoutCache::getUpdateTemplate(VkDescriptorSetLayout layout,
+    const VkDescriptorSetLayoutBinding* bindings, size_t bindingCount) {
+    auto templateFromCache = updateTemplates.find(layout);
+    if (templateFromCache != updateTemplates.end()) {
+        return std::optional(templateFromCache->second);
+    }
+
+    VkDescriptorUpdateTemplateEntry* entries = (VkDescriptorUpdateTemplateEntry*) alloca(sizeof(VkDescriptorUpdateTemplateEntry) * bindingCount);
+    size_t offset = 0;
+    for (size_t i = 0; i < bindingCount; ++i) {
+        entries[i].dstBinding = bindings[i].binding;
+        entries[i].dstArrayElement = 0;
+        entries[i].descriptorCount = bindings[i].descriptorCount;
+        entries[i].descriptorType = bindings[i].descriptorType;
+        entries[i].offset = offset;
+        entries[i].stride = descriptorInfoSize(bindings[i].descriptorType);
+        offset += entries[i].stride * bindings[i].descriptorCount;
+    }
+
+    VkDescriptorUpdateTemplateCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_UPDATE_TEMPLATE_CREATE_INFO;
+    info.pNext = nullptr;
+    info.flags = 0;
+    info.descriptorUpdateEntryCount = bindingCount;
+    info.pDescriptorUpdateEntries = entries;
+    info.templateType = VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET;
+    info.descriptorSetLayout = layout;
+
+    VkDescriptorUpdateTemplate updateTemplate;
+    if (vkCreateDescriptorUpdateTemplate(device, &info, nullptr, &updateTemplate) != VK_SUCCESS) {
+        printf("Failed creating descriptor update template\n");
+        return std::nullopt;
+    }
+    updateTemplates[layout] = updateTemplate;
+
+    return std::optional(updateTemplate);
+}
+
 void DescriptorSetLayoutCache::deinit() {
-    for (auto layout : layouts) {
+    for (auto& updateTemplate : updateTemplates) {
+        vkDestroyDescriptorUpdateTemplate(device, updateTemplate.second, nullptr);
+    }
+    for (auto& layout : pipelineLayouts) {
+        vkDestroyPipelineLayout(device, layout.second, nullptr);
+    }
+    for (auto& layout : cache) {
+        vkDestroyDescriptorSetLayout(device, layout.second, nullptr);
+    }
+    for (auto layout : uncachedLayouts) {
         vkDestroyDescriptorSetLayout(device, layout, nullptr);
     }
 }
@@ -59,24 +325,38 @@ void DescriptorSetLayoutCache::deinit() {
     return builder;
 }
 
+size_t descriptorInfoSize(VkDescriptorType type) {
+    switch (type) {
+        case VK_DESCRIPTOR_TYPE_SAMPLER:
+        case VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER:
+        case VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE:
+        case VK_DESCRIPTOR_TYPE_STORAGE_IMAGE:
+        case VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT:
+            return sizeof(VkDescriptorImageInfo);
+        case VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER:
+        case VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER:
+            return sizeof(VkBufferView);
+        default:
+            return sizeof(VkDescriptorBufferInfo);
+    }
+}
+
 DescriptorSetBuilder& DescriptorSetBuilder::bindDuplicateBuffer(VkDescriptorBufferInfo* info, VkDescriptorType type, VkShaderStageFlags stageFlags, uint32_t binding) {
-    assert(binding == bindings.size());
+    assert(binding == bindingCount && bindingCount < MAX_BINDINGS);
 
-    bindings.push_back(descriptorSetLayoutBinding(type, stageFlags, binding));
-    for (size_t i = 0; i < setCount; ++i) {
-        writes.push_back(writeDescriptorBuffer(type, nullptr, info, binding)); // we will back-fill the dst set on build
-    }
+    bindings[bindingCount] = descriptorSetLayoutBinding(type, stageFlags, binding);
+    bindingInfos[bindingCount] = BindingInfos{ info, 0 };
+    bindingCount++;
 
     return *this;
 }
 
 DescriptorSetBuilder& DescriptorSetBuilder::bindDuplicateImage(VkDescriptorImageInfo* info, VkDescriptorType type, VkShaderStageFlags stageFlags, uint32_t binding) {
-    assert(binding == bindings.size());
+    assert(binding == bindingCount && bindingCount < MAX_BINDINGS);
 
-    bindings.push_back(descriptorSetLayoutBinding(type, stageFlags, binding));
-    for (size_t i = 0; i < setCount; ++i) {
-        writes.push_back(writeDescriptorImage(type, nullptr, info, binding)); // we will back-fill the dst set on build
-    }
+    bindings[bindingCount] = descriptorSetLayoutBinding(type, stageFlags, binding);
+    bindingInfos[bindingCount] = BindingInfos{ info, 0 };
+    bindingCount++;
 
     return *this;
 }
@@ -84,12 +364,11 @@ DescriptorSetBuilder& DescriptorSetBuilder::bindDuplicateImage(VkDescriptorImage
 DescriptorSetBuilder& DescriptorSetBuilder::bindBuffers(VkDescriptorBufferInfo* info, size_t infoCount, VkDescriptorType type, VkShaderStageFlags stageFlags, uint32_t binding) {
     // Otherwise what do we bind for remaining sets?
     assert(infoCount == setCount);
-    assert(binding == bindings.size());
+    assert(binding == bindingCount && bindingCount < MAX_BINDINGS);
 
-    bindings.push_back(descriptorSetLayoutBinding(type, stageFlags, binding));
-    for (size_t i = 0; i < infoCount; ++i) {
-        writes.push_back(writeDescriptorBuffer(type, nullptr, &info[i], binding)); // we will back-fill the dst set on build
-    }
+    bindings[bindingCount] = descriptorSetLayoutBinding(type, stageFlags, binding);
+    bindingInfos[bindingCount] = BindingInfos{ info, sizeof(VkDescriptorBufferInfo) };
+    bindingCount++;
 
     return *this;
 }
@@ -97,37 +376,70 @@ DescriptorSetBuilder& DescriptorSetBuilder::bindBuffers(VkDescriptorBufferInfo*
 DescriptorSetBuilder& DescriptorSetBuilder::bindImages(VkDescriptorImageInfo* info, size_t infoCount, VkDescriptorType type, VkShaderStageFlags stageFlags, uint32_t binding) {
     // Otherwise what do we bind for remaining sets?
     assert(infoCount == setCount);
-    assert(binding == bindings.size());
+    assert(binding == bindingCount && bindingCount < MAX_BINDINGS);
 
-    bindings.push_back(descriptorSetLayoutBinding(type, stageFlags, binding));
-    for (size_t i = 0; i < infoCount; ++i) {
-        writes.push_back(writeDescriptorImage(type, nullptr, &info[i], binding)); // we will back-fill the dst set on build
-    }
+    bindings[bindingCount] = descriptorSetLayoutBinding(type, stageFlags, binding);
+    bindingInfos[bindingCount] = BindingInfos{ info, sizeof(VkDescriptorImageInfo) };
+    bindingCount++;
 
     return *this;
 }
 
-VkDescriptorSetLayout DescriptorSetBuilder::build(VkDescriptorSet* descriptorSets, VkDescriptorSetLayoutCreateFlagBits flags) {
-    // Check for success
-    std::optional<VkDescriptorSetLayout> layout = layoutCache.getLayout(bindings.data(), bindings.size(), flags);
+std::optional<VkDescriptorSetLayout> DescriptorSetBuilder::layout(VkDescriptorSetLayoutCreateFlagBits flags) {
+    std::optional<VkDescriptorSetLayout> layout = layoutCache.getLayout(bindings, bindingCount, flags);
     if (!layout) {
-        // TODO: fix
         printf("Failed to fetch a layout\n");
-        return layout.value();
     }
 
-    // TODO: error handle
-    if (setCount > 0) {
-        allocator.alloc(descriptorSets, setCount, layout.value());
+    return layout;
+}
+
+bool DescriptorSetBuilder::write(const VkDescriptorSet* descriptorSets, VkDescriptorSetLayout layout) {
+    if (bindingCount == 0) {
+        return true;
     }
 
-    // Backfill with descriptor dstSets as we skipped that in binds
-    for (size_t i = 0; i < writes.size(); ++i) {
-        writes[i].dstSet = descriptorSets[i % setCount];
+    std::optional<VkDescriptorUpdateTemplate> updateTemplate = layoutCache.getUpdateTemplate(layout, bindings, bindingCount);
+    if (!updateTemplate) {
+        return false;
     }
-    if (writes.size() > 0) {
-        vkUpdateDescriptorSets(device, writes.size(), writes.data(), 0, nullptr);
+
+    // Packed the same way the template was created. Bindings built here always have a single descriptor
+    size_t dataSize = 0;
+    for (size_t i = 0; i < bindingCount; ++i) {
+        dataSize += descriptorInfoSize(bindings[i].descriptorType);
     }
+    char* data = (char*) alloca(dataSize);
+
+    for (size_t set = 0; set < setCount; ++set) {
+        char* dst = data;
+        for (size_t i = 0; i < bindingCount; ++i) {
+            size_t infoSize = descriptorInfoSize(bindings[i].descriptorType);
+            memcpy(dst, (const char*)bindingInfos[i].infos + bindingInfos[i].stride * set, infoSize);
+            dst += infoSize;
+        }
+
+        vkUpdateDescriptorSetWithTemplate(device, descriptorSets[set], updateTemplate.value(), data);
+    }
+
+    return true;
+}
+
+VkDescriptorSetLayout DescriptorSetBuilder::build(VkDescriptorSet* descriptorSets, VkDescriptorSetLayoutCreateFlagBits flags) {
+    // Check for success
+    std::optional<VkDescriptorSetLayout> setLayout = layout(flags);
+    if (!setLayout) {
+        // TODO: fix
+        return VK_NULL_HANDLE;
+    }
+
+    if (setCount > 0 && !allocator.alloc(descriptorSets, setCount, setLayout.value(), bindings, bindingCount)) {
+        // TODO: fix
+        printf("Failed to allocate descriptor sets\n");
+        return setLayout.value();
+    }
+
+    write(descriptorSets, setLayout.value());
 
-    return layout.value();
+    return setLayout.value();
 }
@@ -1,63 +1,123 @@
 #pragma once
 #include <optional>
 #include <stdint.h>
+#include <unordered_map>
 #include <vector>
 
 #include <vulkan/vulkan.h>
 
+// Allocates sets out of a chain of descriptor pools. Once a pool runs out it's put aside and the next
+// one is taken, either recycled or created with sizes extrapolated from what's been allocated so far, so
+// allocation never fails for lack of pool space. Sets can't be freed individually -- reset() recycles
+// all pools at once, which makes this usable as a per-frame allocator as well
 struct DescriptorSetAllocator {
+    static constexpr uint32_t INITIAL_POOL_SETS = 64;
+    static constexpr uint32_t MAX_POOL_SETS = 4096;
+
     VkDevice device;
-    // TODO: temporary, needs to allocate on itself, or by relying on some descriptor pool
-    VkDescriptorPool& pool;
 
-    DescriptorSetAllocator(VkDevice device, VkDescriptorPool& pool) : device(device), pool(pool) {}
-    void alloc(VkDescriptorSet* descriptorSets, size_t setCount, VkDescriptorSetLayout layout);
-    //DescriptorSetAllocation alloc(VkDescriptorSet* descriptorSet, VkDescriptorSetLayout layout);
+    VkDescriptorPool currentPool = VK_NULL_HANDLE;
+    std::vector<VkDescriptorPool> usedPools;
+    std::vector<VkDescriptorPool> freePools;
+    // Every new pool gets twice the sets of the last one, up to MAX_POOL_SETS
+    uint32_t nextPoolSets = INITIAL_POOL_SETS;
 
-    //void resetPools();
-};
+    // Observed usage, new pools get descriptors in the same proportion to sets
+    uint64_t allocatedSets = 0;
+    std::unordered_map<VkDescriptorType, uint64_t> allocatedDescriptors;
 
-struct DescriptorSetLayoutCache {
-    VkDevice device;
+    DescriptorSetAllocator(VkDevice device) : device(device) {}
+    // bindings of the layout, if given, go into the usage statistics and make sure a fresh pool fits them
+    bool alloc(VkDescriptorSet* descriptorSets, size_t setCount, VkDescriptorSetLayout layout,
+        const VkDescriptorSetLayoutBinding* bindings = nullptr, size_t bindingCount = 0);
 
-    //struct DescriptorSetLayoutInfoForHashing {
-    //    //VkDescriptorSetLayoutBinding* bindings;
-    //    //size_t count;
-    //    std::vector<VkDescriptorSetLayoutBinding> bindings;
-    //    VkDescriptorSetLayoutCreateFlags flags;
-
-    //    // TODO: give an allocator
-    //    DescriptorSetLayoutInfoForHashing(VkDescriptorSetLayoutInfo& info);
+    // Invalidates all sets allocated so far, pools are kept for reuse
+    void reset();
+    void deinit();
 
-    //    bool operator==(const DescriptorSetLayoutInfoForHashing& other) const;
-    //    size_t hash() const;
-    //}
+private:
+    VkDescriptorPool createPool(size_t setCount, const VkDescriptorSetLayoutBinding* bindings, size_t bindingCount);
+};
 
-    //struct DescriptorLayoutHash {
-    //    size_t operator()(const DescriptorSetLayoutInfoForHashing& info) const {
-    //        return info.hash();
-    //    }
-    //};
-    //std::unordered_map<DescriptorSetLayoutInfoForHashing, VkDescriptorSetLayout, DescriptorLayoutHash> cache;
+struct DescriptorSetLayoutCache {
+    VkDevice device;
 
-    // TODO: Contains all generated layouts. Need to move to a legit caching system
-    std::vector<VkDescriptorSetLayout> layouts;
+    // Everything that makes two set layouts compatible. Bindings are sorted as their order in the
+    // create info doesn't matter
+    struct DescriptorSetLayoutInfo {
+        // pImmutableSamplers are always null here, the samplers are copied into immutableSamplers
+        std::vector<VkDescriptorSetLayoutBinding> bindings;
+        std::vector<VkSampler> immutableSamplers;
+        VkDescriptorSetLayoutCreateFlags flags;
+
+        DescriptorSetLayoutInfo(const VkDescriptorSetLayoutCreateInfo& info);
+
+        bool operator==(const DescriptorSetLayoutInfo& other) const;
+        size_t hash() const;
+
+        struct Hash {
+            size_t operator()(const DescriptorSetLayoutInfo& info) const {
+                return info.hash();
+            }
+        };
+    };
+    std::unordered_map<DescriptorSetLayoutInfo, VkDescriptorSetLayout, DescriptorSetLayoutInfo::Hash> cache;
+    // Layouts with extension structs chained in can't be hashed, those are created every time
+    std::vector<VkDescriptorSetLayout> uncachedLayouts;
+
+    // Pipeline layouts are only a list of set layouts and push constant ranges, so with set layouts
+    // shared they can be shared just as well
+    struct PipelineLayoutInfo {
+        std::vector<VkDescriptorSetLayout> setLayouts;
+        std::vector<VkPushConstantRange> pushConstants;
+
+        bool operator==(const PipelineLayoutInfo& other) const;
+        size_t hash() const;
+
+        struct Hash {
+            size_t operator()(const PipelineLayoutInfo& info) const {
+                return info.hash();
+            }
+        };
+    };
+    std::unordered_map<PipelineLayoutInfo, VkPipelineLayout, PipelineLayoutInfo::Hash> pipelineLayouts;
+
+    // Layouts are shared by content, so the handle alone identifies the packing of the template data
+    std::unordered_map<VkDescriptorSetLayout, VkDescriptorUpdateTemplate> updateTemplates;
 
     DescriptorSetLayoutCache(VkDevice device) : device(device) {}
     std::optional<VkDescriptorSetLayout> getLayout(VkDescriptorSetLayoutCreateInfo* info);
     std::optional<VkDescriptorSetLayout> getLayout(VkDescriptorSetLayoutBinding* bindings, size_t bindingCount, VkDescriptorSetLayoutCreateFlags flags = (VkDescriptorSetLayoutCreateFlags)0);
+    std::optional<VkPipelineLayout> getPipelineLayout(const VkDescriptorSetLayout* setLayouts, size_t setLayoutCount,
+        const VkPushConstantRange* pushConstants = nullptr, size_t pushConstantCount = 0);
+    // Template data is the bindings' infos packed back to back in binding order, see descriptorInfoSize().
+    // bindings have to be the ones layout was created from
+    std::optional<VkDescriptorUpdateTemplate> getUpdateTemplate(VkDescriptorSetLayout layout, const VkDescriptorSetLayoutBinding* bindings, size_t bindingCount);
 
     void deinit();
 };
 
+// Size of the info struct a descriptor of type takes up in update template data
+size_t descriptorInfoSize(VkDescriptorType type);
+
+// Writes go through a cached update template, so building, e.g. the sets built anew every frame, is a
+// single vkUpdateDescriptorSetWithTemplate per set without any write arrays on the heap
 struct DescriptorSetBuilder {
+    static constexpr size_t MAX_BINDINGS = 16;
+
     VkDevice device;
     DescriptorSetLayoutCache& layoutCache;
     DescriptorSetAllocator& allocator;
 
     size_t setCount;
-    std::vector<VkDescriptorSetLayoutBinding> bindings;
-    std::vector<VkWriteDescriptorSet> writes; // set0Write0, set1Write0... setNWrite0, set0Write1, set1Write1... set1WriteN, etc
+    VkDescriptorSetLayoutBinding bindings[MAX_BINDINGS];
+    // Where the infos of each binding are read from on build. A stride of 0 reuses the same info for all sets
+    struct BindingInfos {
+        const void* infos;
+        size_t stride;
+    };
+    BindingInfos bindingInfos[MAX_BINDINGS];
+    size_t bindingCount = 0;
 
     static DescriptorSetBuilder begin(VkDevice device, DescriptorSetLayoutCache& layoutCache, DescriptorSetAllocator& allocator, size_t setCount = 1);
 
@@ -79,9 +139,13 @@ struct DescriptorSetBuilder {
     //DescriptorSetBuilder& bindImages();
     //DescriptorSetBuilder& bindViews();
 
+    // Allocates setCount sets and writes them
     VkDescriptorSetLayout build(VkDescriptorSet* descriptorSets, VkDescriptorSetLayoutCreateFlagBits flags = (VkDescriptorSetLayoutCreateFlagBits) 0);
 
 private:
+    std::optional<VkDescriptorSetLayout> layout(VkDescriptorSetLayoutCreateFlagBits flags);
+    bool write(const VkDescriptorSet* descriptorSets, VkDescriptorSetLayout layout);
+
     DescriptorSetBuilder(VkDevice device, DescriptorSetLayoutCache& layoutCache, DescriptorSetAllocator& allocator, size_t setCount) 
         : device(device), layoutCache(layoutCache), allocator(allocator), setCount(setCount) {}
 };
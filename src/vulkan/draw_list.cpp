@@ -0,0 +1,247 @@
+#include <cassert>
+#include <string.h>
+#include <utility>
+
+#include "vulkan/bindless.h"
+#include "vulkan/draw_list.h"
+#include "vulkan/engine.h"
+#include "vulkan/vk_shader.h"
+
+void DrawList::clear() {
+    draws.clear();
+    keys.clear();
+    alive.clear();
+    freeIds.clear();
+    bounds = BoundingSpheres();
+    inFrustum.clear();
+    entries.clear();
+    visible.clear();
+    batches.clear();
+    ++batchVersion;
+    dirty = false;
+}
+
+uint32_t DrawList::pipelineId(ShaderPass* shaderPass) {
+    auto id = pipelineIds.find(shaderPass);
+    if (id != pipelineIds.end()) {
+        return id->second;
+    }
+
+    // Running out only costs sorting quality, ids alias in the key but draws still carry their pass
+    uint32_t newId = pipelineIds.size();
+    pipelineIds.emplace(shaderPass, newId);
+    return newId;
+}
+
+DrawList::DrawId DrawList::add(uint32_t pass, uint32_t meshIndex, const Draw& draw, const glm::vec3& center, float radius) {
+    DrawId id;
+    if (!freeIds.empty()) {
+        id = freeIds.back();
+        freeIds.pop_back();
+    } else {
+        id = draws.size();
+        draws.emplace_back();
+        keys.emplace_back();
+        alive.push_back(false);
+    }
+
+    draws[id] = draw;
+    keys[id] = DrawKey::make(pass, pipelineId(draw.shaderPass), draw.materialIndex, meshIndex);
+    alive[id] = true;
+    bounds.set(id, center, radius);
+    dirty = true;
+
+    return id;
+}
+
+void DrawList::setBounds(DrawId id, const glm::vec3& center, float radius) {
+    assert(id < draws.size() && alive[id]);
+
+    bounds.set(id, center, radius);
+}
+
+void DrawList::cull(const Frustum& frustum) {
+    inFrustum.resize(bounds.size());
+    cullSpheres(frustum, bounds, inFrustum.data());
+}
+
+void DrawList::resetInFrustum() {
+    inFrustum.assign(bounds.size(), 0);
+}
+
+bool DrawList::intersects(DrawId id, const Frustum& frustum) const {
+    return frustum.intersectsSphere(glm::vec3(bounds.x[id], bounds.y[id], bounds.z[id]), bounds.radius[id]);
+}
+
+void DrawList::remove(DrawId id) {
+    assert(id < draws.size() && alive[id]);
+
+    alive[id] = false;
+    freeIds.push_back(id);
+    dirty = true;
+}
+
+bool DrawList::sort() {
+    if (!dirty) {
+        return false;
+    }
+
+    entries.clear();
+    for (DrawId id = 0; id < draws.size(); ++id) {
+        if (alive[id]) {
+            entries.push_back(Entry{ keys[id], id });
+        }
+    }
+    radixSort(entries, scratch);
+    dirty = false;
+
+    return true;
+}
+
+/*static*/ void DrawList::radixSort(std::vector<Entry>& entries, std::vector<Entry>& scratch) {
+    static constexpr uint32_t RADIX_BITS = 8;
+    static constexpr uint32_t BUCKET_COUNT = 1 << RADIX_BITS;
+    static constexpr uint32_t ROUND_COUNT = 64 / RADIX_BITS;
+
+    const size_t count = entries.size();
+    if (count < 2) {
+        return;
+    }
+    scratch.resize(count);
+
+    // All histograms in a single pass over the keys
+    uint32_t histograms[ROUND_COUNT][BUCKET_COUNT];
+    memset(histograms, 0, sizeof(histograms));
+    for (const Entry& entry : entries) {
+        for (uint32_t round = 0; round < ROUND_COUNT; ++round) {
+            ++histograms[round][(entry.key >> (round * RADIX_BITS)) & (BUCKET_COUNT - 1)];
+        }
+    }
+
+    Entry* src = entries.data();
+    Entry* dst = scratch.data();
+    for (uint32_t round = 0; round < ROUND_COUNT; ++round) {
+        uint32_t* histogram = histograms[round];
+        const uint32_t shift = round * RADIX_BITS;
+
+        // Every key has the same digit, the order wouldn't change
+        if (histogram[(src[0].key >> shift) & (BUCKET_COUNT - 1)] == count) {
+            continue;
+        }
+
+        uint32_t offset = 0;
+        for (uint32_t bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+            uint32_t bucketCount = histogram[bucket];
+            histogram[bucket] = offset;
+            offset += bucketCount;
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            dst[histogram[(src[i].key >> shift) & (BUCKET_COUNT - 1)]++] = src[i];
+        }
+        std::swap(src, dst);
+    }
+
+    if (src != entries.data()) {
+        entries.swap(scratch);
+    }
+}
+
+static bool sameMesh(const GeometryAllocation& a, const GeometryAllocation& b) {
+    return a.block == b.block && a.firstIndex == b.firstIndex && a.vertexOffset == b.vertexOffset && a.indexCount == b.indexCount;
+}
+
+void DrawList::batch(uint32_t maxInstances, uint32_t maxBatches) {
+    if (visible.size() > maxInstances) {
+        visible.resize(maxInstances);
+    }
+
+    batches.clear();
+    for (uint32_t i = 0; i < visible.size();) {
+        const Draw& draw = draws[visible[i]];
+
+        // Everything in between only differs in the object, keys put those next to each other
+        uint32_t end = i + 1;
+        while (end < visible.size()) {
+            const Draw& next = draws[visible[end]];
+            if (next.shaderPass != draw.shaderPass || next.materialIndex != draw.materialIndex || !sameMesh(next.geometry, draw.geometry)) {
+                break;
+            }
+            ++end;
+        }
+
+        if (batches.size() == maxBatches) {
+            visible.resize(i);
+            break;
+        }
+        batches.push_back(Batch{ draw.shaderPass, draw.materialIndex, draw.geometry, i, end - i });
+        i = end;
+    }
+    ++batchVersion;
+}
+
+/*static*/ void DrawList::bind(VkCommandBuffer cmd, const DrawListBindings& bindings, GeometryArena& geometry, const Batch& batch, BoundState& bound) {
+    ShaderPass* shaderPass = batch.shaderPass;
+    if (shaderPass->pipeline != bound.pipeline) {
+        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, shaderPass->pipeline);
+        bound.pipeline = shaderPass->pipeline;
+    }
+
+    // Sets stay bound across pipelines as long as the layouts are compatible. Passes with the same
+    // interface share their layout, so this only happens when the interface changes
+    if (shaderPass->info->layout != bound.layout) {
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, shaderPass->info->layout,
+            0, 1, &bindings.globalSet, 1, &bindings.sceneParamsOffset);
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, shaderPass->info->layout,
+            1, 1, &bindings.objectSet, 0, nullptr);
+        // All textures of all instances
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, shaderPass->info->layout,
+            BindlessResources::SET_INDEX, 1, &bindings.bindlessSet, 0, nullptr);
+        bound.layout = shaderPass->info->layout;
+    }
+
+    // Buffer bindings survive pipeline changes, so this only rebinds when crossing arena blocks
+    if (batch.geometry.block != bound.geometryBlock) {
+        geometry.bind(cmd, batch.geometry.block);
+        bound.geometryBlock = batch.geometry.block;
+    }
+}
+
+uint32_t DrawList::record(VkCommandBuffer cmd, const DrawListBindings& bindings, GeometryArena& geometry, GPUInstanceData* instances) const {
+    BoundState bound;
+    for (const Batch& batch : batches) {
+        for (uint32_t i = batch.first; i < batch.first + batch.count; ++i) {
+            instances[i].objectIndex = draws[visible[i]].objectIndex;
+            instances[i].materialIndex = batch.materialIndex;
+        }
+
+        bind(cmd, bindings, geometry, batch, bound);
+        // gl_InstanceIndex starts at firstInstance, so it indexes the instance buffer directly
+        vkCmdDrawIndexed(cmd, batch.geometry.indexCount, batch.count, batch.geometry.firstIndex,
+            batch.geometry.vertexOffset, batch.first);
+    }
+
+    return batches.size();
+}
+
+uint32_t DrawList::recordIndirect(VkCommandBuffer cmd, const DrawListBindings& bindings, GeometryArena& geometry, VkBuffer commands, VkDeviceSize offset) const {
+    BoundState bound;
+    uint32_t drawCallCount = 0;
+    for (uint32_t i = 0; i < batches.size();) {
+        const Batch& batch = batches[i];
+
+        uint32_t end = i + 1;
+        while (end < batches.size() && batches[end].shaderPass->pipeline == batch.shaderPass->pipeline
+            && batches[end].geometry.block == batch.geometry.block) {
+            ++end;
+        }
+
+        bind(cmd, bindings, geometry, batch, bound);
+        // Culled batches are left with an instance count of 0, which is cheaper than compacting
+        vkCmdDrawIndexedIndirect(cmd, commands, offset + i * sizeof(VkDrawIndexedIndirectCommand), end - i, sizeof(VkDrawIndexedIndirectCommand));
+        ++drawCallCount;
+        i = end;
+    }
+
+    return drawCallCount;
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "vulkan/culling.h"
+#include "vulkan/geometry.h"
+#include "vulkan/upload.h"
+
+// Sort key of a single draw, compared as a plain integer. Most significant first, so that sorting groups
+// draws by the state that is the most expensive to change:
+//   pass        4 bits
+//   pipeline   12 bits   (DrawList local id)
+//   material   16 bits   (bindless material table index)
+//   mesh       32 bits   (mesh instance index)
+// There's no view depth in it. Keys only get sorted when draws come or go, and draws of the same mesh end
+// up in one instanced draw anyway
+struct DrawKey {
+    static constexpr uint32_t PASS_BITS = 4;
+    static constexpr uint32_t PIPELINE_BITS = 12;
+    static constexpr uint32_t MATERIAL_BITS = 16;
+    static constexpr uint32_t MESH_BITS = 32;
+
+    static constexpr uint32_t MESH_SHIFT = 0;
+    static constexpr uint32_t MATERIAL_SHIFT = MESH_SHIFT + MESH_BITS;
+    static constexpr uint32_t PIPELINE_SHIFT = MATERIAL_SHIFT + MATERIAL_BITS;
+    static constexpr uint32_t PASS_SHIFT = PIPELINE_SHIFT + PIPELINE_BITS;
+    static_assert(PASS_SHIFT + PASS_BITS == 64, "Draw keys have to fill exactly 64 bits");
+
+    static uint64_t field(uint32_t value, uint32_t bits, uint32_t shift) {
+        return ((uint64_t)value & ((1ull << bits) - 1)) << shift;
+    }
+
+    static uint64_t make(uint32_t pass, uint32_t pipeline, uint32_t material, uint32_t mesh) {
+        return field(pass, PASS_BITS, PASS_SHIFT)
+            | field(pipeline, PIPELINE_BITS, PIPELINE_SHIFT)
+            | field(material, MATERIAL_BITS, MATERIAL_SHIFT)
+            | field(mesh, MESH_BITS, MESH_SHIFT);
+    }
+};
+
+struct ShaderPass;
+struct Draw {
+    ShaderPass* shaderPass;
+    uint32_t materialIndex;
+    uint32_t objectIndex;
+    GeometryAllocation geometry;
+    // Latest upload the draw depends on, it's filtered out until that retired
+    UploadTicket uploadTicket;
+    // Mesh space bounding sphere, w is the radius. GPU culling transforms it by the object's matrix itself
+    glm::vec4 meshBounds;
+};
+
+// Descriptor sets every pass of the scene binds the same way
+struct DrawListBindings {
+    VkDescriptorSet globalSet;
+    uint32_t sceneParamsOffset;
+    VkDescriptorSet objectSet;
+    VkDescriptorSet bindlessSet;
+};
+
+struct GeometryArena;
+struct GPUInstanceData;
+// Persistent flat array of draws with their sort keys and world bounds. The scene patches it as things get
+// added, removed or moved, it's only radix sorted again after additions or removals. The sorted draws get
+// filtered down to the visible ones and grouped into batches, which are recorded in key order as instanced
+// draws, skipping every bind that wouldn't change anything. Culling happens either on the CPU before
+// filtering, or on the GPU per batch with the draws recorded as indirect ones
+struct DrawList {
+    typedef uint32_t DrawId;
+
+    struct Entry {
+        uint64_t key;
+        uint32_t drawIndex;
+    };
+
+    // Indexed by DrawId. Removed draws leave holes that get reused by later additions
+    std::vector<Draw> draws;
+    std::vector<uint64_t> keys;
+    std::vector<bool> alive;
+    std::vector<DrawId> freeIds;
+    BoundingSpheres bounds;
+    // Result of the last cull(), padded like bounds
+    std::vector<uint8_t> inFrustum;
+
+    // Live draws in key order. Only valid while not dirty
+    std::vector<Entry> entries;
+    bool dirty = false;
+
+    // Indices into draws of the frame being recorded, in key order
+    std::vector<uint32_t> visible;
+
+    // Consecutive visible draws of the same mesh with the same material and pipeline, drawn as one
+    // instanced draw. Its instances are the ones at [first, first + count) in visible
+    struct Batch {
+        ShaderPass* shaderPass;
+        uint32_t materialIndex;
+        GeometryAllocation geometry;
+        uint32_t first;
+        uint32_t count;
+    };
+    std::vector<Batch> batches;
+    // Bumped by every batch(), so that GPU copies of the batches know when they're stale
+    uint64_t batchVersion = 0;
+
+    // Pipelines get small ids in order of first use, so that they fit into the key. Kept across clear()
+    std::unordered_map<ShaderPass*, uint32_t> pipelineIds;
+
+    DrawId add(uint32_t pass, uint32_t meshIndex, const Draw& draw, const glm::vec3& center, float radius);
+    void remove(DrawId id);
+    // When the object moved
+    void setBounds(DrawId id, const glm::vec3& center, float radius);
+    void clear();
+
+    // No-op unless draws were added or removed since the last call. Returns whether it sorted
+    bool sort();
+
+    // Tests the bounds of every draw, dead ones included since that's cheaper than skipping them
+    void cull(const Frustum& frustum);
+    // Nothing in the frustum, for callers that find the visible draws through some hierarchy and set them
+    // in inFrustum themselves
+    void resetInFrustum();
+    bool intersects(DrawId id, const Frustum& frustum) const;
+
+    // isVisible gets the index into draws
+    template<typename IsVisible>
+    void filter(IsVisible isVisible) {
+        visible.clear();
+        for (const Entry& entry : entries) {
+            if (isVisible(entry.drawIndex)) {
+                visible.push_back(entry.drawIndex);
+            }
+        }
+    }
+
+    // Groups visible into batches. Visible draws beyond maxInstances or maxBatches are dropped
+    void batch(uint32_t maxInstances, uint32_t maxBatches = UINT32_MAX);
+
+    // Draws every batch with all of its draws, writing their instance data to instances.
+    // Returns the number of draw calls recorded
+    uint32_t record(VkCommandBuffer cmd, const DrawListBindings& bindings, GeometryArena& geometry, GPUInstanceData* instances) const;
+    // Draws every batch from the VkDrawIndexedIndirectCommand at its index in commands past offset, as filled in
+    // by GPU culling. Consecutive batches of the same pipeline and geometry block share a single multi draw.
+    // Returns the number of draw calls recorded
+    uint32_t recordIndirect(VkCommandBuffer cmd, const DrawListBindings& bindings, GeometryArena& geometry, VkBuffer commands, VkDeviceSize offset = 0) const;
+
+    // LSD radix sort, 8 bits per round. Rounds in which all keys share the digit are skipped, which with
+    // mostly empty upper fields is most of them
+    static void radixSort(std::vector<Entry>& entries, std::vector<Entry>& scratch);
+
+private:
+    std::vector<Entry> scratch;
+
+    uint32_t pipelineId(ShaderPass* shaderPass);
+
+    // What record() and recordIndirect() last bound
+    struct BoundState {
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        VkPipelineLayout layout = VK_NULL_HANDLE;
+        uint32_t geometryBlock = UINT32_MAX;
+    };
+    static void bind(VkCommandBuffer cmd, const DrawListBindings& bindings, GeometryArena& geometry, const Batch& batch, BoundState& bound);
+};
@@ -11,14 +11,20 @@
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_vulkan.h"
 
+#include "vulkan/bindless.h"
 #include "vulkan/descriptors.h"
 #include "vulkan/engine.h"
+#include "vulkan/gpu_culling.h"
 #include "vulkan/mesh.h"
 #include "vulkan/vk_shader.h"
 #include "vulkan/vk_init_helpers.h"
 #include "vulkan/pipeline_builder.h"
+#include "vulkan/pipeline_cache.h"
 #include "vulkan/material.h"
 #include "vulkan/renderpass.h"
+#include "vulkan/shader_reload.h"
+#include "vulkan/thread_pool.h"
+#include "vulkan/upload.h"
 
 #define LOG_CALL(code) do {                                      \
         std::cout << "Calling: " #code << std::endl; \
@@ -92,25 +98,21 @@ VkExtent3D glfwFramebufferSize(GLFWwindow* window) {
 }
 
 void VulkanBackend::uploadMesh(Mesh& mesh) {
-    const size_t bufferSize = mesh.vertices.size() * sizeof(Vertex);
+    const size_t vertexBufferSize = mesh.vertexCount * sizeof(Vertex);
+    const size_t indexBufferSize = mesh.indexCount * sizeof(uint32_t);
 
-    AllocatedBuffer cpuBuffer = createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
-    uploadData(mesh.vertices.data(), bufferSize, 0, cpuBuffer.allocation);
+    mesh.geometry = geometry->alloc(mesh.vertexCount, mesh.indexCount);
+    GeometryBlock& block = geometry->blocks[mesh.geometry.block];
 
-    mesh.vertexBuffer = createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+    uploads->uploadBuffer(mesh.vertices, vertexBufferSize, block.vertexBuffer.buffer, mesh.geometry.vertexOffset * sizeof(Vertex));
+    // Might have ended up in a later batch than the vertices, and batches retire in order
+    mesh.uploadTicket = uploads->uploadBuffer(mesh.indices, indexBufferSize, block.indexBuffer.buffer, mesh.geometry.firstIndex * sizeof(uint32_t));
 
-    immediateBlockingSubmit([&](VkCommandBuffer cmd) {
-        VkBufferCopy copy = {};       
-        copy.srcOffset = 0;
-        copy.dstOffset = 0;
-        copy.size = bufferSize;
-        vkCmdCopyBuffer(cmd, cpuBuffer.buffer, mesh.vertexBuffer.buffer, 1, &copy);
-    });
-
-    deinitQueue.enqueue([=]() {
-        LOG_CALL(vmaDestroyBuffer(allocator, mesh.vertexBuffer.buffer, mesh.vertexBuffer.allocation));
-    });
-    vmaDestroyBuffer(allocator, cpuBuffer.buffer, cpuBuffer.allocation);
+    // Staged by now, and the model they point into is about to go away
+    mesh.vertices = nullptr;
+    mesh.vertexCount = 0;
+    mesh.indices = nullptr;
+    mesh.indexCount = 0;
 }
 
 void VulkanBackend::uploadData(const void* data, size_t size, size_t offset, VmaAllocation allocation) {
@@ -155,12 +157,35 @@ void VulkanBackend::initVulkan() {
         printf("Failed creating surface\n");
     }
 
+    // GPU culling draws every batch of a pipeline with one indirect call, each batch starting at its own instance
+    VkPhysicalDeviceFeatures requiredFeatures = {};
+    requiredFeatures.multiDrawIndirect = VK_TRUE;
+    requiredFeatures.drawIndirectFirstInstance = VK_TRUE;
+
+    // Bindless textures. Core only from 1.2 on, so 1.1 devices need the extension and these features
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT descriptorIndexingFeatures = {};
+    descriptorIndexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+    descriptorIndexingFeatures.pNext = nullptr;
+    descriptorIndexingFeatures.descriptorBindingPartiallyBound = VK_TRUE;
+    descriptorIndexingFeatures.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+    descriptorIndexingFeatures.descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+
+    // The selector checks the features against every device and enables them on the one it picks
     vkb::PhysicalDeviceSelector selector { vkbInstance };
-    vkb::PhysicalDevice physicalDevice = selector
+    auto physicalDeviceResult = selector
         .set_minimum_version(1, 1)
         .set_surface(surface)
-        .select()
-        .value();
+        .set_required_features(requiredFeatures)
+        .add_required_extension(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME)
+        .add_required_extension_features(descriptorIndexingFeatures)
+        .select();
+    if (!physicalDeviceResult) {
+        printf("No suitable GPU: %s. Needs multiDrawIndirect, drawIndirectFirstInstance and %s with partially bound, "
+            "sampled image update after bind and update unused while pending descriptors\n",
+            physicalDeviceResult.error().message().c_str(), VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+        assert(false);
+    }
+    vkb::PhysicalDevice physicalDevice = physicalDeviceResult.value();
     vkb::DeviceBuilder deviceBuilder { physicalDevice };
     VkPhysicalDeviceShaderDrawParametersFeatures shaderDrawParametersFeatures = {};
     shaderDrawParametersFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_DRAW_PARAMETERS_FEATURES;
@@ -176,11 +201,36 @@ void VulkanBackend::initVulkan() {
     graphicsQueue = vkbDevice.get_queue(vkb::QueueType::graphics).value();
     graphicsQueueFamily = vkbDevice.get_queue_index(vkb::QueueType::graphics).value();
 
+    // Prefer a transfer-only family (usually backed by the copy engines), then any family other than
+    // the graphics one, and share the graphics queue as a last resort
+    auto dedicatedTransferQueue = vkbDevice.get_dedicated_queue(vkb::QueueType::transfer);
+    auto separateTransferQueue = vkbDevice.get_queue(vkb::QueueType::transfer);
+    if (dedicatedTransferQueue.has_value()) {
+        transferQueue = dedicatedTransferQueue.value();
+        transferQueueFamily = vkbDevice.get_dedicated_queue_index(vkb::QueueType::transfer).value();
+    } else if (separateTransferQueue.has_value()) {
+        transferQueue = separateTransferQueue.value();
+        transferQueueFamily = vkbDevice.get_queue_index(vkb::QueueType::transfer).value();
+    } else {
+        transferQueue = graphicsQueue;
+        transferQueueFamily = graphicsQueueFamily;
+    }
+
     VmaAllocatorCreateInfo allocatorInfo = {};
     allocatorInfo.physicalDevice = gpu;   
     allocatorInfo.device = device;
     allocatorInfo.instance = instance;
     vmaCreateAllocator(&allocatorInfo, &allocator);
+
+    geometry = new GeometryArena(*this);
+    deinitQueue.enqueue([=]() {
+        LOG_CALL(geometry->deinit());
+    });
+
+    threadPool = new ThreadPool();
+    deinitQueue.enqueue([=]() {
+        LOG_CALL(threadPool->deinit());
+    });
 }
 
 void VulkanBackend::initSwapchain() {
@@ -227,14 +277,10 @@ void VulkanBackend::initCommandBuffers() {
         );
     });
 
-    VkCommandPoolCreateInfo uploadCmdPoolInfo = commandPoolCreateInfo(graphicsQueueFamily, 0);
-    VK_CHECK(vkCreateCommandPool(device, &uploadCmdPoolInfo, nullptr, &uploadCtx.cmdPool));
-
-    VkCommandBufferAllocateInfo uploadCmdAllocInfo = commandBufferAllocateInfo(1, VK_COMMAND_BUFFER_LEVEL_PRIMARY, uploadCtx.cmdPool);
-    VK_CHECK(vkAllocateCommandBuffers(device, &uploadCmdAllocInfo, &uploadCtx.cmdBuffer));
-
+    uploads = new UploadQueue(*this);
+    uploads->init();
     deinitQueue.enqueue([=]() {
-        LOG_CALL(vkDestroyCommandPool(device, uploadCtx.cmdPool, nullptr));
+        LOG_CALL(uploads->deinit());
     });
 }
 
@@ -276,7 +322,8 @@ void VulkanBackend::initDefaultRenderpass() {
         depthTexture->image.extent = viewportSize;
         depthTexture->mipCount = 1;
 
-        VkImageCreateInfo imgInfo = imageCreateInfo(VK_FORMAT_D32_SFLOAT, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, viewportSize);
+        // Sampled by GPU culling to build the depth pyramid
+        VkImageCreateInfo imgInfo = imageCreateInfo(VK_FORMAT_D32_SFLOAT, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, viewportSize);
 
         VmaAllocationCreateInfo imgAlloc = {};
         imgAlloc.usage = VMA_MEMORY_USAGE_GPU_ONLY;
@@ -311,6 +358,30 @@ void VulkanBackend::initDefaultRenderpass() {
         .build(device, *attachments);
     renderPasses.push_back(std::move(forwardRenderpass));
 
+    // Draws what occlusion culling's late phase found visible on top of the forward pass. Compatible with it,
+    // so the same pipelines work in both
+    uint32_t lateColorAttachment = attachments->add(RenderAttachments::defaultColorAttachmentDescription(false), colorAttachment);
+    uint32_t lateDepthAttachment = attachments->add(RenderAttachments::defaultDepthAttachmentDescription(false), depthAttachment);
+    RenderPass lateForwardRenderpass = RenderPassBuilder::begin("late forward pass")
+        .addAttachment(lateColorAttachment, "color output")
+        .addAttachment(lateDepthAttachment, "depth")
+        .addSubpass(VK_PIPELINE_BIND_POINT_GRAPHICS, {
+            RenderPassBuilder::SubpassAttachmentDesc(
+                lateColorAttachment,
+                VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+            ),
+            RenderPassBuilder::SubpassAttachmentDesc(
+                lateDepthAttachment,
+                VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+                VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT
+            ),
+        })
+        .build(device, *attachments);
+    renderPasses.push_back(std::move(lateForwardRenderpass));
+
     uint32_t preBlitOutputAttachment = attachments->add(RenderAttachments::defaultColorAttachmentDescription(false, true), colorAttachment);
     uint32_t outputAttachment = attachments->addOutput(swapchainImages, swapchainImageViews, swapchainImageFormat, viewportSize);
     outputRenderPass = new RenderPass("", false); // WHY CAN'T I HAVE UNINITIALIZED VARIABLES C++, HUHHHHHHH? And fuck your optionals too
@@ -357,16 +428,23 @@ void VulkanBackend::initSyncStructs() {
             }
         );
     });
-
-    VkFenceCreateInfo uploadFenceCreateInfo = fenceCreateInfo(0);
-    VK_CHECK(vkCreateFence(device, &uploadFenceCreateInfo, nullptr, &uploadCtx.uploadFence));
-    deinitQueue.enqueue([=](){
-        LOG_CALL(vkDestroyFence(device, uploadCtx.uploadFence, nullptr));
-    });
 }
 
 void VulkanBackend::draw() {
+    // Everything uploaded since the last frame goes out in one batch ahead of the frame. Whatever
+    // retired by now can be drawn
+    uploads->submit();
+    uploads->poll();
+
     VK_CHECK(vkWaitForFences(device, 1, &currentFrame().renderFence, true, 1000000000));
+    // Sets of the last time this frame was in flight aren't in use anymore
+    currentFrame().descriptorSetAllocator->reset();
+    geometry->update(frameNumber);
+    buildFrameDescriptors(currentFrame());
+    // Pipelines rebuilt from edited shaders get swapped in before anything binds them
+    if (shaderHotReload != nullptr) {
+        shaderHotReload->update(frameNumber);
+    }
 
     // TODO: render graph should handle renderpass dispatch. Cmd buffer recording can be done in parallel
     // For now let's just stupidly iterate through all renderpasses, let them fill in cmd buffers and then 
@@ -411,6 +489,9 @@ void VulkanBackend::draw() {
     VkCommandBufferBeginInfo cmdBeginInfo = commandBufferBeginInfo(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
     VK_CHECK(vkBeginCommandBuffer(cmd, &cmdBeginInfo));
 
+    // Culling might dispatch compute work
+    scene->prepare(cmd, currentFrame());
+
     VkRenderPassBeginInfo rpInfo = renderPasses[0].beginRenderPassInfo(swapchainImageIndex);
     vkCmdBeginRenderPass(cmd, &rpInfo, VK_SUBPASS_CONTENTS_INLINE);
 
@@ -419,6 +500,17 @@ void VulkanBackend::draw() {
     scene->draw(cmd, currentFrame());
     vkCmdEndRenderPass(cmd);
 
+    // Whatever occlusion culling held back but turned out visible against this frame's depth
+    if (scene->prepareLate(cmd, currentFrame())) {
+        rpInfo = renderPasses[1].beginRenderPassInfo(swapchainImageIndex);
+        vkCmdBeginRenderPass(cmd, &rpInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+        vkCmdSetViewport(cmd, 0, 1, &viewport);
+        vkCmdSetScissor(cmd, 0, 1, &scissor);
+        scene->drawLate(cmd, currentFrame());
+        vkCmdEndRenderPass(cmd);
+    }
+
     // TODO: record once and then reuse
     rpInfo = outputRenderPass->beginRenderPassInfo(swapchainImageIndex);
     vkCmdBeginRenderPass(cmd, &rpInfo, VK_SUBPASS_CONTENTS_INLINE);
@@ -476,86 +568,47 @@ void VulkanBackend::draw() {
     //printf("frame: %d\n", frameNumber);
 }
 
-void VulkanBackend::immediateBlockingSubmit(std::function<void(VkCommandBuffer)>&& func) {
-    VkCommandBufferBeginInfo beginInfo = commandBufferBeginInfo(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
-    VK_CHECK(vkBeginCommandBuffer(uploadCtx.cmdBuffer, &beginInfo));
-    func(uploadCtx.cmdBuffer);
-    VK_CHECK(vkEndCommandBuffer(uploadCtx.cmdBuffer));
-
-    VkSubmitInfo submit = submitInfo(&uploadCtx.cmdBuffer);
-    VK_CHECK(vkQueueSubmit(graphicsQueue, 1, &submit, uploadCtx.uploadFence));
-
-    vkWaitForFences(device, 1, &uploadCtx.uploadFence, true, 1000000000);
-    vkResetFences(device, 1, &uploadCtx.uploadFence);
-
-    vkResetCommandPool(device, uploadCtx.cmdPool, 0);
-}
-
 void VulkanBackend::initDescriptors() {
-    VkDescriptorPoolSize descriptorPoolSizes[] = {
-        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 10 },
-        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 10 },
-        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 10 },
-        { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1000 },
-    };
-
-    VkDescriptorPoolCreateInfo poolCreateInfo = {};
-    poolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    poolCreateInfo.pNext = nullptr;
-    poolCreateInfo.flags = 0;
-    poolCreateInfo.maxSets = 1000;
-    poolCreateInfo.poolSizeCount = sizeof(descriptorPoolSizes) / sizeof(VkDescriptorPoolSize);
-    poolCreateInfo.pPoolSizes = descriptorPoolSizes;
-
-    vkCreateDescriptorPool(device, &poolCreateInfo, nullptr, &descriptorPool);
+    descriptorSetAllocator = new DescriptorSetAllocator(device);
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        inFlightFrames[i].descriptorSetAllocator = new DescriptorSetAllocator(device);
+    }
     deinitQueue.enqueue([=]() {
-        LOG_CALL(vkDestroyDescriptorPool(device, descriptorPool, nullptr));
+        LOG_CALL(
+            descriptorSetAllocator->deinit();
+            for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+                inFlightFrames[i].descriptorSetAllocator->deinit();
+            }
+        );
     });
 
     descriptorSetLayoutCache = new DescriptorSetLayoutCache(device);
-    descriptorSetAllocator = new DescriptorSetAllocator(device, descriptorPool);
 
-    const int MAX_OBJECTS = 10000;
+    bindless = new BindlessResources(*this);
+    bindless->init();
+    deinitQueue.enqueue([=]() {
+        LOG_CALL(bindless->deinit());
+    });
+
     // Create buffers
     const size_t sceneParamsBuffersSize = MAX_FRAMES_IN_FLIGHT * padUniformBufferSize(sizeof(GPUSceneData));
     sceneParamsBuffers = createBuffer(sceneParamsBuffersSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
-    VkDescriptorBufferInfo sceneParamsDescriptorInfo = descriptorBufferInfo(sceneParamsBuffers.buffer, 0, sizeof(GPUSceneData));
     for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
         inFlightFrames[i].cameraUBO = createBuffer(sizeof(GPUCameraData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
         inFlightFrames[i].objectDataBuffer = createBuffer(sizeof(GPUObjectData) * MAX_OBJECTS, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+        inFlightFrames[i].instanceBuffer = createBuffer(sizeof(GPUInstanceData) * MAX_INSTANCES * 2, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
     }
 
-    // Generate infos
-    VkDescriptorBufferInfo cameraDescriptorInfos[MAX_FRAMES_IN_FLIGHT];
-    VkDescriptorBufferInfo objectDescriptorInfos[MAX_FRAMES_IN_FLIGHT];
-    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-        cameraDescriptorInfos[i] = descriptorBufferInfo(inFlightFrames[i].cameraUBO.buffer, 0, sizeof(GPUCameraData));
-        objectDescriptorInfos[i] = descriptorBufferInfo(inFlightFrames[i].objectDataBuffer.buffer, 0, sizeof(GPUObjectData) * MAX_OBJECTS);
-    }
-
-    // Build descriptor sets
-    // TODO: congregate into a single build
-    VkDescriptorSet cameraDescriptorSets[MAX_FRAMES_IN_FLIGHT];
-    globalDescriptorSetLayout = DescriptorSetBuilder::begin(device, *descriptorSetLayoutCache, *descriptorSetAllocator, MAX_FRAMES_IN_FLIGHT)
-        .bindBuffers(cameraDescriptorInfos, MAX_FRAMES_IN_FLIGHT, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 0)
-        .bindDuplicateBuffer(&sceneParamsDescriptorInfo, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_FRAGMENT_BIT, 1)
-        .build(cameraDescriptorSets);
-
-    VkDescriptorSet objectDescriptorSets[MAX_FRAMES_IN_FLIGHT];
-    objectDescriptorSetLayout = DescriptorSetBuilder::begin(device, *descriptorSetLayoutCache, *descriptorSetAllocator, MAX_FRAMES_IN_FLIGHT)
-        .bindBuffers(objectDescriptorInfos, MAX_FRAMES_IN_FLIGHT, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 0)
-        .build(objectDescriptorSets);
-
-    // TODO: temporarily write back descriptor sets until frame data is redone to SOA
+    // Layouts for the pipelines, the frames get their sets again each time they come around
     for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-        inFlightFrames[i].globalDescriptor = cameraDescriptorSets[i];
-        inFlightFrames[i].objectDescriptor = objectDescriptorSets[i]; 
+        buildFrameDescriptors(inFlightFrames[i]);
     }
 
     deinitQueue.enqueue([=]() {
         LOG_CALL(
             for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
                 vmaDestroyBuffer(allocator, inFlightFrames[i].objectDataBuffer.buffer, inFlightFrames[i].objectDataBuffer.allocation); 
+                vmaDestroyBuffer(allocator, inFlightFrames[i].instanceBuffer.buffer, inFlightFrames[i].instanceBuffer.allocation); 
                 vmaDestroyBuffer(allocator, inFlightFrames[i].cameraUBO.buffer, inFlightFrames[i].cameraUBO.allocation); 
             }
             vmaDestroyBuffer(allocator, sceneParamsBuffers.buffer, sceneParamsBuffers.allocation); 
@@ -564,12 +617,39 @@ void VulkanBackend::initDescriptors() {
     });
 }
 
+void VulkanBackend::buildFrameDescriptors(FrameData& frame) {
+    VkDescriptorBufferInfo cameraInfo = descriptorBufferInfo(frame.cameraUBO.buffer, 0, sizeof(GPUCameraData));
+    VkDescriptorBufferInfo sceneParamsInfo = descriptorBufferInfo(sceneParamsBuffers.buffer, 0, sizeof(GPUSceneData));
+    VkDescriptorBufferInfo objectInfo = descriptorBufferInfo(frame.objectDataBuffer.buffer, 0, sizeof(GPUObjectData) * MAX_OBJECTS);
+    VkDescriptorBufferInfo instanceInfo = descriptorBufferInfo(frame.instanceBuffer.buffer, 0, sizeof(GPUInstanceData) * MAX_INSTANCES * 2);
+
+    globalDescriptorSetLayout = DescriptorSetBuilder::begin(device, *descriptorSetLayoutCache, *frame.descriptorSetAllocator)
+        .bindBuffers(&cameraInfo, 1, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 0)
+        .bindBuffers(&sceneParamsInfo, 1, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_FRAGMENT_BIT, 1)
+        .build(&frame.globalDescriptor);
+
+    objectDescriptorSetLayout = DescriptorSetBuilder::begin(device, *descriptorSetLayoutCache, *frame.descriptorSetAllocator)
+        .bindBuffers(&objectInfo, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 0)
+        .bindBuffers(&instanceInfo, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 1)
+        .build(&frame.objectDescriptor);
+}
+
 void VulkanBackend::initPipelines() {
     textureCache = new TextureCache(*this);
+    pipelineCache = new PipelineCache();
+    pipelineCache->init(device, gpuProperties);
+    deinitQueue.enqueue([=]() {
+        LOG_CALL(pipelineCache->deinit());
+    });
+
     shaderModuleCache = new ShaderModuleCache(device);
-    shaderPassCache = new ShaderPassCache(device, *shaderModuleCache, *descriptorSetLayoutCache);
+    shaderPassCache = new ShaderPassCache(device, *shaderModuleCache, *descriptorSetLayoutCache, pipelineCache->cache);
     materials = new Materials(*shaderPassCache);
     samplerCache = new SamplerCache(*this);
+    deinitQueue.enqueue([=]() {
+        LOG_CALL(samplerCache->deinit());
+    });
+    bindless->initDefaultTexture();
 
     PipelineBuilder forwardPipelineBuilder;
     VertexInputDescription vertexDescription = Vertex::getVertexDescription();
@@ -582,7 +662,7 @@ void VulkanBackend::initPipelines() {
 
     // TODO: add error material
 
-    // TODO: pass these into shaders as specialization constants
+    // Have to match the shaders' set qualifiers, which GLSL doesn't allow specialization constants in
     const uint8_t SCENE_DESCRIPTOR_SET_INDEX = 0;
     const uint8_t OBJECT_DATA_DESCRIPTOR_SET_INDEX = 1;
 
@@ -607,6 +687,9 @@ void VulkanBackend::initPipelines() {
         },
         {
             sceneParamsDescriptorOverride,
+        },
+        {
+            { BindlessResources::SET_INDEX, bindless->layout },
         }));
 
 
@@ -646,15 +729,35 @@ void VulkanBackend::initPipelines() {
         printf("Failed creating material \"%s\" - failed retrieving shaders\n", "blit");
     }
 
-    // TODO: redo materials internals to support SoA for usage with vkCreateGraphicsPipelines
-    materials->buildQueued();
+    materials->buildQueued(threadPool);
+
+#ifdef DEBUG
+    // Runs after the thread pool is drained, nothing can be building anymore
+    shaderHotReload = new ShaderHotReload(device, *shaderModuleCache, *shaderPassCache, *threadPool, MAX_FRAMES_IN_FLIGHT);
+    deinitQueue.enqueue([=]() {
+        LOG_CALL(shaderHotReload->deinit());
+    });
+#endif //DEBUG
 
-    VkSamplerCreateInfo samplerInfo = samplerCreateInfo(VK_FILTER_NEAREST);
+    gpuCulling = new GPUCulling(*this);
+    if (gpuCulling->init(attachments->attachments[renderPasses[0].attachmentIndices[1]].textures[0])) {
+        deinitQueue.enqueue([=]() {
+            LOG_CALL(gpuCulling->deinit());
+        });
+        if (shaderHotReload != nullptr) {
+            shaderHotReload->watchCompute(&gpuCulling->pipeline, gpuCulling->info);
+            shaderHotReload->watchCompute(&gpuCulling->depthPyramid.pipeline, gpuCulling->depthPyramid.info);
+        }
+    } else {
+        delete gpuCulling;
+        gpuCulling = nullptr;
+    }
+
+    VkSamplerCreateInfo samplerInfo = samplerCreateInfo(VK_FILTER_NEAREST, VK_SAMPLER_ADDRESS_MODE_REPEAT, VK_LOD_CLAMP_NONE);
     CacheLoadResult<SampledTexture> defaultAlbedo = textureCache->load("/home/savas/Projects/ignoramus_renderer/assets/textures/default.jpeg", samplerInfo);
     if (defaultAlbedo.success) {
-        // TODO: mem leak
-        materials->materials[Materials::DEFAULT_LIT].defaultTextures["albedo"] = new SampledTexture();
-        *materials->materials[Materials::DEFAULT_LIT].defaultTextures["albedo"] = *defaultAlbedo.data;
+        // Owned by the texture cache
+        materials->materials[Materials::DEFAULT_LIT].defaultTextures["albedo"] = defaultAlbedo.data;
     } else {
         printf("failed creating default texture\n");
         assert(false);
@@ -718,9 +821,9 @@ void VulkanBackend::initImgui() {
     //ImGui_ImplVulkan_Init(&initInfo, renderPasses[0].renderPass);
     ImGui_ImplVulkan_Init(&initInfo, outputRenderPass->renderPass);
 
-    immediateBlockingSubmit([&](VkCommandBuffer cmd) {
-        ImGui_ImplVulkan_CreateFontsTexture(cmd);
-    });
+    // ImGui brings its own staging buffer, which it wants to free right away
+    ImGui_ImplVulkan_CreateFontsTexture(uploads->graphicsCommandBuffer());
+    uploads->flush();
     ImGui_ImplVulkan_DestroyFontUploadObjects();
 
     deinitQueue.enqueue([=]() {
@@ -736,8 +839,14 @@ FrameData& VulkanBackend::currentFrame() {
     return inFlightFrames[frameNumber % MAX_FRAMES_IN_FLIGHT];
 }
 
-AllocatedBuffer VulkanBackend::createBuffer(size_t size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage) {
+AllocatedBuffer VulkanBackend::createBuffer(size_t size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage, bool sharedWithTransfer) {
     VkBufferCreateInfo bufferInfo = bufferCreateInfo(size, usage);
+    uint32_t queueFamilies[] = { graphicsQueueFamily, transferQueueFamily };
+    if (sharedWithTransfer && transferQueueFamily != graphicsQueueFamily) {
+        bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        bufferInfo.queueFamilyIndexCount = 2;
+        bufferInfo.pQueueFamilyIndices = queueFamilies;
+    }
 
     VmaAllocationCreateInfo allocInfo = {};
     allocInfo.usage = memoryUsage;
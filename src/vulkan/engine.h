@@ -29,12 +29,6 @@
     }                                                              \
 } while (0)
 
-struct UploadContext {
-    VkFence uploadFence;
-    VkCommandPool cmdPool;
-    VkCommandBuffer cmdBuffer;
-};
-
 struct FunctionQueue {
     std::deque<std::function<void()>> functions;
 
@@ -60,12 +54,27 @@ struct GPUObjectData {
     glm::mat4 modelMatrix;
 };
 
+// Per drawn instance, has to match InstanceData of the forward shaders
+struct GPUInstanceData {
+    uint32_t objectIndex;
+    // Into the bindless material table
+    uint32_t materialIndex;
+};
+
+struct DescriptorSetAllocator;
 struct FrameData {
     AllocatedBuffer cameraUBO;
+    // Both allocated anew every time the frame comes around, see VulkanBackend::buildFrameDescriptors()
     VkDescriptorSet globalDescriptor;
 
     AllocatedBuffer objectDataBuffer;
+    // GPUInstanceData per drawn instance, instanced draws index it with gl_InstanceIndex. Same set as the object data.
+    // Written by the CPU or by GPU culling. GPU culling's late phase gets the upper MAX_INSTANCES
+    // TODO: GPU culling would rather have it device local
+    AllocatedBuffer instanceBuffer;
     VkDescriptorSet objectDescriptor;
+    // Objects whose data changed since this frame was last in flight
+    std::vector<uint32_t> dirtyObjects;
 
     VkSemaphore presentSem;
     VkSemaphore renderSem;
@@ -73,17 +82,29 @@ struct FrameData {
 
     VkCommandPool cmdPool;
     VkCommandBuffer cmdBuffer;
+
+    // Transient sets, reset wholesale once the frame's fence is signaled
+    DescriptorSetAllocator* descriptorSetAllocator;
 };
 
 struct RenderAttachments;
+struct GeometryArena;
+struct UploadQueue;
+struct ThreadPool;
 struct DescriptorSetLayoutCache;
-struct DescriptorSetAllocator;
+struct BindlessResources;
+struct PipelineCache;
 struct ShaderModuleCache;
 struct ShaderPassCache;
+struct ShaderHotReload;
+struct GPUCulling;
 struct Materials;
 struct RenderPass;
 struct VulkanBackend { 
     static constexpr int MAX_FRAMES_IN_FLIGHT = 2;
+    static constexpr int MAX_OBJECTS = 10000;
+    // Instances across all draws of a frame
+    static constexpr int MAX_INSTANCES = 1 << 16;
     FrameData inFlightFrames[MAX_FRAMES_IN_FLIGHT];
 
     VkViewport viewport;
@@ -101,8 +122,6 @@ struct VulkanBackend {
 
     Scene* scene;
 
-    UploadContext uploadCtx;
-
     vkb::Instance vkbInstance;
     VkInstance instance;
     VkDebugUtilsMessengerEXT debugMessenger;
@@ -121,6 +140,9 @@ struct VulkanBackend {
 
     VkQueue graphicsQueue;
     uint32_t graphicsQueueFamily;
+    // Same as the graphics queue if the device has no other family supporting transfers
+    VkQueue transferQueue;
+    uint32_t transferQueueFamily;
 
     VmaAllocator allocator;
 
@@ -130,11 +152,23 @@ struct VulkanBackend {
 
     RenderAttachments* attachments;
 
+    UploadQueue* uploads;
+    GeometryArena* geometry;
+
+    // Shared by CPU side asset processing
+    ThreadPool* threadPool;
+
     DescriptorSetLayoutCache* descriptorSetLayoutCache;
     DescriptorSetAllocator* descriptorSetAllocator;
+    BindlessResources* bindless;
 
+    PipelineCache* pipelineCache;
     ShaderModuleCache* shaderModuleCache;
     ShaderPassCache* shaderPassCache;
+    // Debug builds only
+    ShaderHotReload* shaderHotReload = nullptr;
+    // nullptr if the culling shader failed to load
+    GPUCulling* gpuCulling = nullptr;
     SamplerCache* samplerCache;
 
     TextureCache* textureCache;
@@ -148,7 +182,6 @@ struct VulkanBackend {
     // TODO: should be stored along with the descriptor set
     VkDescriptorSetLayout globalDescriptorSetLayout;
     VkDescriptorSetLayout objectDescriptorSetLayout;
-    VkDescriptorPool descriptorPool;
 
     static void framebufferResizeCallback(GLFWwindow* window, int width, int height);
     void registerCallbacks();
@@ -162,6 +195,8 @@ struct VulkanBackend {
     void initDefaultRenderpass();
     void initSyncStructs();
     void initDescriptors();
+    // Global and object sets out of the frame's transient allocator, once it's been reset
+    void buildFrameDescriptors(FrameData& frame);
     void initPipelines();
     void initImgui();
 
@@ -170,10 +205,9 @@ struct VulkanBackend {
 
     void draw();
 
-    void immediateBlockingSubmit(std::function<void(VkCommandBuffer)>&& func);
-
     FrameData& currentFrame();
 
-    AllocatedBuffer createBuffer(size_t size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage);
+    // Buffers the upload queue writes into have to be shared with the transfer queue family
+    AllocatedBuffer createBuffer(size_t size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage, bool sharedWithTransfer = false);
     size_t padUniformBufferSize(size_t requestedSize);
 };
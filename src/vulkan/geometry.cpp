@@ -0,0 +1,127 @@
+#include <assert.h>
+#include <algorithm>
+
+#include "vulkan/engine.h"
+#include "vulkan/geometry.h"
+#include "vulkan/mesh.h"
+
+std::optional<uint32_t> RangeAllocator::alloc(uint32_t count) {
+    for (size_t i = 0; i < freeRanges.size(); ++i) {
+        Range& range = freeRanges[i];
+        if (range.count < count) {
+            continue;
+        }
+
+        uint32_t offset = range.offset;
+        range.offset += count;
+        range.count -= count;
+        if (range.count == 0) {
+            freeRanges.erase(freeRanges.begin() + i);
+        }
+
+        return offset;
+    }
+
+    return std::nullopt;
+}
+
+void RangeAllocator::free(uint32_t offset, uint32_t count) {
+    if (count == 0) {
+        return;
+    }
+    assert(offset + count <= capacity);
+
+    auto next = std::lower_bound(freeRanges.begin(), freeRanges.end(), offset, [](const Range& range, uint32_t offset) {
+        return range.offset < offset;
+    });
+    auto inserted = freeRanges.insert(next, Range{ offset, count });
+
+    // Merge with the following range
+    auto following = inserted + 1;
+    if (following != freeRanges.end() && inserted->offset + inserted->count == following->offset) {
+        inserted->count += following->count;
+        freeRanges.erase(following);
+    }
+
+    // Merge with the preceding range
+    if (inserted != freeRanges.begin()) {
+        auto preceding = inserted - 1;
+        if (preceding->offset + preceding->count == inserted->offset) {
+            preceding->count += inserted->count;
+            freeRanges.erase(inserted);
+        }
+    }
+}
+
+GeometryAllocation GeometryArena::alloc(uint32_t vertexCount, uint32_t indexCount) {
+    GeometryAllocation allocation = {};
+    allocation.vertexCount = vertexCount;
+    allocation.indexCount = indexCount;
+
+    for (uint32_t i = 0; i < blocks.size(); ++i) {
+        std::optional<uint32_t> vertexOffset = blocks[i].vertices.alloc(vertexCount);
+        if (!vertexOffset) {
+            continue;
+        }
+        std::optional<uint32_t> firstIndex = blocks[i].indices.alloc(indexCount);
+        if (!firstIndex) {
+            blocks[i].vertices.free(vertexOffset.value(), vertexCount);
+            continue;
+        }
+
+        allocation.block = i;
+        allocation.vertexOffset = vertexOffset.value();
+        allocation.firstIndex = firstIndex.value();
+        return allocation;
+    }
+
+    // Nothing fits -- meshes bigger than the default block size get a block of their own
+    allocation.block = addBlock(std::max(vertexCount, DEFAULT_BLOCK_VERTEX_COUNT), std::max(indexCount, DEFAULT_BLOCK_INDEX_COUNT));
+    allocation.vertexOffset = blocks[allocation.block].vertices.alloc(vertexCount).value();
+    allocation.firstIndex = blocks[allocation.block].indices.alloc(indexCount).value();
+
+    return allocation;
+}
+
+void GeometryArena::free(GeometryAllocation allocation, uint64_t frameNumber) {
+    assert(allocation.block < blocks.size());
+    pendingFrees.push_back(PendingFree{ frameNumber, allocation });
+}
+
+void GeometryArena::update(uint64_t frameNumber) {
+    // Same as with anything else retired at a frame, see ShaderHotReload::update()
+    while (!pendingFrees.empty() && pendingFrees.front().frame + VulkanBackend::MAX_FRAMES_IN_FLIGHT < frameNumber) {
+        const GeometryAllocation& allocation = pendingFrees.front().allocation;
+        blocks[allocation.block].vertices.free(allocation.vertexOffset, allocation.vertexCount);
+        blocks[allocation.block].indices.free(allocation.firstIndex, allocation.indexCount);
+        pendingFrees.pop_front();
+    }
+}
+
+void GeometryArena::bind(VkCommandBuffer cmd, uint32_t block) {
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(cmd, 0, 1, &blocks[block].vertexBuffer.buffer, &offset);
+    vkCmdBindIndexBuffer(cmd, blocks[block].indexBuffer.buffer, 0, INDEX_TYPE);
+}
+
+void GeometryArena::deinit() {
+    for (GeometryBlock& block : blocks) {
+        vmaDestroyBuffer(backend.allocator, block.vertexBuffer.buffer, block.vertexBuffer.allocation);
+        vmaDestroyBuffer(backend.allocator, block.indexBuffer.buffer, block.indexBuffer.allocation);
+    }
+    blocks.clear();
+    pendingFrees.clear();
+}
+
+uint32_t GeometryArena::addBlock(uint32_t vertexCapacity, uint32_t indexCapacity) {
+    GeometryBlock block {
+        // Uploads into one range run on the transfer queue while the graphics queue draws from others
+        backend.createBuffer(vertexCapacity * sizeof(Vertex), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, true),
+        backend.createBuffer(indexCapacity * sizeof(uint32_t), VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, true),
+        RangeAllocator(vertexCapacity),
+        RangeAllocator(indexCapacity),
+    };
+    blocks.push_back(std::move(block));
+
+    return blocks.size() - 1;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <deque>
+#include <optional>
+#include <stdint.h>
+#include <vector>
+
+#include "vulkan/types.h"
+
+// First-fit sub-allocator over [0, capacity). Free ranges are kept sorted by offset so that
+// neighbours can be merged back together on free
+struct RangeAllocator {
+    struct Range {
+        uint32_t offset;
+        uint32_t count;
+    };
+
+    uint32_t capacity;
+    std::vector<Range> freeRanges;
+
+    RangeAllocator(uint32_t capacity) : capacity(capacity), freeRanges({ Range{ 0, capacity } }) {}
+
+    std::optional<uint32_t> alloc(uint32_t count);
+    void free(uint32_t offset, uint32_t count);
+};
+
+// Where a mesh lives in the arena. Offsets are in elements, so they can be passed
+// straight to vkCmdDrawIndexed as vertexOffset/firstIndex
+struct GeometryAllocation {
+    uint32_t block;
+    uint32_t vertexOffset;
+    uint32_t vertexCount;
+    uint32_t firstIndex;
+    uint32_t indexCount;
+};
+
+struct GeometryBlock {
+    AllocatedBuffer vertexBuffer;
+    AllocatedBuffer indexBuffer;
+
+    RangeAllocator vertices;
+    RangeAllocator indices;
+};
+
+struct VulkanBackend;
+// All mesh geometry is sub-allocated from a handful of big vertex/index buffer pairs, so that draws
+// only have to rebind buffers when crossing a block boundary. Indices are always 32 bit -- mixing index
+// types would mean rebinding the index buffer per mesh again.
+// Freed ranges go back to their block's free list, merged with free neighbours, once no frame in flight
+// can draw from them anymore
+struct GeometryArena {
+    static constexpr uint32_t DEFAULT_BLOCK_VERTEX_COUNT = 1 << 20;
+    static constexpr uint32_t DEFAULT_BLOCK_INDEX_COUNT = 1 << 22;
+    static constexpr VkIndexType INDEX_TYPE = VK_INDEX_TYPE_UINT32;
+
+    VulkanBackend& backend;
+    std::vector<GeometryBlock> blocks;
+
+    GeometryArena(VulkanBackend& backend) : backend(backend) {}
+
+    GeometryAllocation alloc(uint32_t vertexCount, uint32_t indexCount);
+    // Draws recorded up to frameNumber might still use the allocation
+    void free(GeometryAllocation allocation, uint64_t frameNumber);
+    // Hands back what frames done by now freed. Has to be called once the current frame's fence is signaled
+    void update(uint64_t frameNumber);
+
+    void bind(VkCommandBuffer cmd, uint32_t block);
+
+    void deinit();
+
+private:
+    struct PendingFree {
+        uint64_t frame;
+        GeometryAllocation allocation;
+    };
+    std::deque<PendingFree> pendingFrees;
+
+    uint32_t addBlock(uint32_t vertexCapacity, uint32_t indexCapacity);
+};
@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <string>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "tiny_gltf.h"
+
+#include "vulkan/mesh.h"
+
+// We feed textures through TextureCache by path, so there's no point in tinygltf decoding
+// every image up front
+static bool skipImageData(tinygltf::Image* image, const int imageIndex, std::string* err, std::string* warn,
+    int reqWidth, int reqHeight, const unsigned char* bytes, int size, void* userData) {
+    return true;
+}
+
+// Strided accessor view. Sparse accessors are not supported
+struct GltfAccessorView {
+    const unsigned char* data = nullptr;
+    size_t stride = 0;
+    size_t count = 0;
+    int componentType = -1;
+    bool normalized = false;
+
+    GltfAccessorView(const tinygltf::Model& gltf, int accessorIndex, int expectedType) {
+        if (accessorIndex < 0 || accessorIndex >= (int)gltf.accessors.size()) {
+            return;
+        }
+        const tinygltf::Accessor& accessor = gltf.accessors[accessorIndex];
+        if (accessor.type != expectedType || accessor.bufferView < 0 || accessor.sparse.isSparse) {
+            return;
+        }
+        if (accessor.bufferView >= (int)gltf.bufferViews.size()) {
+            return;
+        }
+        const tinygltf::BufferView& bufferView = gltf.bufferViews[accessor.bufferView];
+        if (bufferView.buffer < 0 || bufferView.buffer >= (int)gltf.buffers.size()) {
+            return;
+        }
+        const tinygltf::Buffer& buffer = gltf.buffers[bufferView.buffer];
+
+        // Malformed assets get rejected here, so that reads through the view can't leave the buffer
+        int byteStride = accessor.ByteStride(bufferView);
+        int componentSize = tinygltf::GetComponentSizeInBytes(accessor.componentType);
+        int componentCount = tinygltf::GetNumComponentsInType(accessor.type);
+        if (byteStride <= 0 || componentSize <= 0 || componentCount <= 0
+            || bufferView.byteOffset + bufferView.byteLength > buffer.data.size()) {
+            return;
+        }
+        size_t elementSize = (size_t)componentSize * componentCount;
+        if (accessor.count > 0 && accessor.byteOffset + (accessor.count - 1) * (size_t)byteStride + elementSize > bufferView.byteLength) {
+            return;
+        }
+
+        componentType = accessor.componentType;
+        normalized = accessor.normalized;
+        count = accessor.count;
+        stride = byteStride;
+        data = buffer.data.data() + bufferView.byteOffset + accessor.byteOffset;
+    }
+
+    bool valid() const {
+        return data != nullptr;
+    }
+
+    float component(size_t element, size_t component) const {
+        const unsigned char* ptr = data + element * stride;
+        switch (componentType) {
+            case TINYGLTF_COMPONENT_TYPE_FLOAT:
+                return ((const float*)ptr)[component];
+            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+                return ((const uint8_t*)ptr)[component] / (normalized ? 255.f : 1.f);
+            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+                return ((const uint16_t*)ptr)[component] / (normalized ? 65535.f : 1.f);
+            default:
+                return 0.f;
+        }
+    }
+
+    uint32_t index(size_t element) const {
+        const unsigned char* ptr = data + element * stride;
+        switch (componentType) {
+            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+                return *(const uint8_t*)ptr;
+            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+                return *(const uint16_t*)ptr;
+            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+                return *(const uint32_t*)ptr;
+            default:
+                return 0;
+        }
+    }
+};
+
+static std::string gltfTexturePath(const tinygltf::Model& gltf, const std::string& baseDir, int textureIndex) {
+    if (textureIndex < 0 || textureIndex >= (int)gltf.textures.size()) {
+        return "";
+    }
+
+    int imageIndex = gltf.textures[textureIndex].source;
+    if (imageIndex < 0 || imageIndex >= (int)gltf.images.size()) {
+        return "";
+    }
+
+    // TODO: images embedded into buffers (usually .glb) would need TextureCache to load from memory.
+    // Until then those fall back to material defaults
+    const tinygltf::Image& image = gltf.images[imageIndex];
+    if (image.uri.empty() || image.uri.rfind("data:", 0) == 0) {
+        return "";
+    }
+
+    return baseDir + image.uri;
+}
+
+static glm::mat4 gltfLocalTransform(const tinygltf::Node& node) {
+    if (node.matrix.size() == 16) {
+        return glm::mat4(glm::make_mat4(node.matrix.data()));
+    }
+
+    glm::mat4 transform(1.f);
+    if (node.translation.size() == 3) {
+        transform = glm::translate(transform, glm::vec3(glm::make_vec3(node.translation.data())));
+    }
+    if (node.rotation.size() == 4) {
+        // glTF stores xyzw, glm's constructor takes wxyz
+        transform *= glm::mat4_cast(glm::quat((float)node.rotation[3], (float)node.rotation[0], (float)node.rotation[1], (float)node.rotation[2]));
+    }
+    if (node.scale.size() == 3) {
+        transform = glm::scale(transform, glm::vec3(glm::make_vec3(node.scale.data())));
+    }
+
+    return transform;
+}
+
+struct GltfMeshRange {
+    uint32_t firstMesh;
+    uint32_t meshCount;
+};
+
+static void flattenGltfNode(const tinygltf::Model& gltf, int nodeIndex, const glm::mat4& parentTransform,
+    const std::vector<GltfMeshRange>& meshRanges, std::vector<ModelNode>& nodes, uint32_t depth = 0) {
+    // Guards against malformed files with cycles
+    if (nodeIndex < 0 || nodeIndex >= (int)gltf.nodes.size() || depth > 256) {
+        return;
+    }
+    const tinygltf::Node& gltfNode = gltf.nodes[nodeIndex];
+    glm::mat4 transform = parentTransform * gltfLocalTransform(gltfNode);
+
+    if (gltfNode.mesh >= 0 && gltfNode.mesh < (int)meshRanges.size() && meshRanges[gltfNode.mesh].meshCount > 0) {
+        ModelNode& node = nodes.emplace_back();
+        node.firstMesh = meshRanges[gltfNode.mesh].firstMesh;
+        node.meshCount = meshRanges[gltfNode.mesh].meshCount;
+
+        // Decompose into the TRS that ObjectData expects. Shear is lost
+        node.position = glm::vec3(transform[3]);
+        node.scale = glm::vec3(glm::length(glm::vec3(transform[0])), glm::length(glm::vec3(transform[1])), glm::length(glm::vec3(transform[2])));
+        node.rotation = glm::mat4(1.f);
+        for (int i = 0; i < 3; ++i) {
+            node.rotation[i] = node.scale[i] != 0.f ? glm::vec4(glm::vec3(transform[i]) / node.scale[i], 0.f) : glm::vec4(0.f);
+        }
+    }
+
+    for (int child : gltfNode.children) {
+        flattenGltfNode(gltf, child, transform, meshRanges, nodes, depth + 1);
+    }
+}
+
+bool Model::loadFromGltf(const char* filename) {
+    name = filename;
+
+    std::string path(filename);
+    std::string baseDir = path.substr(0, path.find_last_of("/\\") + 1);
+    bool binary = path.size() >= 4 && path.compare(path.size() - 4, 4, ".glb") == 0;
+
+    tinygltf::TinyGLTF loader;
+    loader.SetImageLoader(skipImageData, nullptr);
+
+    tinygltf::Model gltf;
+    std::string warn;
+    std::string err;
+    bool loaded = binary
+        ? loader.LoadBinaryFromFile(&gltf, &err, &warn, path)
+        : loader.LoadASCIIFromFile(&gltf, &err, &warn, path);
+    if (!warn.empty()) {
+        //printf("WARN: %s\n", warn.c_str());
+    }
+    if (!loaded || !err.empty()) {
+        printf("Failed loading glTF %s: %s\n", filename, err.c_str());
+        return false;
+    }
+
+    // The cooked cache only checks the file itself, edits to external buffers would go unnoticed.
+    // Images don't matter, textures are loaded by path and never cooked
+    bool selfContained = true;
+    for (const tinygltf::Buffer& buffer : gltf.buffers) {
+        if (!buffer.uri.empty() && buffer.uri.rfind("data:", 0) != 0) {
+            selfContained = false;
+        }
+    }
+
+    // Views can only be set up once the storage stops growing
+    std::vector<uint32_t> firstVertices;
+    std::vector<uint32_t> firstIndices;
+
+    // Every primitive becomes a Mesh. Primitives of a glTF mesh end up next to each other, so nodes can
+    // reference them as a range
+    std::vector<GltfMeshRange> meshRanges(gltf.meshes.size());
+    for (size_t m = 0; m < gltf.meshes.size(); ++m) {
+        const tinygltf::Mesh& gltfMesh = gltf.meshes[m];
+        meshRanges[m].firstMesh = meshes.size();
+
+        for (size_t p = 0; p < gltfMesh.primitives.size(); ++p) {
+            const tinygltf::Primitive& primitive = gltfMesh.primitives[p];
+            if (primitive.mode != TINYGLTF_MODE_TRIANGLES && primitive.mode != -1) {
+                printf("Skipping non-triangle primitive %zu of mesh \"%s\"\n", p, gltfMesh.name.c_str());
+                continue;
+            }
+
+            auto attribute = [&](const char* attributeName, int type) {
+                auto found = primitive.attributes.find(attributeName);
+                return GltfAccessorView(gltf, found != primitive.attributes.end() ? found->second : -1, type);
+            };
+            GltfAccessorView positions = attribute("POSITION", TINYGLTF_TYPE_VEC3);
+            GltfAccessorView normals = attribute("NORMAL", TINYGLTF_TYPE_VEC3);
+            GltfAccessorView uvs = attribute("TEXCOORD_0", TINYGLTF_TYPE_VEC2);
+            if (!positions.valid()) {
+                printf("Skipping primitive %zu of mesh \"%s\" without positions\n", p, gltfMesh.name.c_str());
+                continue;
+            }
+
+            Mesh& mesh = meshes.emplace_back();
+            mesh.name = name + "_" + gltfMesh.name + "_" + std::to_string(p);
+            firstVertices.push_back(vertices.size());
+            firstIndices.push_back(indices.size());
+
+            // Attributes are separate streams in glTF, so they have to be interleaved. Indices can go as is
+            vertices.reserve(vertices.size() + positions.count);
+            for (size_t v = 0; v < positions.count; ++v) {
+                Vertex& vertex = vertices.emplace_back();
+                vertex.position = glm::vec3(positions.component(v, 0), positions.component(v, 1), positions.component(v, 2));
+                vertex.normal = normals.valid() && v < normals.count
+                    ? glm::vec3(normals.component(v, 0), normals.component(v, 1), normals.component(v, 2))
+                    : glm::vec3(0.f);
+                // glTF uvs already have the origin at the top left, no flip needed unlike OBJ
+                vertex.uv = uvs.valid() && v < uvs.count ? glm::vec2(uvs.component(v, 0), uvs.component(v, 1)) : glm::vec2(0.f);
+                //we are setting the vertex color as the vertex normal. This is just for display purposes
+                vertex.color = vertex.normal;
+            }
+            mesh.vertexCount = positions.count;
+
+            GltfAccessorView primitiveIndices(gltf, primitive.indices, TINYGLTF_TYPE_SCALAR);
+            if (primitiveIndices.valid()) {
+                if (primitiveIndices.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT && primitiveIndices.stride == sizeof(uint32_t)) {
+                    const uint32_t* src = (const uint32_t*)primitiveIndices.data;
+                    indices.insert(indices.end(), src, src + primitiveIndices.count);
+                } else {
+                    indices.reserve(indices.size() + primitiveIndices.count);
+                    for (size_t i = 0; i < primitiveIndices.count; ++i) {
+                        indices.push_back(primitiveIndices.index(i));
+                    }
+                }
+                mesh.indexCount = primitiveIndices.count;
+
+                // Past the end would read other meshes' vertices out of the shared geometry buffers
+                bool indicesInRange = true;
+                for (size_t i = firstIndices.back(); i < indices.size(); ++i) {
+                    indicesInRange &= indices[i] < positions.count;
+                }
+                if (!indicesInRange) {
+                    printf("Skipping primitive %zu of mesh \"%s\" with indices past its %zu vertices\n", p, gltfMesh.name.c_str(), positions.count);
+                    vertices.resize(firstVertices.back());
+                    indices.resize(firstIndices.back());
+                    firstVertices.pop_back();
+                    firstIndices.pop_back();
+                    meshes.pop_back();
+                    continue;
+                }
+            } else {
+                for (uint32_t i = 0; i < mesh.vertexCount; ++i) {
+                    indices.push_back(i);
+                }
+                mesh.indexCount = mesh.vertexCount;
+            }
+
+            if (primitive.material >= 0 && primitive.material < (int)gltf.materials.size()) {
+                const tinygltf::Material& gltfMaterial = gltf.materials[primitive.material];
+                mesh.material.name = gltfMaterial.name;
+                mesh.material.albedoTexture = gltfTexturePath(gltf, baseDir, gltfMaterial.pbrMetallicRoughness.baseColorTexture.index);
+                mesh.material.normalTexture = gltfTexturePath(gltf, baseDir, gltfMaterial.normalTexture.index);
+            }
+        }
+
+        meshRanges[m].meshCount = meshes.size() - meshRanges[m].firstMesh;
+    }
+
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        meshes[i].vertices = vertices.data() + firstVertices[i];
+        meshes[i].indices = indices.data() + firstIndices[i];
+        meshes[i].computeBounds();
+    }
+
+    int sceneIndex = gltf.defaultScene >= 0 ? gltf.defaultScene : 0;
+    if (sceneIndex < (int)gltf.scenes.size()) {
+        for (int rootNode : gltf.scenes[sceneIndex].nodes) {
+            flattenGltfNode(gltf, rootNode, glm::mat4(1.f), meshRanges, nodes);
+        }
+    }
+
+    // No scene to speak of, just show all of the meshes
+    if (nodes.empty() && !meshes.empty()) {
+        ModelNode& root = nodes.emplace_back();
+        root.firstMesh = 0;
+        root.meshCount = meshes.size();
+    }
+
+    return selfContained;
+}
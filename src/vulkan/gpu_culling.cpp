@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+#include "vulkan/descriptors.h"
+#include "vulkan/draw_list.h"
+#include "vulkan/engine.h"
+#include "vulkan/gpu_culling.h"
+#include "vulkan/pipeline_cache.h"
+#include "vulkan/texture.h"
+#include "vulkan/vk_init_helpers.h"
+#include "vulkan/vk_shader.h"
+
+bool GPUCulling::init(Texture* depthTexture) {
+    CacheLoadResult<ShaderPassInfo> infoResult = backend.shaderPassCache->loadInfo(ShaderPassCache::ShaderStageCreateInfos({
+        ShaderPassCache::ShaderStageCreateInfo(SHADER_PATH("cull_draws.comp.glsl"), VK_SHADER_STAGE_COMPUTE_BIT, {
+            SpecializationConstant::ofUint(WORKGROUP_SIZE_CONSTANT_ID, WORKGROUP_SIZE),
+        }),
+    }));
+    if (!infoResult.success) {
+        printf("Failed loading the draw culling shader\n");
+        return false;
+    }
+    info = infoResult.data;
+
+    if (!depthPyramid.init(depthTexture->image.image, depthTexture->view, depthTexture->image.extent)) {
+        return false;
+    }
+
+    VkComputePipelineCreateInfo pipelineInfo = {};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.pNext = nullptr;
+    pipelineInfo.stage = shaderStageCreateInfo(info->stages[0]);
+    pipelineInfo.layout = info->layout;
+    VK_CHECK(vkCreateComputePipelines(backend.device, backend.pipelineCache->cache, 1, &pipelineInfo, nullptr, &pipeline));
+
+    const size_t drawsSize = sizeof(GPUCullDraw) * VulkanBackend::MAX_INSTANCES;
+    const size_t commandsSize = sizeof(VkDrawIndexedIndirectCommand) * MAX_BATCHES * PHASE_COUNT;
+    const size_t statsSize = sizeof(uint32_t) * 2;
+    const size_t viewsSize = sizeof(GPUCullView) * PHASE_COUNT;
+    const size_t lateDrawsSize = sizeof(uint32_t) * (1 + VulkanBackend::MAX_INSTANCES);
+
+    VkDescriptorImageInfo pyramidInfo = {};
+    pyramidInfo.sampler = depthPyramid.sampler;
+    pyramidInfo.imageView = depthPyramid.view;
+    pyramidInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    frames.resize(VulkanBackend::MAX_FRAMES_IN_FLIGHT);
+    std::vector<VkDescriptorBufferInfo> objectInfos(frames.size());
+    std::vector<VkDescriptorBufferInfo> drawInfos(frames.size());
+    std::vector<VkDescriptorBufferInfo> commandInfos(frames.size());
+    std::vector<VkDescriptorBufferInfo> instanceInfos(frames.size());
+    std::vector<VkDescriptorBufferInfo> statsInfos(frames.size());
+    std::vector<VkDescriptorImageInfo> pyramidInfos(frames.size(), pyramidInfo);
+    std::vector<VkDescriptorBufferInfo> viewInfos(frames.size());
+    std::vector<VkDescriptorBufferInfo> lateDrawInfos(frames.size());
+    for (size_t i = 0; i < frames.size(); ++i) {
+        Frame& frame = frames[i];
+        FrameData& frameData = backend.inFlightFrames[i];
+
+        frame.draws = backend.createBuffer(drawsSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+        frame.commandTemplates = backend.createBuffer(commandsSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+        frame.commands = backend.createBuffer(commandsSize,
+            VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+        frame.stats = backend.createBuffer(statsSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU);
+        frame.views = backend.createBuffer(viewsSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+        frame.lateDraws = backend.createBuffer(lateDrawsSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+
+        objectInfos[i] = descriptorBufferInfo(frameData.objectDataBuffer.buffer, 0, sizeof(GPUObjectData) * VulkanBackend::MAX_OBJECTS);
+        drawInfos[i] = descriptorBufferInfo(frame.draws.buffer, 0, drawsSize);
+        commandInfos[i] = descriptorBufferInfo(frame.commands.buffer, 0, commandsSize);
+        instanceInfos[i] = descriptorBufferInfo(frameData.instanceBuffer.buffer, 0, sizeof(GPUInstanceData) * VulkanBackend::MAX_INSTANCES * PHASE_COUNT);
+        statsInfos[i] = descriptorBufferInfo(frame.stats.buffer, 0, statsSize);
+        viewInfos[i] = descriptorBufferInfo(frame.views.buffer, 0, viewsSize);
+        lateDrawInfos[i] = descriptorBufferInfo(frame.lateDraws.buffer, 0, lateDrawsSize);
+    }
+
+    // Same bindings as reflected from the shader, so the layout comes out of the cache
+    std::vector<VkDescriptorSet> sets(frames.size());
+    DescriptorSetBuilder::begin(backend.device, *backend.descriptorSetLayoutCache, *backend.descriptorSetAllocator, frames.size())
+        .bindBuffers(objectInfos.data(), frames.size(), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 0)
+        .bindBuffers(drawInfos.data(), frames.size(), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 1)
+        .bindBuffers(commandInfos.data(), frames.size(), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2)
+        .bindBuffers(instanceInfos.data(), frames.size(), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 3)
+        .bindBuffers(statsInfos.data(), frames.size(), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 4)
+        .bindImages(pyramidInfos.data(), frames.size(), VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 5)
+        .bindBuffers(viewInfos.data(), frames.size(), VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 6)
+        .bindBuffers(lateDrawInfos.data(), frames.size(), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 7)
+        .build(sets.data());
+    for (size_t i = 0; i < frames.size(); ++i) {
+        frames[i].set = sets[i];
+    }
+
+    return true;
+}
+
+void GPUCulling::deinit() {
+    for (Frame& frame : frames) {
+        vmaDestroyBuffer(backend.allocator, frame.draws.buffer, frame.draws.allocation);
+        vmaDestroyBuffer(backend.allocator, frame.commandTemplates.buffer, frame.commandTemplates.allocation);
+        vmaDestroyBuffer(backend.allocator, frame.commands.buffer, frame.commands.allocation);
+        vmaDestroyBuffer(backend.allocator, frame.stats.buffer, frame.stats.allocation);
+        vmaDestroyBuffer(backend.allocator, frame.views.buffer, frame.views.allocation);
+        vmaDestroyBuffer(backend.allocator, frame.lateDraws.buffer, frame.lateDraws.allocation);
+    }
+    depthPyramid.deinit();
+    vkDestroyPipeline(backend.device, pipeline, nullptr);
+}
+
+void GPUCulling::upload(Frame& frame, const DrawList& drawList) {
+    // The scene batches with MAX_BATCHES as the limit, this only guards the buffer
+    frame.batchCount = std::min((uint32_t)drawList.batches.size(), MAX_BATCHES);
+    frame.drawCount = 0;
+
+    VkDrawIndexedIndirectCommand* commands;
+    GPUCullDraw* draws;
+    vmaMapMemory(backend.allocator, frame.commandTemplates.allocation, (void**)&commands);
+    vmaMapMemory(backend.allocator, frame.draws.allocation, (void**)&draws);
+    for (uint32_t batchIndex = 0; batchIndex < frame.batchCount; ++batchIndex) {
+        const DrawList::Batch& batch = drawList.batches[batchIndex];
+
+        VkDrawIndexedIndirectCommand& command = commands[batchIndex];
+        command.indexCount = batch.geometry.indexCount;
+        command.instanceCount = 0;
+        command.firstIndex = batch.geometry.firstIndex;
+        command.vertexOffset = batch.geometry.vertexOffset;
+        // Batches are laid out in visible order, so their instances can't overlap
+        command.firstInstance = batch.first;
+
+        VkDrawIndexedIndirectCommand& lateCommand = commands[MAX_BATCHES + batchIndex];
+        lateCommand = command;
+        lateCommand.firstInstance = VulkanBackend::MAX_INSTANCES + batch.first;
+
+        for (uint32_t i = batch.first; i < batch.first + batch.count; ++i) {
+            const Draw& draw = drawList.draws[drawList.visible[i]];
+
+            GPUCullDraw& cullDraw = draws[frame.drawCount++];
+            cullDraw.meshBounds = draw.meshBounds;
+            cullDraw.objectIndex = draw.objectIndex;
+            cullDraw.batchIndex = batchIndex;
+            cullDraw.materialIndex = draw.materialIndex;
+            cullDraw.padding = 0;
+        }
+    }
+    vmaUnmapMemory(backend.allocator, frame.draws.allocation);
+    vmaUnmapMemory(backend.allocator, frame.commandTemplates.allocation);
+
+    frame.batchVersion = drawList.batchVersion;
+}
+
+VkBuffer GPUCulling::cull(VkCommandBuffer cmd, uint32_t frameIndex, const DrawList& drawList, const glm::mat4& viewProjection, bool occlusion) {
+    Frame& frame = frames[frameIndex];
+    if (frame.batchVersion != drawList.batchVersion) {
+        upload(frame, drawList);
+    }
+    frame.viewProjection = viewProjection;
+    // The last frame's pyramid is only any good if it was built right before
+    frame.occlusion = occlusion && depthPyramid.initialized && pyramidFrameNumber == backend.frameNumber - 1;
+
+    Frustum frustum = Frustum::fromViewProjection(viewProjection);
+    GPUCullView views[PHASE_COUNT];
+    for (uint32_t phase = 0; phase < PHASE_COUNT; ++phase) {
+        GPUCullView& view = views[phase];
+        memcpy(view.frustumPlanes, frustum.planes, sizeof(view.frustumPlanes));
+        view.pyramidSize = glm::vec2(depthPyramid.image.extent.width, depthPyramid.image.extent.height);
+        view.padding = 0;
+    }
+    views[PHASE_EARLY].viewProjection = pyramidViewProjection;
+    views[PHASE_EARLY].occlusion = frame.occlusion ? 1 : 0;
+    views[PHASE_LATE].viewProjection = viewProjection;
+    views[PHASE_LATE].occlusion = 1;
+    backend.uploadData((void*)views, sizeof(views), 0, frame.views.allocation);
+
+    // Reset the instance counts of both phases, the stats and the late draws
+    if (frame.batchCount > 0) {
+        VkBufferCopy copies[PHASE_COUNT] = {};
+        for (uint32_t phase = 0; phase < PHASE_COUNT; ++phase) {
+            copies[phase].srcOffset = phase * lateCommandsOffset();
+            copies[phase].dstOffset = phase * lateCommandsOffset();
+            copies[phase].size = frame.batchCount * sizeof(VkDrawIndexedIndirectCommand);
+        }
+        vkCmdCopyBuffer(cmd, frame.commandTemplates.buffer, frame.commands.buffer, PHASE_COUNT, copies);
+    }
+    vkCmdFillBuffer(cmd, frame.stats.buffer, 0, sizeof(uint32_t) * 2, 0);
+    vkCmdFillBuffer(cmd, frame.lateDraws.buffer, 0, sizeof(uint32_t), 0);
+
+    VkMemoryBarrier resetBarrier = {};
+    resetBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    resetBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    resetBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+        1, &resetBarrier, 0, nullptr, 0, nullptr);
+
+    dispatch(cmd, frame, PHASE_EARLY);
+
+    frame.culled = true;
+    return frame.commands.buffer;
+}
+
+bool GPUCulling::cullLate(VkCommandBuffer cmd, uint32_t frameIndex) {
+    Frame& frame = frames[frameIndex];
+
+    depthPyramid.build(cmd);
+    pyramidViewProjection = frame.viewProjection;
+    pyramidFrameNumber = backend.frameNumber;
+
+    if (!frame.occlusion) {
+        return false;
+    }
+    dispatch(cmd, frame, PHASE_LATE);
+    return true;
+}
+
+void GPUCulling::dispatch(VkCommandBuffer cmd, Frame& frame, Phase phase) {
+    GPUCullConstants constants;
+    constants.drawCount = frame.drawCount;
+    constants.phase = phase;
+    constants.commandOffset = phase * MAX_BATCHES;
+
+    // The late phase can't know how many draws are left without reading back, so it gets enough for all of them
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, info->layout, 0, 1, &frame.set, 0, nullptr);
+    info->push(cmd, constants);
+    vkCmdDispatch(cmd, (frame.drawCount + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+
+    // The early phase's late draws are read by the late phase
+    VkMemoryBarrier cullBarrier = {};
+    cullBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    cullBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    cullBarrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_HOST_BIT, 0,
+        1, &cullBarrier, 0, nullptr, 0, nullptr);
+}
+
+void GPUCulling::readStats(uint32_t frameIndex, uint32_t& visible, uint32_t& occluded) {
+    visible = 0;
+    occluded = 0;
+    Frame& frame = frames[frameIndex];
+    if (!frame.culled) {
+        return;
+    }
+
+    uint32_t* stats;
+    vmaMapMemory(backend.allocator, frame.stats.allocation, (void**)&stats);
+    vmaInvalidateAllocation(backend.allocator, frame.stats.allocation, 0, sizeof(uint32_t) * 2);
+    visible = stats[0];
+    occluded = stats[1];
+    vmaUnmapMemory(backend.allocator, frame.stats.allocation);
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <vulkan/vulkan.h>
+
+#include "vulkan/culling.h"
+#include "vulkan/depth_pyramid.h"
+#include "vulkan/types.h"
+
+// One per draw of the draw list's batches, has to match CullDraw in cull_draws.comp.glsl
+struct GPUCullDraw {
+    glm::vec4 meshBounds;
+    uint32_t objectIndex;
+    uint32_t batchIndex;
+    uint32_t materialIndex;
+    uint32_t padding;
+};
+
+// Has to match CullView in cull_draws.comp.glsl, std140
+struct GPUCullView {
+    glm::mat4 viewProjection;
+    glm::vec4 frustumPlanes[Frustum::PLANE_COUNT];
+    glm::vec2 pyramidSize;
+    uint32_t occlusion;
+    uint32_t padding;
+};
+
+// Has to match the push constant block of cull_draws.comp.glsl
+struct GPUCullConstants {
+    uint32_t drawCount;
+    uint32_t phase;
+    uint32_t commandOffset;
+};
+
+struct Texture;
+struct VulkanBackend;
+struct DrawList;
+struct ShaderPassInfo;
+// Culls the draw list's batches in a compute shader. Every batch gets a VkDrawIndexedIndirectCommand
+// whose instance count the shader increments for each of its draws that passed, writing their instance data
+// into the batch's range of the frame's instance buffer. The forward pass then draws the batches indirectly,
+// so the CPU only pays per batch and only when the draw list changes, never per object.
+//
+// Occlusion culling runs in two phases, so that nothing pops in when it gets uncovered. The early phase
+// frustum culls and tests against the depth pyramid of the last frame, reprojected with its view. What
+// passes gets drawn, the pyramid is rebuilt from that depth and the late phase retests the draws found
+// occluded against it. The ones that turn out visible after all are drawn in a second forward pass, from a
+// second set of commands and the upper half of the instance buffer.
+struct GPUCulling {
+    // Specialized into cull_draws.comp.glsl as its local size
+    static constexpr uint32_t WORKGROUP_SIZE = 64;
+    static constexpr uint32_t WORKGROUP_SIZE_CONSTANT_ID = 0;
+    static constexpr uint32_t MAX_BATCHES = 1 << 14;
+    // Has to match the defines in cull_draws.comp.glsl
+    enum Phase {
+        PHASE_EARLY = 0,
+        PHASE_LATE,
+        PHASE_COUNT,
+    };
+
+    VulkanBackend& backend;
+
+    ShaderPassInfo* info = nullptr;
+    VkPipeline pipeline = VK_NULL_HANDLE;
+
+    DepthPyramid depthPyramid;
+    // View the pyramid was last built with, and on which frame
+    glm::mat4 pyramidViewProjection = glm::mat4(1.f);
+    int pyramidFrameNumber = -1;
+
+    struct Frame {
+        // Host visible, rewritten from the draw list whenever it changed since the frame was last in flight
+        AllocatedBuffer draws;
+        // The indirect commands with instance counts of 0, copied over commands before culling.
+        // MAX_BATCHES per phase
+        AllocatedBuffer commandTemplates;
+        AllocatedBuffer commands;
+        // Read back once the frame is done
+        AllocatedBuffer stats;
+        // GPUCullView per phase
+        AllocatedBuffer views;
+        // Count and indices of the draws left for the late phase
+        AllocatedBuffer lateDraws;
+
+        VkDescriptorSet set;
+
+        uint64_t batchVersion = UINT64_MAX;
+        uint32_t drawCount = 0;
+        uint32_t batchCount = 0;
+        bool culled = false;
+        // Whether the early phase tested occlusion, only then is there anything for the late phase
+        bool occlusion = false;
+        glm::mat4 viewProjection;
+    };
+    std::vector<Frame> frames;
+
+    GPUCulling(VulkanBackend& backend) : backend(backend), depthPyramid(backend) {}
+
+    // The pyramid is built from depthTexture, which has to be sampleable. False if a shader couldn't be loaded
+    bool init(Texture* depthTexture);
+    void deinit();
+
+    // Outside of any render pass, once the frame's fence is signaled and the object data written.
+    // Returns the indirect commands for DrawList::recordIndirect(), the early phase's come first
+    VkBuffer cull(VkCommandBuffer cmd, uint32_t frameIndex, const DrawList& drawList, const glm::mat4& viewProjection, bool occlusion);
+    // Outside of any render pass, once the early phase's draws are done. Builds the pyramid and runs the late
+    // phase, whose commands start at lateCommandsOffset(). False if the late phase has nothing to draw
+    bool cullLate(VkCommandBuffer cmd, uint32_t frameIndex);
+    static constexpr VkDeviceSize lateCommandsOffset() {
+        return sizeof(VkDrawIndexedIndirectCommand) * MAX_BATCHES;
+    }
+    // Of the last time the frame was culled, that's MAX_FRAMES_IN_FLIGHT frames behind
+    void readStats(uint32_t frameIndex, uint32_t& visible, uint32_t& occluded);
+
+private:
+    void upload(Frame& frame, const DrawList& drawList);
+    void dispatch(VkCommandBuffer cmd, Frame& frame, Phase phase);
+};
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// FNV-1a, but eating 8 bytes per step. Not meant to be cryptographic, only for detecting changed
+// file contents and the like
+inline uint64_t hashBytes(const void* data, size_t size, uint64_t seed = 0xcbf29ce484222325ull) {
+    const uint64_t prime = 0x100000001b3ull;
+    const char* bytes = (const char*)data;
+
+    uint64_t hash = seed;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(uint64_t));
+        hash = (hash ^ word) * prime;
+    }
+    for (; i < size; ++i) {
+        hash = (hash ^ (uint8_t)bytes[i]) * prime;
+    }
+
+    return hash;
+}
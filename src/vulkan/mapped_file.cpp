@@ -0,0 +1,62 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "vulkan/mapped_file.h"
+
+MappedFile::MappedFile(MappedFile&& other) : data(other.data), size(other.size) {
+    other.data = nullptr;
+    other.size = 0;
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) {
+    if (this != &other) {
+        close();
+        data = other.data;
+        size = other.size;
+        other.data = nullptr;
+        other.size = 0;
+    }
+
+    return *this;
+}
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+bool MappedFile::open(const char* path) {
+    close();
+
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+
+    void* mapping = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    data = (const char*)mapping;
+    size = fileStat.st_size;
+
+    return true;
+}
+
+void MappedFile::close() {
+    if (data != nullptr) {
+        munmap((void*)data, size);
+    }
+    data = nullptr;
+    size = 0;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+
+// Read-only memory mapping of a whole file. Unmapped on destruction
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other);
+    MappedFile& operator=(MappedFile&& other);
+    ~MappedFile();
+
+    bool open(const char* path);
+    void close();
+
+    bool isOpen() const { return data != nullptr; }
+};
@@ -23,7 +23,7 @@ MaterialBuilder& MaterialBuilder::addPass(PassType type, ShaderPassInfo* passInf
     assert(passInfo != nullptr);
 
     for (size_t i = 0; i < passInfo->stages.size(); ++i) {
-        builder.shaderStages.push_back(shaderStageCreateInfo(passInfo->stages[i].flags, passInfo->stages[i].module->module));
+        builder.shaderStages.push_back(shaderStageCreateInfo(passInfo->stages[i]));
     }
 
     buildingMaterials.emplace_back(*this, type, passInfo, builder, renderpass, viewport, scissor);
@@ -35,7 +35,7 @@ PassBuildingMaterials& MaterialBuilder::beginPass(PassType type, ShaderPassInfo*
     assert(passInfo != nullptr);
 
     for (size_t i = 0; i < passInfo->stages.size(); ++i) {
-        builder.shaderStages.push_back(shaderStageCreateInfo(passInfo->stages[i].flags, passInfo->stages[i].module->module));
+        builder.shaderStages.push_back(shaderStageCreateInfo(passInfo->stages[i]));
     }
 
     return buildingMaterials.emplace_back(*this, type, passInfo, builder, renderpass, viewport, scissor);
@@ -60,15 +60,17 @@ void Materials::enqueue(MaterialBuilder&& builder) {
     queuedBuilders.push_back(builder);
 }
 
-void Materials::buildQueued() {
-    // TODO: materials and pipeline storage has to be redone to SoA to lend itself nicely
-    // to vkCreateGraphicsPipelines
+void Materials::buildQueued(ThreadPool* threadPool) {
+    // Passes of all materials are collected first so that their pipelines can be created in bulk
+    std::vector<PassBuildingMaterials*> passes;
+    std::vector<Material*> passMaterials;
 
     for (MaterialBuilder& builder : queuedBuilders) {
         if (materials.find(builder.materialName) != materials.end()) {
             printf("Material \"%s\" found. Skipping building", builder.materialName.c_str());
             continue;
         }
+        // References into unordered_map stay valid as it grows
         Material& material = materials[builder.materialName];
         material.name = builder.materialName;
 
@@ -77,14 +79,21 @@ void Materials::buildQueued() {
             material.defaultTextures[textureInfo.first] = nullptr;
         }
 
-        for (PassBuildingMaterials passBuildingMaterials : builder.buildingMaterials) {
-            CacheLoadResult<ShaderPass> passResult = shaderPassCache.loadPass(passBuildingMaterials);
-            if (!passResult.success) {
-                continue;
-            }
+        for (PassBuildingMaterials& passBuildingMaterials : builder.buildingMaterials) {
+            passes.push_back(&passBuildingMaterials);
+            passMaterials.push_back(&material);
+        }
+    }
 
-            material.perPassShaders[static_cast<size_t>(passBuildingMaterials.type)] = passResult.data;
-            // TODO: load default textures, create descriptor sets
+    std::vector<ShaderPass*> builtPasses = shaderPassCache.loadPasses(passes, threadPool);
+    for (size_t i = 0; i < passes.size(); ++i) {
+        if (builtPasses[i] == nullptr) {
+            continue;
         }
+
+        passMaterials[i]->perPassShaders[static_cast<size_t>(passes[i]->type)] = builtPasses[i];
+        // TODO: load default textures, create descriptor sets
     }
+
+    queuedBuilders.clear();
 }
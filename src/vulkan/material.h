@@ -6,6 +6,7 @@
 
 #include <vulkan/vulkan.h>
 
+#include "vulkan/bindless.h"
 #include "vulkan/mesh.h"
 #include "vulkan/pipeline_builder.h"
 #include "vulkan/texture.h"
@@ -83,7 +84,10 @@ private:
 
 struct MaterialInstance {
     std::unordered_map<std::string, SampledTexture*> textures;
-    VkDescriptorSet textureDescriptorSet;
+    // Entry in the bindless material table
+    uint32_t materialIndex = BindlessResources::DEFAULT_MATERIAL;
+    // Latest upload among the textures, the instance can't be drawn before it retires
+    UploadTicket uploadTicket = 0;
     //settings;
     std::vector<uint32_t> meshInstanceIndices;
 };
@@ -119,5 +123,6 @@ struct Materials {
     Materials(ShaderPassCache& shaderPassCache) : shaderPassCache{shaderPassCache} {}
 
     void enqueue(MaterialBuilder&& builder);
-    void buildQueued();
+    // Pipelines of all queued materials get created together, across threadPool if given
+    void buildQueued(ThreadPool* threadPool = nullptr);
 };
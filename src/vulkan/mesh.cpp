@@ -1,6 +1,10 @@
 #include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <unordered_map>
 
 #include "vulkan/mesh.h"
+#include "vulkan/thread_pool.h"
 #include "tiny_obj_loader.h"
 
 /*static*/ VertexInputDescription Vertex::getVertexDescription() {
@@ -49,81 +53,140 @@
     return description;
 }
 
-void Mesh::loadFromObj(const char* filename, const char* materialDir) {
-     //attrib will contain the vertex arrays of the file
-    tinyobj::attrib_t attrib;
-    //shapes contains the info for each separate object in the file
-    std::vector<tinyobj::shape_t> shapes;
-    //materials contains the information about the material of each shape, but we won't use it.
-    std::vector<tinyobj::material_t> materials;
+void Mesh::computeBounds() {
+    if (vertexCount == 0) {
+        bounds = MeshBounds();
+        return;
+    }
 
-    //error and warning output from the load function
-    std::string warn;
-    std::string err;
+    bounds.min = vertices[0].position;
+    bounds.max = vertices[0].position;
+    for (uint32_t i = 1; i < vertexCount; ++i) {
+        bounds.min = glm::min(bounds.min, vertices[i].position);
+        bounds.max = glm::max(bounds.max, vertices[i].position);
+    }
+}
 
-    //load the OBJ file
-    tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, filename, materialDir);
-    //make sure to output the warnings to the console, in case there are issues with the file
-    if (!warn.empty()) {
-        //std::cout << "WARN: " << warn << std::endl;
+// tinyobj gives separate position/normal/uv indices per face corner -- a unique combination
+// of the three is a unique vertex
+struct ObjVertexKey {
+    int vertexIndex;
+    int normalIndex;
+    int texcoordIndex;
+
+    ObjVertexKey(tinyobj::index_t idx) : vertexIndex(idx.vertex_index), normalIndex(idx.normal_index), texcoordIndex(idx.texcoord_index) {}
+
+    bool operator==(const ObjVertexKey& other) const {
+        return vertexIndex == other.vertexIndex && normalIndex == other.normalIndex && texcoordIndex == other.texcoordIndex;
     }
-    //if we have any error, print it to the console, and break the mesh loading.
-    //This happens if the file can't be found or is malformed
-    if (!err.empty()) {
-        std::cerr << err << std::endl;
-        return;
+
+    struct Hash {
+        size_t operator() (const ObjVertexKey& key) const {
+            size_t h = std::hash<int>{}(key.vertexIndex);
+            h = h * 31 + std::hash<int>{}(key.normalIndex);
+            h = h * 31 + std::hash<int>{}(key.texcoordIndex);
+            return h;
+        }
+    };
+};
+
+static Vertex objVertex(const tinyobj::attrib_t& attrib, tinyobj::index_t idx) {
+    Vertex vertex = {};
+
+    //vertex position
+    vertex.position.x = attrib.vertices[3 * idx.vertex_index + 0];
+    vertex.position.y = attrib.vertices[3 * idx.vertex_index + 1];
+    vertex.position.z = attrib.vertices[3 * idx.vertex_index + 2];
+
+    //vertex normal
+    if (idx.normal_index >= 0) {
+        vertex.normal.x = attrib.normals[3 * idx.normal_index + 0];
+        vertex.normal.y = attrib.normals[3 * idx.normal_index + 1];
+        vertex.normal.z = attrib.normals[3 * idx.normal_index + 2];
     }
 
-    // Loop over shapes
-    for (size_t s = 0; s < shapes.size(); s++) {
-        // Loop over faces(polygon)
-        size_t index_offset = 0;
-        for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
-
-            //hardcode loading to triangles
-            int fv = 3;
-
-            // Loop over vertices in the face.
-            for (int v = 0; v < fv; v++) {
-                // access to vertex
-                tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-
-                //vertex position
-                tinyobj::real_t vx = attrib.vertices[3 * idx.vertex_index + 0];
-                tinyobj::real_t vy = attrib.vertices[3 * idx.vertex_index + 1];
-                tinyobj::real_t vz = attrib.vertices[3 * idx.vertex_index + 2];
-                //vertex normal
-                tinyobj::real_t nx = attrib.normals[3 * idx.normal_index + 0];
-                tinyobj::real_t ny = attrib.normals[3 * idx.normal_index + 1];
-                tinyobj::real_t nz = attrib.normals[3 * idx.normal_index + 2];
-                //vertex uv
-                tinyobj::real_t uvx = attrib.texcoords[2 * idx.texcoord_index + 0];
-                tinyobj::real_t uvy = attrib.texcoords[2 * idx.texcoord_index + 1];
-
-                //copy it into our vertex
-                Vertex new_vert;
-                new_vert.position.x = vx;
-                new_vert.position.y = vy;
-                new_vert.position.z = vz;
-
-                new_vert.normal.x = nx;
-                new_vert.normal.y = ny;
-                new_vert.normal.z = nz;
-
-                new_vert.uv.x = uvx;
-                new_vert.uv.y = 1.0 - uvy;
-
-                //we are setting the vertex color as the vertex normal. This is just for display purposes
-                new_vert.color = new_vert.normal;
-
-                vertices.push_back(new_vert);
+    //vertex uv
+    if (idx.texcoord_index >= 0) {
+        vertex.uv.x = attrib.texcoords[2 * idx.texcoord_index + 0];
+        vertex.uv.y = 1.0 - attrib.texcoords[2 * idx.texcoord_index + 1];
+    }
+
+    //we are setting the vertex color as the vertex normal. This is just for display purposes
+    vertex.color = vertex.normal;
+
+    return vertex;
+}
+
+// Appends the shape's triangles to the vertex/index arrays, deduplicating vertices within the shape.
+// Indices are relative to the first vertex appended
+static void appendObjShape(const tinyobj::attrib_t& attrib, const tinyobj::shape_t& shape, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+    const uint32_t baseVertex = vertices.size();
+
+    std::unordered_map<ObjVertexKey, uint32_t, ObjVertexKey::Hash> uniqueVertices;
+    uniqueVertices.reserve(shape.mesh.indices.size());
+    indices.reserve(indices.size() + shape.mesh.indices.size());
+
+    // Loop over faces(polygon)
+    size_t index_offset = 0;
+    for (size_t f = 0; f < shape.mesh.num_face_vertices.size(); f++) {
+        //hardcode loading to triangles
+        int fv = 3;
+
+        // Loop over vertices in the face.
+        for (int v = 0; v < fv; v++) {
+            tinyobj::index_t idx = shape.mesh.indices[index_offset + v];
+
+            auto inserted = uniqueVertices.emplace(ObjVertexKey(idx), (uint32_t)vertices.size() - baseVertex);
+            if (inserted.second) {
+                vertices.push_back(objVertex(attrib, idx));
             }
-            index_offset += fv;
+            indices.push_back(inserted.first->second);
         }
+        index_offset += fv;
+    }
+}
+
+// Falls back to running on the calling thread when there's no pool to spread the work over
+static void parallelFor(ThreadPool* threadPool, size_t count, const std::function<void(size_t)>& func) {
+    if (threadPool != nullptr) {
+        threadPool->parallelFor(count, func);
+        return;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        func(i);
+    }
+}
+
+static std::string objTexturePath(const char* materialDir, const std::string& texname) {
+    if (texname.empty()) {
+        return "";
+    }
+
+    // Sponza's .mtl references textures relative to the asset root, one level above materialDir
+    return std::string(materialDir) + "/../" + texname;
+}
+
+void Model::load(const char* filename, const char* materialDir, ThreadPool* threadPool) {
+    std::string cookedPath = std::string(filename) + ".cooked";
+    if (loadCooked(cookedPath.c_str(), filename, materialDir)) {
+        return;
+    }
+
+    bool cookable = true;
+    std::string extension = std::string(filename).substr(std::string(filename).find_last_of('.') + 1);
+    if (extension == "gltf" || extension == "glb") {
+        cookable = loadFromGltf(filename);
+    } else {
+        loadFromObj(filename, materialDir, threadPool);
+    }
+
+    if (cookable && !meshes.empty() && !writeCooked(cookedPath.c_str(), filename, materialDir)) {
+        printf("Failed writing cooked model %s\n", cookedPath.c_str());
     }
 }
 
-void Model::loadFromObj(const char* filename, const char* materialDir) {
+void Model::loadFromObj(const char* filename, const char* materialDir, ThreadPool* threadPool) {
     name = filename;
 
     tinyobj::attrib_t attrib;
@@ -147,55 +210,56 @@ void Model::loadFromObj(const char* filename, const char* materialDir) {
         return;
     }
 
+    // Shapes don't share vertices, so they can be assembled independently. Each one goes into
+    // its own storage first and gets packed into the contiguous arrays afterwards
+    struct ShapeGeometry {
+        std::vector<Vertex> vertices;
+        std::vector<uint32_t> indices;
+    };
+    std::vector<ShapeGeometry> shapeGeometries(shapes.size());
+    parallelFor(threadPool, shapes.size(), [&](size_t s) {
+        appendObjShape(attrib, shapes[s], shapeGeometries[s].vertices, shapeGeometries[s].indices);
+    });
+
+    std::vector<uint32_t> firstVertices(shapes.size());
+    std::vector<uint32_t> firstIndices(shapes.size());
+    uint32_t vertexCount = 0;
+    uint32_t indexCount = 0;
+
     // Loop over shapes
     for (size_t s = 0; s < shapes.size(); s++) {
         Mesh& mesh = meshes.emplace_back();
         // NOTE: For now let's only allow a single material per mesh
-        mesh.loaderMaterial = materials[shapes[s].mesh.material_ids[0]];
-        mesh.name = name + "_" + mesh.loaderMaterial.name + "_" + std::to_string(s);
-
-        // Loop over faces(polygon)
-        size_t index_offset = 0;
-        for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
-            //hardcode loading to triangles
-            int fv = 3;
-
-            // Loop over vertices in the face.
-            for (int v = 0; v < fv; v++) {
-                // access to vertex
-                tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-
-                //vertex position
-                tinyobj::real_t vx = attrib.vertices[3 * idx.vertex_index + 0];
-                tinyobj::real_t vy = attrib.vertices[3 * idx.vertex_index + 1];
-                tinyobj::real_t vz = attrib.vertices[3 * idx.vertex_index + 2];
-                //vertex normal
-                tinyobj::real_t nx = attrib.normals[3 * idx.normal_index + 0];
-                tinyobj::real_t ny = attrib.normals[3 * idx.normal_index + 1];
-                tinyobj::real_t nz = attrib.normals[3 * idx.normal_index + 2];
-                //vertex uv
-                tinyobj::real_t uvx = attrib.texcoords[2 * idx.texcoord_index + 0];
-                tinyobj::real_t uvy = attrib.texcoords[2 * idx.texcoord_index + 1];
-
-                //copy it into our vertex
-                Vertex new_vert;
-                new_vert.position.x = vx;
-                new_vert.position.y = vy;
-                new_vert.position.z = vz;
-
-                new_vert.normal.x = nx;
-                new_vert.normal.y = ny;
-                new_vert.normal.z = nz;
-
-                new_vert.uv.x = uvx;
-                new_vert.uv.y = 1.0 - uvy;
-
-                //we are setting the vertex color as the vertex normal. This is just for display purposes
-                new_vert.color = new_vert.normal;
-
-                mesh.vertices.push_back(new_vert);
-            }
-            index_offset += fv;
-        }
+        tinyobj::material_t& loaderMaterial = materials[shapes[s].mesh.material_ids[0]];
+        mesh.name = name + "_" + loaderMaterial.name + "_" + std::to_string(s);
+        mesh.material.name = loaderMaterial.name;
+        mesh.material.albedoTexture = objTexturePath(materialDir, loaderMaterial.diffuse_texname);
+        mesh.material.normalTexture = objTexturePath(materialDir, loaderMaterial.bump_texname);
+
+        mesh.vertexCount = shapeGeometries[s].vertices.size();
+        mesh.indexCount = shapeGeometries[s].indices.size();
+        firstVertices[s] = vertexCount;
+        firstIndices[s] = indexCount;
+        vertexCount += mesh.vertexCount;
+        indexCount += mesh.indexCount;
     }
+
+    vertices.resize(vertexCount);
+    indices.resize(indexCount);
+    parallelFor(threadPool, shapes.size(), [&](size_t s) {
+        ShapeGeometry& geometry = shapeGeometries[s];
+        memcpy(vertices.data() + firstVertices[s], geometry.vertices.data(), geometry.vertices.size() * sizeof(Vertex));
+        memcpy(indices.data() + firstIndices[s], geometry.indices.data(), geometry.indices.size() * sizeof(uint32_t));
+
+        // Free as we go, the per-shape copies double the memory footprint of large models
+        geometry = ShapeGeometry();
+
+        meshes[s].vertices = vertices.data() + firstVertices[s];
+        meshes[s].indices = indices.data() + firstIndices[s];
+        meshes[s].computeBounds();
+    });
+
+    ModelNode& root = nodes.emplace_back();
+    root.firstMesh = 0;
+    root.meshCount = meshes.size();
 }
@@ -1,16 +1,14 @@
 #pragma once
 
 #include <glm/glm.hpp>
+#include <string>
 #include <vector>
 #include <vk_mem_alloc.h>
 
+#include "vulkan/geometry.h"
+#include "vulkan/mapped_file.h"
+#include "vulkan/upload.h"
 #include "vulkan/types.h"
-#include "tiny_obj_loader.h"
-
-struct MeshPushConstants {
-    glm::vec4 data;
-    glm::mat4 MVP;
-};
 
 struct VertexInputDescription {
     std::vector<VkVertexInputBindingDescription> bindings;
@@ -28,22 +26,85 @@ struct Vertex {
     static VertexInputDescription getVertexDescription();
 };
 
+// Loader agnostic description of what a mesh should be shaded with
+struct MeshMaterial {
+    std::string name;
+    // Resolved paths, empty if the source material doesn't reference a texture
+    std::string albedoTexture;
+    std::string normalTexture;
+};
+
+// Mesh space bounds. The sphere encloses the box, which is cheaper to transform and test for culling
+struct MeshBounds {
+    glm::vec3 min = glm::vec3(0.f);
+    glm::vec3 max = glm::vec3(0.f);
+
+    glm::vec3 center() const { return (min + max) * 0.5f; }
+    float radius() const { return glm::length(max - min) * 0.5f; }
+};
+
 struct Mesh {
     std::string name;
 
-    // TODO: have all vertices under the model and only have indices here.
-    std::vector<Vertex> vertices;
-    AllocatedBuffer vertexBuffer;
+    // Views into the owning Model's geometry, which might be memory-mapped. Only valid
+    // while the Model is alive -- upload before letting go of it. Cleared by the upload,
+    // geometry has the counts from then on
+    const Vertex* vertices = nullptr;
+    uint32_t vertexCount = 0;
+    const uint32_t* indices = nullptr;
+    uint32_t indexCount = 0;
+
+    GeometryAllocation geometry;
+    UploadTicket uploadTicket = 0;
 
-    tinyobj::material_t loaderMaterial;
+    MeshBounds bounds;
 
-    void loadFromObj(const char* filename, const char* materialDir);
+    MeshMaterial material;
+
+    // From the vertices, which have to be set by then
+    void computeBounds();
 };
 
+// Places a contiguous range of the model's meshes in the model's space. OBJ models get a single
+// identity node, glTF node hierarchies get flattened into these
+struct ModelNode {
+    glm::vec3 position = glm::vec3(0.f);
+    glm::mat4 rotation = glm::mat4(1.f);
+    glm::vec3 scale = glm::vec3(1.f);
+
+    uint32_t firstMesh;
+    uint32_t meshCount;
+};
+
+struct ThreadPool;
 struct Model {
     std::string name;
     std::vector<Mesh> meshes;
+    std::vector<ModelNode> nodes;
 
-    void loadFromObj(const char* filename, const char* materialDir);
-};
+    // Backing storage of the mesh views. Either parsed from the source asset into the vectors,
+    // or used directly from the mapped cooked file
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+    MappedFile cookedFile;
+
+    Model() {}
+    Model(const Model&) = delete;
+    Model& operator=(const Model&) = delete;
+    Model(Model&&) = default;
+    Model& operator=(Model&&) = default;
 
+    // Uses the cooked cache next to the source asset if it's up to date, otherwise loads the
+    // source (picked by extension) and (re)writes the cache, unless the source has external buffers
+    // the cache couldn't tell are stale. materialDir is only used by OBJ.
+    // If given, the thread pool is used to assemble the meshes in parallel
+    void load(const char* filename, const char* materialDir, ThreadPool* threadPool = nullptr);
+    void loadFromObj(const char* filename, const char* materialDir, ThreadPool* threadPool = nullptr);
+    // Implemented in gltf.cpp. Handles both .gltf and .glb. Returns whether the geometry came from the file
+    // alone, .gltf files referencing external buffers can't be cooked
+    bool loadFromGltf(const char* filename);
+
+    // Implemented in cooked_model.cpp
+    bool loadCooked(const char* cookedPath, const char* sourcePath, const char* materialDir);
+    bool writeCooked(const char* cookedPath, const char* sourcePath, const char* materialDir) const;
+};
@@ -4,38 +4,49 @@
 
 #include "vulkan/vk_init_helpers.h"
 
-VkPipeline PipelineBuilder::build(VkDevice device, VkRenderPass pass, VkViewport* viewport, VkRect2D* scissor, VkPipelineLayout& pipelineLayout) {
-    VkPipelineViewportStateCreateInfo viewportState = pipelineViewportState(1, viewport, 1, scissor);
+void PipelineBuilder::fill(PipelineCreateInfo& createInfo, VkRenderPass pass, VkViewport* viewport, VkRect2D* scissor, VkPipelineLayout pipelineLayout) const {
+    // Own copy, shader stages live in a vector
+    createInfo.builder = *this;
+    PipelineBuilder& builder = createInfo.builder;
 
-    VkPipelineColorBlendStateCreateInfo colorBlending = pipelineColorBlendState(false, VK_LOGIC_OP_COPY, 1, &colorBlendAttachment);
+    createInfo.viewportState = pipelineViewportState(1, viewport, 1, scissor);
 
-    VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
-    VkPipelineDynamicStateCreateInfo dynamicState = {};
-    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-    dynamicState.pNext = nullptr;
-    dynamicState.dynamicStateCount = 2;
-    dynamicState.pDynamicStates = dynamicStates;
+    createInfo.colorBlending = pipelineColorBlendState(false, VK_LOGIC_OP_COPY, 1, &builder.colorBlendAttachment);
 
-    VkGraphicsPipelineCreateInfo pipelineInfo = {};
+    createInfo.dynamicStates[0] = VK_DYNAMIC_STATE_VIEWPORT;
+    createInfo.dynamicStates[1] = VK_DYNAMIC_STATE_SCISSOR;
+    createInfo.dynamicState = {};
+    createInfo.dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    createInfo.dynamicState.pNext = nullptr;
+    createInfo.dynamicState.dynamicStateCount = 2;
+    createInfo.dynamicState.pDynamicStates = createInfo.dynamicStates;
+
+    VkGraphicsPipelineCreateInfo& pipelineInfo = createInfo.info;
+    pipelineInfo = {};
     pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
     pipelineInfo.pNext = nullptr;
 
-    pipelineInfo.stageCount = shaderStages.size();
-    pipelineInfo.pStages = shaderStages.data();
-    pipelineInfo.pVertexInputState = &vertexInputInfo;
-    pipelineInfo.pInputAssemblyState = &inputAssembly;
-    pipelineInfo.pViewportState = &viewportState;
-    pipelineInfo.pRasterizationState = &rasterizer;
-    pipelineInfo.pMultisampleState = &multisampling;
-    pipelineInfo.pColorBlendState = &colorBlending; // TODO change
-    pipelineInfo.pDynamicState = &dynamicState;
-    pipelineInfo.pDepthStencilState = &depthStencil;
+    pipelineInfo.stageCount = builder.shaderStages.size();
+    pipelineInfo.pStages = builder.shaderStages.data();
+    pipelineInfo.pVertexInputState = &builder.vertexInputInfo;
+    pipelineInfo.pInputAssemblyState = &builder.inputAssembly;
+    pipelineInfo.pViewportState = &createInfo.viewportState;
+    pipelineInfo.pRasterizationState = &builder.rasterizer;
+    pipelineInfo.pMultisampleState = &builder.multisampling;
+    pipelineInfo.pColorBlendState = &createInfo.colorBlending; // TODO change
+    pipelineInfo.pDynamicState = &createInfo.dynamicState;
+    pipelineInfo.pDepthStencilState = &builder.depthStencil;
     pipelineInfo.layout = pipelineLayout;
     pipelineInfo.renderPass = pass;
     pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+}
+
+VkPipeline PipelineBuilder::build(VkDevice device, VkPipelineCache pipelineCache, VkRenderPass pass, VkViewport* viewport, VkRect2D* scissor, VkPipelineLayout& pipelineLayout) {
+    PipelineCreateInfo createInfo;
+    fill(createInfo, pass, viewport, scissor, pipelineLayout);
 
     VkPipeline pipeline = {};
-    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS) {
+    if (vkCreateGraphicsPipelines(device, pipelineCache, 1, &createInfo.info, nullptr, &pipeline) != VK_SUCCESS) {
         printf("Failed creating graphics pipeline\n");
         return VK_NULL_HANDLE;
     }
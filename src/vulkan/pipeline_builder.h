@@ -4,6 +4,7 @@
 
 #include <vulkan/vulkan.h>
 
+struct PipelineCreateInfo;
 struct PipelineBuilder {
     std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
     VkPipelineVertexInputStateCreateInfo vertexInputInfo;
@@ -14,5 +15,23 @@ struct PipelineBuilder {
     VkPipelineLayout pipelineLayout;
     VkPipelineDepthStencilStateCreateInfo depthStencil;
 
-    VkPipeline build(VkDevice device, VkRenderPass pass, VkViewport* viewport, VkRect2D* scissor, VkPipelineLayout& pipelineLayout );
+    // Fills createInfo in place without creating anything, for batching into a single vkCreateGraphicsPipelines
+    void fill(PipelineCreateInfo& createInfo, VkRenderPass pass, VkViewport* viewport, VkRect2D* scissor, VkPipelineLayout pipelineLayout) const;
+    VkPipeline build(VkDevice device, VkPipelineCache pipelineCache, VkRenderPass pass, VkViewport* viewport, VkRect2D* scissor, VkPipelineLayout& pipelineLayout);
+};
+
+// VkGraphicsPipelineCreateInfo along with all the state it points to. Points into itself, so it has
+// to stay where it was filled until the pipeline is created
+struct PipelineCreateInfo {
+    PipelineBuilder builder;
+    VkPipelineViewportStateCreateInfo viewportState;
+    VkPipelineColorBlendStateCreateInfo colorBlending;
+    VkDynamicState dynamicStates[2];
+    VkPipelineDynamicStateCreateInfo dynamicState;
+
+    VkGraphicsPipelineCreateInfo info;
+
+    PipelineCreateInfo() = default;
+    PipelineCreateInfo(const PipelineCreateInfo&) = delete;
+    PipelineCreateInfo& operator=(const PipelineCreateInfo&) = delete;
 };
@@ -0,0 +1,114 @@
+#include <fstream>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "vulkan/hash.h"
+#include "vulkan/mapped_file.h"
+#include "vulkan/pipeline_cache.h"
+
+static void fillHeader(PipelineCacheFileHeader& header, const VkPhysicalDeviceProperties& gpuProperties) {
+    memcpy(header.magic, PIPELINE_CACHE_MAGIC, sizeof(PIPELINE_CACHE_MAGIC));
+    header.version = PIPELINE_CACHE_VERSION;
+    header.vendorID = gpuProperties.vendorID;
+    header.deviceID = gpuProperties.deviceID;
+    header.driverVersion = gpuProperties.driverVersion;
+    memcpy(header.pipelineCacheUUID, gpuProperties.pipelineCacheUUID, VK_UUID_SIZE);
+}
+
+void PipelineCache::init(VkDevice device, const VkPhysicalDeviceProperties& gpuProperties, const char* path) {
+    this->device = device;
+    this->gpuProperties = gpuProperties;
+    this->path = path;
+
+    VkPipelineCacheCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    createInfo.pNext = nullptr;
+    createInfo.flags = 0;
+    createInfo.initialDataSize = 0;
+    createInfo.pInitialData = nullptr;
+
+    MappedFile file;
+    if (file.open(path)) {
+        PipelineCacheFileHeader expected = {};
+        fillHeader(expected, gpuProperties);
+
+        const PipelineCacheFileHeader* header = (const PipelineCacheFileHeader*)file.data;
+        const char* data = file.data + sizeof(PipelineCacheFileHeader);
+        if (file.size < sizeof(PipelineCacheFileHeader)
+            || memcmp(header->magic, expected.magic, sizeof(expected.magic)) != 0
+            || header->version != expected.version) {
+            printf("Ignoring pipeline cache %s - incompatible\n", path);
+        } else if (header->vendorID != expected.vendorID
+            || header->deviceID != expected.deviceID
+            || header->driverVersion != expected.driverVersion
+            || memcmp(header->pipelineCacheUUID, expected.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+            printf("Ignoring pipeline cache %s - different device or driver\n", path);
+        } else if (header->dataSize != file.size - sizeof(PipelineCacheFileHeader)
+            || header->dataHash != hashBytes(data, header->dataSize)) {
+            printf("Ignoring pipeline cache %s - corrupt\n", path);
+        } else {
+            createInfo.initialDataSize = header->dataSize;
+            createInfo.pInitialData = data;
+        }
+    }
+
+    VkResult result = vkCreatePipelineCache(device, &createInfo, nullptr, &cache);
+    if (result != VK_SUCCESS && createInfo.pInitialData != nullptr) {
+        printf("Failed creating pipeline cache from %s, starting empty\n", path);
+        createInfo.initialDataSize = 0;
+        createInfo.pInitialData = nullptr;
+        result = vkCreatePipelineCache(device, &createInfo, nullptr, &cache);
+    }
+    if (result != VK_SUCCESS) {
+        printf("Failed creating pipeline cache\n");
+        cache = VK_NULL_HANDLE;
+    }
+}
+
+bool PipelineCache::save() {
+    if (cache == VK_NULL_HANDLE) {
+        return false;
+    }
+
+    size_t dataSize = 0;
+    if (vkGetPipelineCacheData(device, cache, &dataSize, nullptr) != VK_SUCCESS) {
+        return false;
+    }
+    std::vector<char> data(dataSize);
+    if (vkGetPipelineCacheData(device, cache, &dataSize, data.data()) != VK_SUCCESS) {
+        return false;
+    }
+
+    PipelineCacheFileHeader header = {};
+    fillHeader(header, gpuProperties);
+    header.dataSize = dataSize;
+    header.dataHash = hashBytes(data.data(), dataSize);
+
+    // Write into a temporary and rename, so that a crash mid-write never leaves a broken cache behind
+    std::string tmpPath = path + ".tmp";
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        return false;
+    }
+    file.write((const char*)&header, sizeof(header));
+    file.write(data.data(), dataSize);
+    file.close();
+
+    if (file.fail() || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        unlink(tmpPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void PipelineCache::deinit() {
+    if (!save()) {
+        printf("Failed saving pipeline cache %s\n", path.c_str());
+    }
+
+    vkDestroyPipelineCache(device, cache, nullptr);
+    cache = VK_NULL_HANDLE;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+#include <vulkan/vulkan.h>
+
+#define PIPELINE_CACHE_PATH "./pipeline_cache.bin"
+
+static constexpr char PIPELINE_CACHE_MAGIC[4] = { 'T', 'R', 'P', 'C' };
+static constexpr uint32_t PIPELINE_CACHE_VERSION = 1;
+
+// Precedes the driver's blob on disk. The blob carries its own header, but drivers are known to
+// misbehave on data from other devices or driver versions, so we don't hand it over unless we're
+// sure it's ours
+struct PipelineCacheFileHeader {
+    char magic[4];
+    uint32_t version;
+
+    uint32_t vendorID;
+    uint32_t deviceID;
+    uint32_t driverVersion;
+    uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+
+    uint32_t padding;
+    uint64_t dataSize;
+    uint64_t dataHash;
+};
+
+// Driver side pipeline cache, shared by all pipeline creation and persisted between runs
+struct PipelineCache {
+    VkDevice device;
+    VkPhysicalDeviceProperties gpuProperties;
+    std::string path;
+
+    VkPipelineCache cache = VK_NULL_HANDLE;
+
+    // Starts from the file at path if it's valid for this device, empty otherwise
+    void init(VkDevice device, const VkPhysicalDeviceProperties& gpuProperties, const char* path = PIPELINE_CACHE_PATH);
+    bool save();
+    // Saves before destroying
+    void deinit();
+};
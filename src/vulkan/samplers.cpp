@@ -14,3 +14,10 @@ CacheLoadResult<VkSampler> SamplerCache::load(VkSamplerCreateInfo createInfo) {
 
     return CacheLoadResult<VkSampler>(true, &sampler);
 }
+
+void SamplerCache::deinit() {
+    for (auto& entry : cache) {
+        vkDestroySampler(backend.device, entry.second, nullptr);
+    }
+    cache.clear();
+}
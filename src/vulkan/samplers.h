@@ -2,6 +2,7 @@
 
 #include <functional>
 #include <stdint.h>
+#include <string.h>
 #include <string>
 #include <unordered_map>
 
@@ -26,7 +27,7 @@ struct SamplerCache {
         }
 
         bool operator==(const SamplerCreateInfo& other) const {
-            return hash() == other.hash();
+            return memcmp(&info, &other.info, sizeof(VkSamplerCreateInfo)) == 0;
         }
 
         struct Hash {
@@ -41,5 +42,7 @@ struct SamplerCache {
 
     SamplerCache(VulkanBackend& backend) : backend(backend) {}
 
+    // Infos are compared bytewise, so they should be zero initialized
     CacheLoadResult<VkSampler> load(VkSamplerCreateInfo createInfo);
+    void deinit();
 };
@@ -1,13 +1,32 @@
+#include <algorithm>
+
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/euler_angles.hpp>
 
+#include "bindless.h"
 #include "engine.h"
+#include "gpu_culling.h"
 #include "mesh.h"
 #include "scene.h"
 #include "vk_init_helpers.h"
 #include "descriptors.h"
+#include "geometry.h"
+#include "thread_pool.h"
+#include "upload.h"
+
+glm::vec3 right(glm::mat4 mat) {
+    return mat * glm::vec4(1.f, 0.f, 0.f, 0.f);
+}
+
+glm::vec3 up(glm::mat4 mat) {
+    return mat * glm::vec4(0.f, 1.f, 0.f, 0.f);
+}
+
+glm::vec3 forward(glm::mat4 mat) {
+    return mat * glm::vec4(0.f, 0.f, -1.f, 0.f);
+}
 
 size_t ObjectData::pushBackDefaults() {
     positions.emplace_back(glm::vec3(0.0));
@@ -15,87 +34,346 @@ size_t ObjectData::pushBackDefaults() {
     rotations.emplace_back(glm::mat4(1.0));
     isValidModelMatrixCache.emplace_back(true);
     modelMatrixCache.emplace_back(glm::mat4(1.0));
+    changed.push_back(positions.size() - 1);
 
     return positions.size() - 1;
 }
 
-Scene::Object Scene::addObject(std::string meshName, std::string materialDir, bool separateMaterialInstances) {
-    // TODO: we need to cache meshes
-    Object object;
-    object.objectDataIndex = objectData.pushBackDefaults();
+void ObjectData::invalidate(size_t i) {
+    isValidModelMatrixCache[i] = false;
+    changed.push_back(i);
+}
 
-    Model model;
-    model.loadFromObj(meshName.c_str(), materialDir.c_str());
-    for (auto& mesh : model.meshes) {
-        //printf("uploading mesh %s\n", mesh.name.c_str());
-        backend->uploadMesh(mesh);
+const glm::mat4& ObjectData::modelMatrix(size_t i) {
+    if (!isValidModelMatrixCache[i]) {
+        modelMatrixCache[i] = glm::translate(positions[i]) * rotations[i] * glm::scale(scales[i]);
+        isValidModelMatrixCache[i] = true;
+    }
+    return modelMatrixCache[i];
+}
 
-        uint32_t meshInstanceIndex = meshInstances.size();
-        uint32_t materialInstanceIndex = backend->materials->materials[Materials::DEFAULT_LIT].instances.size();
+Mesh Scene::placeholderMesh() {
+    // Unit cube with 4 vertices per face, so that normals stay flat
+    static std::vector<Vertex> vertices;
+    static std::vector<uint32_t> indices;
+    if (vertices.empty()) {
+        const glm::vec3 normals[] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+        const glm::vec2 corners[] = { { -1, -1 }, { 1, -1 }, { 1, 1 }, { -1, 1 } };
+        for (const glm::vec3& normal : normals) {
+            // u x v == normal, so the corners above wind counter-clockwise seen from outside
+            glm::vec3 u = glm::vec3(normal.y, normal.z, normal.x);
+            glm::vec3 v = glm::cross(normal, u);
+
+            uint32_t firstVertex = vertices.size();
+            for (const glm::vec2& corner : corners) {
+                Vertex vertex = {};
+                vertex.position = (normal + u * corner.x + v * corner.y) * 0.5f;
+                vertex.normal = normal;
+                vertex.color = normal;
+                vertex.uv = corner * 0.5f + 0.5f;
+                vertices.push_back(vertex);
+            }
+            for (uint32_t index : { 0, 1, 2, 0, 2, 3 }) {
+                indices.push_back(firstVertex + index);
+            }
+        }
+    }
 
-        // TODO: separate materialInstances
-        MaterialInstance& materialInstance = backend->materials->materials[Materials::DEFAULT_LIT].instances.emplace_back();
-        materialInstance.meshInstanceIndices.push_back(meshInstanceIndex);
+    Mesh mesh;
+    mesh.name = "placeholder";
+    mesh.vertices = vertices.data();
+    mesh.vertexCount = vertices.size();
+    mesh.indices = indices.data();
+    mesh.indexCount = indices.size();
+    mesh.computeBounds();
 
-        // TODO: some creator for materialInstance
-        for (auto defaultTexture : backend->materials->materials[Materials::DEFAULT_LIT].defaultTextures) {
-            materialInstance.textures[defaultTexture.first] = defaultTexture.second;
+    return mesh;
+}
+
+uint32_t Scene::addMaterialInstance(const MeshMaterial& meshMaterial, uint32_t meshInstanceIndex, std::unordered_map<std::string, DecodedImage>* images) {
+    uint32_t materialInstanceIndex = backend->materials->materials[Materials::DEFAULT_LIT].instances.size();
+
+    // TODO: separate materialInstances
+    MaterialInstance& materialInstance = backend->materials->materials[Materials::DEFAULT_LIT].instances.emplace_back();
+    materialInstance.meshInstanceIndices.push_back(meshInstanceIndex);
+
+    // TODO: some creator for materialInstance
+    for (auto defaultTexture : backend->materials->materials[Materials::DEFAULT_LIT].defaultTextures) {
+        materialInstance.textures[defaultTexture.first] = defaultTexture.second;
+    }
+
+    // Pixels decoded in the background are preferred, so that the main thread doesn't hit the disk
+    // Every mip the texture has. Equal for all textures, so they share one sampler
+    VkSamplerCreateInfo samplerInfo = samplerCreateInfo(VK_FILTER_NEAREST, VK_SAMPLER_ADDRESS_MODE_REPEAT, VK_LOD_CLAMP_NONE);
+    auto loadTexture = [&](const std::string& path) {
+        if (images != nullptr) {
+            auto image = images->find(path);
+            if (image != images->end()) {
+                return backend->textureCache->create(path, image->second, samplerInfo);
+            }
         }
+        return backend->textureCache->load(path, samplerInfo);
+    };
 
-        // Override the default textures
-        VkSamplerCreateInfo samplerInfo = samplerCreateInfo(VK_FILTER_NEAREST);
-        CacheLoadResult<SampledTexture> albedo = backend->textureCache->load(materialDir + "/../" + mesh.loaderMaterial.diffuse_texname.c_str(), samplerInfo);
+    // Override the default textures
+    if (!meshMaterial.albedoTexture.empty()) {
+        CacheLoadResult<SampledTexture> albedo = loadTexture(meshMaterial.albedoTexture);
         if (albedo.success) {
             materialInstance.textures["albedo"] = albedo.data;
         }
-        CacheLoadResult<SampledTexture> normal = backend->textureCache->load(materialDir + "/../" + mesh.loaderMaterial.bump_texname.c_str(), samplerInfo);
+    }
+    if (!meshMaterial.normalTexture.empty()) {
+        CacheLoadResult<SampledTexture> normal = loadTexture(meshMaterial.normalTexture);
         if (normal.success) {
             materialInstance.textures["normal"] = normal.data;
         }
+    }
 
-        // TEMP
-        VkDescriptorImageInfo albedoDescriptorInfo = {};
-        albedoDescriptorInfo.sampler = materialInstance.textures["albedo"]->sampler;
-        albedoDescriptorInfo.imageView = materialInstance.textures["albedo"]->texture->view;
-        albedoDescriptorInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    for (auto& texture : materialInstance.textures) {
+        materialInstance.uploadTicket = std::max(materialInstance.uploadTicket, texture.second->texture->uploadTicket);
+    }
 
-        //VkDescriptorImageInfo normalDescriptorInfo = {};
-        //normalDescriptorInfo.sampler = normal.data->sampler;
-        //normalDescriptorInfo.imageView = normal.data->texture->view;
-        //normalDescriptorInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    // Shaders find the textures through the material table
+    GPUMaterialData materialData = {};
+    auto bindlessIndex = [&](const char* textureName) {
+        auto texture = materialInstance.textures.find(textureName);
+        return texture != materialInstance.textures.end() ? texture->second->bindlessIndex : BindlessResources::DEFAULT_TEXTURE;
+    };
+    materialData.albedoTexture = bindlessIndex("albedo");
+    materialData.normalTexture = bindlessIndex("normal");
+    materialInstance.materialIndex = backend->bindless->registerMaterial(materialData);
+
+    return materialInstanceIndex;
+}
 
-        DescriptorSetBuilder::begin(backend->device, *backend->descriptorSetLayoutCache, *backend->descriptorSetAllocator)
-            .bindImages(&albedoDescriptorInfo, 1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 0)
-            //.bindImages(&normalDescriptorInfo, 1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 1)
-            .build(&materialInstance.textureDescriptorSet);
+uint32_t Scene::addObject(std::string meshName, std::string materialDir, bool separateMaterialInstances, bool loadInBackground) {
+    uint32_t objectIndex = objects.size();
+    Object& object = objects.emplace_back();
+    object.objectDataIndices.push_back(objectData.pushBackDefaults());
 
-        // TODO: stupid -- for testing only. Once we cache meshes we can simply add to objectIndices 
-        meshInstances.push_back(MeshInstances{ mesh, std::vector<uint32_t>{ object.objectDataIndex } });
+    if (!loadInBackground) {
+        LoadedObject loaded;
+        loaded.objectIndex = objectIndex;
+        loaded.model.load(meshName.c_str(), materialDir.c_str(), backend->threadPool);
+        // Asked for synchronously, so no upload budget
+        finishLoading(loaded, UINT64_MAX);
 
-        object.meshInstanceIndices.push_back(meshInstanceIndex);
-        object.materialInstanceIndices.push_back(materialInstanceIndex);
+        return objectIndex;
+    }
+
+    if (placeholderMeshInstanceIndex == UINT32_MAX) {
+        Mesh mesh = placeholderMesh();
+        backend->uploadMesh(mesh);
+
+        placeholderMeshInstanceIndex = meshInstances.size();
+        uint32_t materialInstanceIndex = addMaterialInstance(mesh.material, placeholderMeshInstanceIndex, nullptr);
+        meshInstances.push_back(MeshInstances{ mesh, {}, &backend->materials->materials[Materials::DEFAULT_LIT], materialInstanceIndex });
+        placeholderUploaded = true;
+    } else if (!placeholderUploaded) {
+        // Released once the last placeholder went away, the instance and its material are kept
+        Mesh mesh = placeholderMesh();
+        backend->uploadMesh(mesh);
+        meshInstances[placeholderMeshInstanceIndex].mesh = mesh;
+        placeholderUploaded = true;
     }
-    
-    return object;
+    attachObject(placeholderMeshInstanceIndex, object.objectDataIndices[0]);
+
+    ThreadPool* threadPool = backend->threadPool;
+    threadPool->enqueue([=]() {
+        auto loaded = std::make_unique<LoadedObject>();
+        loaded->objectIndex = objectIndex;
+        loaded->model.load(meshName.c_str(), materialDir.c_str(), threadPool);
+
+        // Each texture only once, even if shared between meshes
+        for (const Mesh& mesh : loaded->model.meshes) {
+            for (const std::string& path : { mesh.material.albedoTexture, mesh.material.normalTexture }) {
+                if (!path.empty()) {
+                    loaded->images.emplace(path, DecodedImage());
+                }
+            }
+        }
+        std::vector<std::pair<const std::string, DecodedImage>*> images;
+        for (auto& image : loaded->images) {
+            images.push_back(&image);
+        }
+        threadPool->parallelFor(images.size(), [&](size_t i) {
+            TextureCache::decode(images[i]->first, images[i]->second);
+        });
+
+        std::lock_guard<std::mutex> lock(loadedObjectsMutex);
+        loadedObjects.push_back(std::move(loaded));
+    });
+
+    return objectIndex;
 }
 
-void Scene::initTestScene() {
-    Object object = addObject("/home/savas/Projects/ignoramus_renderer/assets/sponza/sponza.obj", "/home/savas/Projects/ignoramus_renderer/assets/sponza");
+void Scene::attachObject(uint32_t meshInstanceIndex, uint32_t objectDataIndex) {
+    MeshInstances& instances = meshInstances[meshInstanceIndex];
+    instances.objectDataIndices.push_back(objectDataIndex);
+    if (objectDataIndex >= VulkanBackend::MAX_OBJECTS) {
+        return;
+    }
+    if (objectMeshInstances.size() <= objectDataIndex) {
+        objectMeshInstances.resize(objectDataIndex + 1);
+    }
+    objectMeshInstances[objectDataIndex].push_back(meshInstanceIndex);
+
+    Material& material = *instances.material;
+    MaterialInstance& materialInstance = material.instances[instances.materialInstanceIndex];
+
+    Draw draw;
+    draw.materialIndex = materialInstance.materialIndex;
+    draw.objectIndex = objectDataIndex;
+    draw.geometry = instances.mesh.geometry;
+    draw.uploadTicket = std::max(instances.mesh.uploadTicket, materialInstance.uploadTicket);
+    draw.meshBounds = glm::vec4(instances.mesh.bounds.center(), instances.mesh.bounds.radius());
+
+    glm::vec3 center;
+    float radius;
+    worldBounds(meshInstanceIndex, objectDataIndex, center, radius);
+
+    std::vector<DrawList::DrawId>& draws = meshObjectDraws[meshObjectKey(meshInstanceIndex, objectDataIndex)];
+    for (uint8_t passIndex = 0; passIndex < (uint8_t)PassType::PASS_COUNT; ++passIndex) {
+        // Materials like blit are drawn elsewhere and don't use the bindless set
+        draw.shaderPass = material.perPassShaders[passIndex];
+        if (draw.shaderPass == nullptr) {
+            continue;
+        }
+
+        draws.push_back(drawList.add(passIndex, meshInstanceIndex, draw, center, radius));
+    }
+    objectBvh.update(objectDataIndex, objectBounds(objectDataIndex));
 }
 
-glm::vec3 right(glm::mat4 mat) {
-    return mat * glm::vec4(1.f, 0.f, 0.f, 0.f);
+void Scene::worldBounds(uint32_t meshInstanceIndex, uint32_t objectDataIndex, glm::vec3& center, float& radius) {
+    const MeshBounds& bounds = meshInstances[meshInstanceIndex].mesh.bounds;
+    transformSphere(objectData.modelMatrix(objectDataIndex), bounds.center(), bounds.radius(), center, radius);
 }
 
-glm::vec3 up(glm::mat4 mat) {
-    return mat * glm::vec4(0.f, 1.f, 0.f, 0.f);
+Aabb Scene::objectBounds(uint32_t objectDataIndex) {
+    Aabb bounds;
+    if (objectDataIndex >= objectMeshInstances.size()) {
+        return bounds;
+    }
+
+    const glm::mat4& modelMatrix = objectData.modelMatrix(objectDataIndex);
+    for (uint32_t meshInstanceIndex : objectMeshInstances[objectDataIndex]) {
+        const MeshBounds& meshBounds = meshInstances[meshInstanceIndex].mesh.bounds;
+        bounds.grow(transformBox(modelMatrix, meshBounds.min, meshBounds.max));
+    }
+    return bounds;
 }
 
-glm::vec3 forward(glm::mat4 mat) {
-    return mat * glm::vec4(0.f, 0.f, -1.f, 0.f);
+void Scene::detachObject(uint32_t meshInstanceIndex, uint32_t objectDataIndex) {
+    std::vector<uint32_t>& objectDataIndices = meshInstances[meshInstanceIndex].objectDataIndices;
+    objectDataIndices.erase(std::remove(objectDataIndices.begin(), objectDataIndices.end(), objectDataIndex), objectDataIndices.end());
+
+    auto draws = meshObjectDraws.find(meshObjectKey(meshInstanceIndex, objectDataIndex));
+    if (draws == meshObjectDraws.end()) {
+        return;
+    }
+    std::vector<uint32_t>& attached = objectMeshInstances[objectDataIndex];
+    attached.erase(std::remove(attached.begin(), attached.end(), meshInstanceIndex), attached.end());
+    for (DrawList::DrawId id : draws->second) {
+        drawList.remove(id);
+    }
+    meshObjectDraws.erase(draws);
+    objectBvh.update(objectDataIndex, objectBounds(objectDataIndex));
+}
+
+bool Scene::finishLoading(LoadedObject& loaded, uint64_t budgetEnd) {
+    // TODO: we need to cache meshes
+    Object& object = objects[loaded.objectIndex];
+
+    Model& model = loaded.model;
+    for (; loaded.finishedMeshes < model.meshes.size(); ++loaded.finishedMeshes) {
+        // Checked before each mesh, so that a mesh bigger than the budget still makes it eventually
+        if (backend->uploads->stagingHead >= budgetEnd) {
+            return false;
+        }
+
+        Mesh& mesh = model.meshes[loaded.finishedMeshes];
+        //printf("uploading mesh %s\n", mesh.name.c_str());
+        backend->uploadMesh(mesh);
+
+        uint32_t meshInstanceIndex = meshInstances.size();
+        uint32_t materialInstanceIndex = addMaterialInstance(mesh.material, meshInstanceIndex, &loaded.images);
+
+        // Objects get attached below, once per node referencing the mesh
+        meshInstances.push_back(MeshInstances{ mesh, {}, &backend->materials->materials[Materials::DEFAULT_LIT], materialInstanceIndex });
+
+        object.meshInstanceIndices.push_back(meshInstanceIndex);
+        object.materialInstanceIndices.push_back(materialInstanceIndex);
+
+        loaded.uploadTicket = std::max(loaded.uploadTicket, mesh.uploadTicket);
+        loaded.uploadTicket = std::max(loaded.uploadTicket, backend->materials->materials[Materials::DEFAULT_LIT].instances[materialInstanceIndex].uploadTicket);
+    }
+
+    // Whatever didn't get used, e.g. textures that only failed meshes referenced
+    for (auto& image : loaded.images) {
+        TextureCache::freeDecoded(image.second);
+    }
+
+    for (size_t i = 0; i < model.nodes.size(); ++i) {
+        const ModelNode& node = model.nodes[i];
+
+        // The first node takes over the slot the object got on creation
+        uint32_t objectDataIndex = i == 0 ? object.objectDataIndices[0] : objectData.pushBackDefaults();
+        objectData.positions[objectDataIndex] = node.position;
+        objectData.rotations[objectDataIndex] = node.rotation;
+        objectData.scales[objectDataIndex] = node.scale;
+        objectData.invalidate(objectDataIndex);
+
+        for (uint32_t m = node.firstMesh; m < node.firstMesh + node.meshCount; ++m) {
+            attachObject(object.meshInstanceIndices[m], objectDataIndex);
+        }
+        if (i != 0) {
+            object.objectDataIndices.push_back(objectDataIndex);
+        }
+    }
+    object.loaded = true;
+
+    pendingObjects.push_back(PendingObject{ loaded.objectIndex, loaded.uploadTicket });
+    return true;
+}
+
+void Scene::initTestScene() {
+    addObject("/home/savas/Projects/ignoramus_renderer/assets/sponza/sponza.obj", "/home/savas/Projects/ignoramus_renderer/assets/sponza");
 }
 
 void Scene::update(float dt) {
+    {
+        std::lock_guard<std::mutex> lock(loadedObjectsMutex);
+        for (auto& loadedObject : loadedObjects) {
+            finishingObjects.push_back(std::move(loadedObject));
+        }
+        loadedObjects.clear();
+    }
+    uint64_t budgetEnd = backend->uploads->stagingHead + UPLOAD_BUDGET_PER_FRAME;
+    while (!finishingObjects.empty() && finishLoading(*finishingObjects.front(), budgetEnd)) {
+        finishingObjects.pop_front();
+    }
+
+    // Drop the placeholders of objects whose resources made it to the GPU
+    for (size_t i = 0; i < pendingObjects.size();) {
+        if (!backend->uploads->isRetired(pendingObjects[i].uploadTicket)) {
+            ++i;
+            continue;
+        }
+
+        if (placeholderMeshInstanceIndex != UINT32_MAX) {
+            detachObject(placeholderMeshInstanceIndex, objects[pendingObjects[i].objectIndex].objectDataIndices[0]);
+        }
+
+        pendingObjects[i] = pendingObjects.back();
+        pendingObjects.pop_back();
+    }
+    // Everything loaded, the placeholder's geometry can go until the next object comes along
+    if (placeholderUploaded && meshInstances[placeholderMeshInstanceIndex].objectDataIndices.empty()) {
+        backend->geometry->free(meshInstances[placeholderMeshInstanceIndex].mesh.geometry, backend->frameNumber);
+        placeholderUploaded = false;
+    }
+
     static glm::dvec2 lastMousePos = glm::vec2(-1.f -1.f);
     if (glfwGetMouseButton(backend->window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS) {
         static double radToVertical = .0;
@@ -153,7 +431,22 @@ void Scene::update(float dt) {
     mainCamera.pos += dir * mainCamera.moveSpeed * dt;
 }
 
-void Scene::draw(VkCommandBuffer cmd, FrameData& frameData) {
+template<typename IsVisible>
+void Scene::filterReady(IsVisible isVisible) {
+    waitingUploadTicket = 0;
+    drawList.filter([&](uint32_t drawIndex) {
+        // Geometry or textures still uploading
+        UploadTicket uploadTicket = drawList.draws[drawIndex].uploadTicket;
+        if (!backend->uploads->isRetired(uploadTicket)) {
+            // Tickets retire in order, so the earliest one is the first to make a difference
+            waitingUploadTicket = waitingUploadTicket == 0 ? uploadTicket : std::min(waitingUploadTicket, uploadTicket);
+            return false;
+        }
+        return isVisible(drawIndex);
+    });
+}
+
+void Scene::prepare(VkCommandBuffer cmd, FrameData& frameData) {
     glm::mat4 view = glm::lookAt(mainCamera.pos, mainCamera.pos + forward(mainCamera.rotation), up(mainCamera.rotation));
     glm::mat4 projection = glm::perspective(glm::radians(70.f), 1700.f / 900.f, 0.1f, 20000.f);
     projection[1][1] *= -1; 
@@ -166,74 +459,140 @@ void Scene::draw(VkCommandBuffer cmd, FrameData& frameData) {
     backend->uploadData((void*)&cameraData, sizeof(GPUCameraData), 0, frameData.cameraUBO.allocation);
 
     backend->sceneParams.ambientColor = glm::vec4(0.f, 0.f, 0.f, 1.f);
-    uint32_t sceneParamsUniformOffset = backend->padUniformBufferSize(sizeof(GPUSceneData)) * (backend->frameNumber % VulkanBackend::MAX_FRAMES_IN_FLIGHT);
+    sceneParamsUniformOffset = backend->padUniformBufferSize(sizeof(GPUSceneData)) * (backend->frameNumber % VulkanBackend::MAX_FRAMES_IN_FLIGHT);
     backend->uploadData((void*)&backend->sceneParams, sizeof(GPUSceneData), sceneParamsUniformOffset, backend->sceneParamsBuffers.allocation);
 
-    // TODO: redo object data into a SoA so that we can just upload the matrix array here.
-    {
-        void* gpuData;
-        vmaMapMemory(backend->allocator, frameData.objectDataBuffer.allocation, &gpuData);
-        GPUObjectData* gpuObjectData = (GPUObjectData*)gpuData;
-
-        // TODO: Probably make another set of arrays for dirty data. At the moment nices way
-        // to prevent from having to do this every frame on all objects
-        for (size_t i = 0; i < objectData.isValidModelMatrixCache.size(); ++i) {
-            if (!objectData.isValidModelMatrixCache[i]) {
-                objectData.modelMatrixCache[i] = glm::translate(objectData.positions[i]) * 
-                    objectData.rotations[i] * 
-                    glm::scale(objectData.scales[i]);
-                objectData.isValidModelMatrixCache[i] = true;
+    // Only objects that changed are touched, so the cost doesn't grow with the object count.
+    // Every frame in flight has its own copy of the object data, which gets them once it comes around
+    for (uint32_t objectDataIndex : objectData.changed) {
+        if (objectDataIndex >= VulkanBackend::MAX_OBJECTS) {
+            continue;
+        }
+
+        objectData.modelMatrix(objectDataIndex);
+        if (objectDataIndex < objectMeshInstances.size()) {
+            for (uint32_t meshInstanceIndex : objectMeshInstances[objectDataIndex]) {
+                auto draws = meshObjectDraws.find(meshObjectKey(meshInstanceIndex, objectDataIndex));
+                if (draws == meshObjectDraws.end()) {
+                    continue;
+                }
+
+                glm::vec3 center;
+                float radius;
+                worldBounds(meshInstanceIndex, objectDataIndex, center, radius);
+                for (DrawList::DrawId id : draws->second) {
+                    drawList.setBounds(id, center, radius);
+                }
             }
+            objectBvh.update(objectDataIndex, objectBounds(objectDataIndex));
+        }
 
-            gpuObjectData[i].modelMatrix = objectData.modelMatrixCache[i];
+        for (FrameData& frame : backend->inFlightFrames) {
+            frame.dirtyObjects.push_back(objectDataIndex);
         }
-        vmaUnmapMemory(backend->allocator, frameData.objectDataBuffer.allocation);
     }
+    objectData.changed.clear();
 
-    // TODO: okay, well this performs absolutely horribly. Need to move materials to
-    // a per pass array at the very least. 
-    for (uint8_t passIndex = 0; passIndex < (uint8_t)PassType::PASS_COUNT; ++passIndex) {
-        for (auto& mat : backend->materials->materials) {
-            Material& material = mat.second;
+    // TODO: redo object data into a SoA so that we can just upload the matrix array here.
+    if (!frameData.dirtyObjects.empty()) {
+        GPUObjectData* gpuObjectData;
+        vmaMapMemory(backend->allocator, frameData.objectDataBuffer.allocation, (void**)&gpuObjectData);
+        for (uint32_t objectDataIndex : frameData.dirtyObjects) {
+            gpuObjectData[objectDataIndex].modelMatrix = objectData.modelMatrixCache[objectDataIndex];
+        }
+        vmaUnmapMemory(backend->allocator, frameData.objectDataBuffer.allocation);
+        frameData.dirtyObjects.clear();
+    }
 
-            ShaderPass* shaderPass = material.perPassShaders[passIndex];
-            if (shaderPass == nullptr) {
-                continue;
-            }
+    // Only re-sorts if anything got attached or detached since the last frame
+    bool sorted = drawList.sort();
+    // Only touches the leaves of objects that moved, unless objects came or went
+    objectBvh.refit();
+    bool uploadsRetired = waitingUploadTicket != 0 && backend->uploads->isRetired(waitingUploadTicket);
+
+    cullingStats = CullingStats();
+    cullingStats.tested = drawList.entries.size();
+    indirectCommands = VK_NULL_HANDLE;
+    if (gpuCulling && backend->gpuCulling != nullptr) {
+        // Culling doesn't change the batches, so they're only rebuilt when the draw list does
+        if (sorted || uploadsRetired || batchesCulled) {
+            filterReady([](uint32_t drawIndex) { return true; });
+            drawList.batch(VulkanBackend::MAX_INSTANCES, GPUCulling::MAX_BATCHES);
+            batchesCulled = false;
+        }
 
-            vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, shaderPass->pipeline);
-            vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, shaderPass->info->layout,
-                0, 1, &frameData.globalDescriptor, 1, &sceneParamsUniformOffset);
-
-            vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, shaderPass->info->layout,
-                1, 1, &frameData.objectDescriptor, 0, nullptr);
-            //material.bindDescriptorSets(pass);
-
-            // TODO: push all metrial instances and then draw with a single draw call
-            // TODO: cache the resulting draw calls and only invalidate the cache once objects
-            // get added / removed... Weeeeeeell might get a little bit more complicated when doing culling
-            for (auto& materialInstance : material.instances) {
-                //materialInstance.bindBuffers();
-                //materialInstance.bindImages();
-                vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, shaderPass->info->layout,
-                        2, 1, &materialInstance.textureDescriptorSet, 0, nullptr);
-
-                // TODO: merge into a single draw call -- simple just write objectIds into a buffer
-                MeshInstances* lastMeshInstances = nullptr;
-                for (uint32_t meshInstanceIndex : materialInstance.meshInstanceIndices) {
-                    MeshInstances& instances = meshInstances[meshInstanceIndex];
-                    if (&instances != lastMeshInstances) {
-                        VkDeviceSize offset = 0;
-                        vkCmdBindVertexBuffers(cmd, 0, 1, &instances.mesh.vertexBuffer.buffer, &offset);
-                        lastMeshInstances = &instances;
+        uint32_t frameIndex = backend->frameNumber % VulkanBackend::MAX_FRAMES_IN_FLIGHT;
+        backend->gpuCulling->readStats(frameIndex, cullingStats.visible, cullingStats.occluded);
+        indirectCommands = backend->gpuCulling->cull(cmd, frameIndex, drawList, cameraData.viewProjection, occlusionCulling);
+    } else {
+        Frustum frustum = Frustum::fromViewProjection(cameraData.viewProjection);
+        if (hierarchicalCulling) {
+            // Objects the frustum cuts through get their draws tested one by one, the rest take the object's result
+            drawList.resetInFrustum();
+            objectBvh.cull(frustum, [&](uint32_t objectDataIndex, bool inside) {
+                for (uint32_t meshInstanceIndex : objectMeshInstances[objectDataIndex]) {
+                    auto draws = meshObjectDraws.find(meshObjectKey(meshInstanceIndex, objectDataIndex));
+                    if (draws == meshObjectDraws.end()) {
+                        continue;
                     }
-
-                    for (uint32_t objectIndex : instances.objectDataIndices) {
-                        // TODO: bind object data?
-                        vkCmdDraw(cmd, instances.mesh.vertices.size(), 1, 0, objectIndex);
+                    for (DrawList::DrawId id : draws->second) {
+                        drawList.inFrustum[id] = inside || drawList.intersects(id, frustum);
                     }
                 }
-            }
+            });
+        } else {
+            drawList.cull(frustum);
         }
+        filterReady([&](uint32_t drawIndex) { return drawList.inFrustum[drawIndex] != 0; });
+        drawList.batch(VulkanBackend::MAX_INSTANCES);
+        batchesCulled = true;
+        cullingStats.visible = drawList.visible.size();
     }
 }
+
+bool Scene::prepareLate(VkCommandBuffer cmd, FrameData& frameData) {
+    if (indirectCommands == VK_NULL_HANDLE || !occlusionCulling) {
+        return false;
+    }
+
+    uint32_t frameIndex = backend->frameNumber % VulkanBackend::MAX_FRAMES_IN_FLIGHT;
+    return backend->gpuCulling->cullLate(cmd, frameIndex);
+}
+
+DrawListBindings Scene::drawListBindings(FrameData& frameData) const {
+    DrawListBindings bindings;
+    bindings.globalSet = frameData.globalDescriptor;
+    bindings.sceneParamsOffset = sceneParamsUniformOffset;
+    bindings.objectSet = frameData.objectDescriptor;
+    bindings.bindlessSet = backend->bindless->set;
+
+    return bindings;
+}
+
+void Scene::draw(VkCommandBuffer cmd, FrameData& frameData) {
+    DrawListBindings bindings = drawListBindings(frameData);
+
+    if (indirectCommands != VK_NULL_HANDLE) {
+        cullingStats.drawCalls = drawList.recordIndirect(cmd, bindings, *backend->geometry, indirectCommands);
+        return;
+    }
+
+    GPUInstanceData* instances;
+    vmaMapMemory(backend->allocator, frameData.instanceBuffer.allocation, (void**)&instances);
+    cullingStats.drawCalls = drawList.record(cmd, bindings, *backend->geometry, instances);
+    vmaUnmapMemory(backend->allocator, frameData.instanceBuffer.allocation);
+}
+
+void Scene::drawLate(VkCommandBuffer cmd, FrameData& frameData) {
+    cullingStats.drawCalls += drawList.recordIndirect(cmd, drawListBindings(frameData), *backend->geometry, indirectCommands,
+        GPUCulling::lateCommandsOffset());
+}
+
+uint32_t Scene::pick(const glm::vec3& origin, const glm::vec3& direction, float& distance) const {
+    uint32_t objectDataIndex = objectBvh.raycast(origin, direction, distance);
+    return objectDataIndex == BVH::INVALID ? UINT32_MAX : objectDataIndex;
+}
+
+void Scene::objectsInRange(const Aabb& range, std::vector<uint32_t>& objectDataIndices) const {
+    objectBvh.query(range, objectDataIndices);
+}
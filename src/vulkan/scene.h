@@ -1,10 +1,15 @@
 #pragma once
 
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <unordered_map>
 
 #include "types.h"
+#include "bvh.h"
+#include "draw_list.h"
 #include "texture.h"
 #include "material.h"
 
@@ -23,8 +28,12 @@ struct Camera {
 };
 
 struct MeshInstances {
+    // Uploaded, so only the geometry and bounds are left
     Mesh mesh;
     std::vector<uint32_t> objectDataIndices;
+
+    Material* material;
+    uint32_t materialInstanceIndex;
 };
 
 struct ObjectData {
@@ -34,9 +43,27 @@ struct ObjectData {
 
     std::vector<bool> isValidModelMatrixCache;
     std::vector<glm::mat4> modelMatrixCache;
-    bool anyModelMatricesInvalid = true;
+    // Objects added or invalidated since the scene last picked them up, might contain duplicates
+    std::vector<uint32_t> changed;
 
     size_t pushBackDefaults();
+    // Has to be called after changing the position, rotation or scale
+    void invalidate(size_t i);
+    // Recomputes the cached matrix if needed
+    const glm::mat4& modelMatrix(size_t i);
+};
+
+// A model parsed and with its textures decoded on a worker, waiting for the main thread to create
+// the GPU resources
+struct LoadedObject {
+    uint32_t objectIndex;
+    Model model;
+    // Keyed by path. Failed decodes are kept without pixels, so that the main thread doesn't retry
+    std::unordered_map<std::string, DecodedImage> images;
+
+    // Meshes before this one are uploaded already, big models take a few frames
+    size_t finishedMeshes = 0;
+    UploadTicket uploadTicket = 0;
 };
 
 struct VulkanBackend;
@@ -49,6 +76,16 @@ struct Scene {
     std::vector<Material*> passMaterials[static_cast<size_t>(PassType::PASS_COUNT)];
     std::vector<MeshInstances> meshInstances;
     ObjectData objectData;
+    // Patched through attachObject()/detachObject(), never rebuilt from scratch
+    DrawList drawList;
+    // Culls in a compute shader and draws indirectly if the backend could set that up
+    bool gpuCulling = true;
+    // Tests the draws against a depth pyramid as well, GPU culling only
+    bool occlusionCulling = true;
+    // CPU culling walks the object BVH instead of testing every draw
+    bool hierarchicalCulling = true;
+    // Of the last frame. With GPU culling the visible count lags behind by the frames in flight
+    CullingStats cullingStats;
 
     Scene(VulkanBackend* backend = nullptr) : backend(backend) {}
     void initTestScene();
@@ -57,10 +94,88 @@ struct Scene {
         std::string materialName;
         std::vector<uint32_t> materialInstanceIndices;
         std::vector<uint32_t> meshInstanceIndices;
-        uint32_t objectDataIndex;
+        // One per model node. The first one exists from the start, the rest once loaded
+        std::vector<uint32_t> objectDataIndices;
+        bool loaded = false;
     };
-    Object addObject(std::string meshName, std::string materialDir, bool separateMaterialInstances = false);
+    std::vector<Object> objects;
+
+    // Returns an index into objects. In the background the object shows up as a placeholder right away
+    // and gets filled in once its model and textures are loaded
+    uint32_t addObject(std::string meshName, std::string materialDir, bool separateMaterialInstances = false, bool loadInBackground = true);
     
     void update(float dt);
+    // Uploads the frame's data and culls. Has to be recorded outside of any render pass
+    void prepare(VkCommandBuffer cmd, FrameData& frameData);
     void draw(VkCommandBuffer cmd, FrameData& frameData);
+    // After draw()'s render pass ended, culls what occlusion culling held back against this frame's depth.
+    // Has to be recorded outside of any render pass. False if there is nothing for drawLate()
+    bool prepareLate(VkCommandBuffer cmd, FrameData& frameData);
+    // Into the same attachments as draw(), loaded instead of cleared
+    void drawLate(VkCommandBuffer cmd, FrameData& frameData);
+
+    // Nearest object whose bounds the ray hits, as an index into objectData. UINT32_MAX if none.
+    // As of the last prepare()
+    uint32_t pick(const glm::vec3& origin, const glm::vec3& direction, float& distance) const;
+    // Appends the objects whose bounds overlap range, as indices into objectData
+    void objectsInRange(const Aabb& range, std::vector<uint32_t>& objectDataIndices) const;
+
+private:
+    // Filled by workers, drained in update()
+    std::mutex loadedObjectsMutex;
+    std::vector<std::unique_ptr<LoadedObject>> loadedObjects;
+
+    // Staged upload bytes per frame that finishing loaded objects may take. Uploading all of a big model
+    // in the frame its decode finished would stall that frame
+    static constexpr uint64_t UPLOAD_BUDGET_PER_FRAME = 16 * 1024 * 1024;
+    // Loaded objects whose meshes and textures are being uploaded, oldest first
+    std::deque<std::unique_ptr<LoadedObject>> finishingObjects;
+
+    // Objects whose resources are created but still uploading. They keep their placeholder until then
+    struct PendingObject {
+        uint32_t objectIndex;
+        UploadTicket uploadTicket;
+    };
+    std::vector<PendingObject> pendingObjects;
+
+    uint32_t placeholderMeshInstanceIndex = UINT32_MAX;
+    // False while no object needs it, its geometry is freed then
+    bool placeholderUploaded = false;
+    Mesh placeholderMesh();
+
+    // Mesh instances attached to each object, indexed like objectData
+    std::vector<std::vector<uint32_t>> objectMeshInstances;
+    // Draws of every mesh instance/object pair, keyed by meshObjectKey()
+    std::unordered_map<uint64_t, std::vector<DrawList::DrawId>> meshObjectDraws;
+    static uint64_t meshObjectKey(uint32_t meshInstanceIndex, uint32_t objectDataIndex) {
+        return ((uint64_t)meshInstanceIndex << 32) | objectDataIndex;
+    }
+
+    // Draws the mesh instance at the object, once for every pass of its material
+    void attachObject(uint32_t meshInstanceIndex, uint32_t objectDataIndex);
+    void detachObject(uint32_t meshInstanceIndex, uint32_t objectDataIndex);
+    // Bounds of the mesh instance placed at the object
+    void worldBounds(uint32_t meshInstanceIndex, uint32_t objectDataIndex, glm::vec3& center, float& radius);
+    // Of all the mesh instances attached to the object, world space
+    Aabb objectBounds(uint32_t objectDataIndex);
+
+    // Over objectBounds(), indexed like objectData. Updated with the draw list's bounds, refit by prepare()
+    BVH objectBvh;
+
+    // Earliest upload that kept draws out of the batches, they're rebuilt once it retired
+    UploadTicket waitingUploadTicket = 0;
+    // The batches only hold draws that passed CPU culling, GPU culling needs all of them
+    bool batchesCulled = false;
+    // Set by prepare() for draw()
+    uint32_t sceneParamsUniformOffset = 0;
+    VkBuffer indirectCommands = VK_NULL_HANDLE;
+    DrawListBindings drawListBindings(FrameData& frameData) const;
+
+    // Filters the draw list down to the draws whose uploads retired, and those isVisible returns true for
+    template<typename IsVisible>
+    void filterReady(IsVisible isVisible);
+
+    // Uploads meshes until the staging ring got to budgetEnd. Returns whether the object is done
+    bool finishLoading(LoadedObject& loaded, uint64_t budgetEnd);
+    uint32_t addMaterialInstance(const MeshMaterial& meshMaterial, uint32_t meshInstanceIndex, std::unordered_map<std::string, DecodedImage>* images);
 };
@@ -0,0 +1,181 @@
+#include <fstream>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "spirv_reflect.h"
+
+#include "vulkan/mapped_file.h"
+#include "vulkan/shader_reflection.h"
+#include "vulkan/vk_init_helpers.h"
+
+bool reflectShader(const std::vector<uint32_t>& spirvCode, ShaderReflection& reflection) {
+    SpvReflectShaderModule module;
+    if (spvReflectCreateShaderModule(spirvCode.size() * sizeof(uint32_t), spirvCode.data(), &module) != SPV_REFLECT_RESULT_SUCCESS) {
+        return false;
+    }
+
+    reflection.stage = static_cast<VkShaderStageFlagBits>(module.shader_stage);
+    reflection.bindings.clear();
+    reflection.pushConstants.clear();
+
+    bool success = true;
+    uint32_t reflectedSetCount = 0;
+    std::vector<SpvReflectDescriptorSet*> reflectedSets;
+    success &= spvReflectEnumerateDescriptorSets(&module, &reflectedSetCount, nullptr) == SPV_REFLECT_RESULT_SUCCESS;
+    reflectedSets.resize(reflectedSetCount);
+    success &= spvReflectEnumerateDescriptorSets(&module, &reflectedSetCount, reflectedSets.data()) == SPV_REFLECT_RESULT_SUCCESS;
+
+    for (SpvReflectDescriptorSet* reflectedSet : reflectedSets) {
+        if (!success || reflectedSet == nullptr) {
+            continue;
+        }
+
+        for (uint32_t bindingIdx = 0; bindingIdx < reflectedSet->binding_count; ++bindingIdx) {
+            SpvReflectDescriptorBinding* reflectedBinding = reflectedSet->bindings[bindingIdx];
+
+            ShaderReflection::Binding& binding = reflection.bindings.emplace_back();
+            binding.setIndex = reflectedSet->set;
+            binding.name = reflectedBinding->name;
+            binding.binding = descriptorSetLayoutBinding(static_cast<VkDescriptorType>(reflectedBinding->descriptor_type),
+                reflection.stage, reflectedBinding->binding);
+            // Arrays take one descriptor per element
+            binding.binding.descriptorCount = 1;
+            for (uint32_t dimIdx = 0; dimIdx < reflectedBinding->array.dims_count; ++dimIdx) {
+                binding.binding.descriptorCount *= reflectedBinding->array.dims[dimIdx];
+            }
+        }
+    }
+
+    uint32_t reflectedBlockCount = 0;
+    std::vector<SpvReflectBlockVariable*> reflectedBlocks;
+    success &= spvReflectEnumeratePushConstantBlocks(&module, &reflectedBlockCount, nullptr) == SPV_REFLECT_RESULT_SUCCESS;
+    reflectedBlocks.resize(reflectedBlockCount);
+    success &= spvReflectEnumeratePushConstantBlocks(&module, &reflectedBlockCount, reflectedBlocks.data()) == SPV_REFLECT_RESULT_SUCCESS;
+
+    for (SpvReflectBlockVariable* reflectedBlock : reflectedBlocks) {
+        if (!success || reflectedBlock == nullptr || reflectedBlock->size == 0) {
+            continue;
+        }
+
+        reflection.pushConstants.push_back(VkPushConstantRange{ static_cast<VkShaderStageFlags>(reflection.stage),
+            reflectedBlock->offset, reflectedBlock->size });
+    }
+
+    spvReflectDestroyShaderModule(&module);
+
+    return success;
+}
+
+bool loadShaderReflection(const char* path, uint64_t spirvHash, ShaderReflection& reflection) {
+    MappedFile file;
+    if (!file.open(path)) {
+        return false;
+    }
+
+    if (file.size < sizeof(ShaderReflectionHeader)) {
+        printf("Ignoring shader reflection %s - truncated\n", path);
+        return false;
+    }
+    const ShaderReflectionHeader& header = *(const ShaderReflectionHeader*)file.data;
+    if (memcmp(header.magic, SHADER_REFLECTION_MAGIC, sizeof(SHADER_REFLECTION_MAGIC)) != 0
+        || header.version != SHADER_REFLECTION_VERSION) {
+        printf("Ignoring shader reflection %s - incompatible\n", path);
+        return false;
+    }
+    if (header.spirvHash != spirvHash) {
+        printf("Ignoring shader reflection %s - stale\n", path);
+        return false;
+    }
+
+    const uint64_t bindingsOffset = sizeof(ShaderReflectionHeader);
+    const uint64_t pushConstantsOffset = bindingsOffset + (uint64_t)header.bindingCount * sizeof(CookedShaderBinding);
+    const uint64_t stringsOffset = pushConstantsOffset + (uint64_t)header.pushConstantCount * sizeof(CookedPushConstantBlock);
+    if (stringsOffset + header.stringsSize > file.size) {
+        printf("Ignoring shader reflection %s - corrupt\n", path);
+        return false;
+    }
+
+    const CookedShaderBinding* cookedBindings = (const CookedShaderBinding*)(file.data + bindingsOffset);
+    const CookedPushConstantBlock* cookedBlocks = (const CookedPushConstantBlock*)(file.data + pushConstantsOffset);
+    const char* strings = file.data + stringsOffset;
+
+    reflection.stage = static_cast<VkShaderStageFlagBits>(header.stage);
+    reflection.bindings.clear();
+    reflection.bindings.reserve(header.bindingCount);
+    for (uint32_t i = 0; i < header.bindingCount; ++i) {
+        const CookedShaderBinding& cookedBinding = cookedBindings[i];
+        if ((uint64_t)cookedBinding.nameOffset + cookedBinding.nameLength > header.stringsSize) {
+            printf("Ignoring shader reflection %s - corrupt binding %d\n", path, i);
+            reflection.bindings.clear();
+            return false;
+        }
+
+        ShaderReflection::Binding& binding = reflection.bindings.emplace_back();
+        binding.setIndex = cookedBinding.setIndex;
+        binding.name = std::string(strings + cookedBinding.nameOffset, cookedBinding.nameLength);
+        binding.binding = descriptorSetLayoutBinding(static_cast<VkDescriptorType>(cookedBinding.descriptorType),
+            reflection.stage, cookedBinding.binding);
+        binding.binding.descriptorCount = cookedBinding.descriptorCount;
+    }
+
+    reflection.pushConstants.clear();
+    for (uint32_t i = 0; i < header.pushConstantCount; ++i) {
+        reflection.pushConstants.push_back(VkPushConstantRange{ static_cast<VkShaderStageFlags>(reflection.stage),
+            cookedBlocks[i].offset, cookedBlocks[i].size });
+    }
+
+    return true;
+}
+
+bool writeShaderReflection(const char* path, uint64_t spirvHash, const ShaderReflection& reflection) {
+    ShaderReflectionHeader header = {};
+    memcpy(header.magic, SHADER_REFLECTION_MAGIC, sizeof(SHADER_REFLECTION_MAGIC));
+    header.version = SHADER_REFLECTION_VERSION;
+    header.spirvHash = spirvHash;
+    header.stage = reflection.stage;
+    header.bindingCount = reflection.bindings.size();
+    header.pushConstantCount = reflection.pushConstants.size();
+
+    std::vector<CookedShaderBinding> cookedBindings(reflection.bindings.size());
+    std::string strings;
+    for (size_t i = 0; i < reflection.bindings.size(); ++i) {
+        const ShaderReflection::Binding& binding = reflection.bindings[i];
+        CookedShaderBinding& cookedBinding = cookedBindings[i];
+
+        cookedBinding.setIndex = binding.setIndex;
+        cookedBinding.binding = binding.binding.binding;
+        cookedBinding.descriptorType = binding.binding.descriptorType;
+        cookedBinding.descriptorCount = binding.binding.descriptorCount;
+        cookedBinding.nameOffset = strings.size();
+        cookedBinding.nameLength = binding.name.size();
+        strings += binding.name;
+    }
+    header.stringsSize = strings.size();
+
+    std::vector<CookedPushConstantBlock> cookedBlocks(reflection.pushConstants.size());
+    for (size_t i = 0; i < reflection.pushConstants.size(); ++i) {
+        cookedBlocks[i].offset = reflection.pushConstants[i].offset;
+        cookedBlocks[i].size = reflection.pushConstants[i].size;
+    }
+
+    // Same as cooked models, never leave a half written file behind
+    std::string tmpPath = std::string(path) + ".tmp";
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)cookedBindings.data(), cookedBindings.size() * sizeof(CookedShaderBinding));
+    file.write((const char*)cookedBlocks.data(), cookedBlocks.size() * sizeof(CookedPushConstantBlock));
+    file.write(strings.data(), strings.size());
+    file.close();
+
+    if (file.fail() || rename(tmpPath.c_str(), path) != 0) {
+        unlink(tmpPath.c_str());
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+// Everything ShaderPassCache needs to know about a single module to build layouts from it
+struct ShaderReflection {
+    struct Binding {
+        uint32_t setIndex;
+        std::string name;
+        // stageFlags is the module's stage
+        VkDescriptorSetLayoutBinding binding;
+    };
+
+    VkShaderStageFlagBits stage;
+    std::vector<Binding> bindings;
+    // One range per push constant block, stageFlags is the module's stage
+    std::vector<VkPushConstantRange> pushConstants;
+};
+
+// Runs SPIRV-Reflect on the code
+bool reflectShader(const std::vector<uint32_t>& spirvCode, ShaderReflection& reflection);
+
+// Binary cache of a ShaderReflection, written next to the SPIR-V as "<spirv>.reflect" so that unchanged
+// shaders skip reflection on startup. Keyed by the SPIR-V's hash. Layout:
+//   ShaderReflectionHeader
+//   CookedShaderBinding[bindingCount]
+//   CookedPushConstantBlock[pushConstantCount]
+//   char strings[stringsSize]
+
+static constexpr char SHADER_REFLECTION_MAGIC[4] = { 'T', 'R', 'S', 'R' };
+// Bump whenever the layout below or what gets reflected changes
+static constexpr uint32_t SHADER_REFLECTION_VERSION = 1;
+
+struct ShaderReflectionHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t spirvHash;
+
+    uint32_t stage;
+    uint32_t bindingCount;
+    uint32_t pushConstantCount;
+    uint32_t stringsSize;
+};
+
+struct CookedShaderBinding {
+    uint32_t setIndex;
+    uint32_t binding;
+    uint32_t descriptorType;
+    uint32_t descriptorCount;
+
+    uint32_t nameOffset;
+    uint32_t nameLength;
+};
+
+struct CookedPushConstantBlock {
+    uint32_t offset;
+    uint32_t size;
+};
+
+bool loadShaderReflection(const char* path, uint64_t spirvHash, ShaderReflection& reflection);
+bool writeShaderReflection(const char* path, uint64_t spirvHash, const ShaderReflection& reflection);
@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+#include "vulkan/hash.h"
+#include "vulkan/shader_reload.h"
+#include "vulkan/thread_pool.h"
+#include "vulkan/vk_init_helpers.h"
+
+void ShaderHotReload::update(uint64_t frameNumber) {
+    // Whatever finished building gets used starting with this frame
+    Reload* reload = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        reload = finishedReload;
+        finishedReload = nullptr;
+        if (reload != nullptr) {
+            reloading = false;
+        }
+    }
+    if (reload != nullptr) {
+        if (reload->success) {
+            swap(*reload, frameNumber);
+        } else {
+            printf("Shader reload failed, keeping the old pipelines\n");
+            discard(*reload);
+        }
+        delete reload;
+    }
+
+    // The frame that retired them and everything before it can't be in flight anymore
+    while (!retired.empty() && retired.front().frame + framesInFlight < frameNumber) {
+        if (retired.front().module != VK_NULL_HANDLE) {
+            vkDestroyShaderModule(device, retired.front().module, nullptr);
+        }
+        if (retired.front().pipeline != VK_NULL_HANDLE) {
+            vkDestroyPipeline(device, retired.front().pipeline, nullptr);
+        }
+        retired.pop_front();
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - lastPoll < POLL_INTERVAL) {
+        return;
+    }
+    lastPoll = now;
+
+    watchNewModules();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // Changes made meanwhile get picked up once the current reload is done
+        if (reloading) {
+            return;
+        }
+    }
+
+    std::vector<ShaderModule*> modules = changedModules();
+    if (!modules.empty()) {
+        startReload(modules);
+    }
+}
+
+void ShaderHotReload::watchCompute(VkPipeline* pipeline, ShaderPassInfo* info) {
+    computePipelines.push_back(ComputePipeline{ pipeline, info });
+}
+
+void ShaderHotReload::deinit() {
+    if (finishedReload != nullptr) {
+        discard(*finishedReload);
+        delete finishedReload;
+        finishedReload = nullptr;
+    }
+
+    for (Retired& object : retired) {
+        if (object.module != VK_NULL_HANDLE) {
+            vkDestroyShaderModule(device, object.module, nullptr);
+        }
+        if (object.pipeline != VK_NULL_HANDLE) {
+            vkDestroyPipeline(device, object.pipeline, nullptr);
+        }
+    }
+    retired.clear();
+}
+
+void ShaderHotReload::watchNewModules() {
+    if (watched.size() == moduleCache.cache.size()) {
+        return;
+    }
+
+    for (auto& entry : moduleCache.cache) {
+        ShaderModule* module = &entry.second;
+        bool alreadyWatched = false;
+        for (WatchedSource& source : watched) {
+            if (source.module == module) {
+                alreadyWatched = true;
+                break;
+            }
+        }
+        if (alreadyWatched) {
+            continue;
+        }
+
+        // Missing sources end up with the minimal timestamp and count as changed once they show up
+        std::error_code error;
+        std::filesystem::file_time_type lastWrite = std::filesystem::last_write_time(module->path.sourcePath, error);
+        watched.push_back(WatchedSource{ module, error ? std::filesystem::file_time_type::min() : lastWrite });
+    }
+}
+
+std::vector<ShaderModule*> ShaderHotReload::changedModules() {
+    std::vector<ShaderModule*> modules;
+    for (WatchedSource& source : watched) {
+        std::error_code error;
+        std::filesystem::file_time_type lastWrite = std::filesystem::last_write_time(source.module->path.sourcePath, error);
+        if (error || lastWrite == source.lastWrite) {
+            continue;
+        }
+
+        source.lastWrite = lastWrite;
+        modules.push_back(source.module);
+    }
+
+    return modules;
+}
+
+void ShaderHotReload::startReload(const std::vector<ShaderModule*>& modules) {
+    Reload* reload = new Reload();
+    for (ShaderModule* module : modules) {
+        printf("Reloading shader %s\n", module->path.filename.c_str());
+        ModuleRebuild moduleRebuild;
+        moduleRebuild.module = module;
+        reload->modules.push_back(std::move(moduleRebuild));
+    }
+
+    for (auto& entry : passCache.passCache) {
+        ShaderPass& pass = entry.second;
+
+        bool affected = false;
+        for (const ShaderStage& stage : pass.info->stages) {
+            for (ShaderModule* module : modules) {
+                affected |= stage.module == module;
+            }
+        }
+        if (!affected) {
+            continue;
+        }
+
+        PassRebuild passRebuild;
+        passRebuild.pass = &pass;
+        passRebuild.builder = pass.builder;
+        passRebuild.renderpass = pass.renderpass;
+        passRebuild.viewport = *pass.viewport;
+        passRebuild.scissor = *pass.scissor;
+        passRebuild.layout = pass.info->layout;
+        reload->passes.push_back(std::move(passRebuild));
+    }
+
+    for (ComputePipeline& compute : computePipelines) {
+        ShaderStage& stage = compute.info->stages[0];
+        for (ShaderModule* module : modules) {
+            if (stage.module == module) {
+                reload->computes.push_back(ComputeRebuild{ compute, shaderStageCreateInfo(stage) });
+                break;
+            }
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        reloading = true;
+    }
+    threadPool.enqueue([this, reload]() {
+        rebuild(*reload);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        finishedReload = reload;
+    });
+}
+
+void ShaderHotReload::swap(Reload& reload, uint64_t frameNumber) {
+    for (ModuleRebuild& moduleRebuild : reload.modules) {
+        ShaderModule& module = *moduleRebuild.module;
+        retired.push_back(Retired{ frameNumber, module.module, VK_NULL_HANDLE });
+
+        // Builders of passes that weren't rebuilt still have to point at live modules
+        for (auto& entry : passCache.passCache) {
+            for (VkPipelineShaderStageCreateInfo& stage : entry.second.builder.shaderStages) {
+                if (stage.module == module.module) {
+                    stage.module = moduleRebuild.shaderModule;
+                }
+            }
+        }
+
+        module.module = moduleRebuild.shaderModule;
+        module.spirvCode = std::move(moduleRebuild.spirvCode);
+        module.reflection = std::move(moduleRebuild.reflection);
+    }
+
+    for (PassRebuild& passRebuild : reload.passes) {
+        retired.push_back(Retired{ frameNumber, VK_NULL_HANDLE, passRebuild.pass->pipeline });
+        passRebuild.pass->pipeline = passRebuild.pipeline;
+    }
+
+    for (ComputeRebuild& computeRebuild : reload.computes) {
+        retired.push_back(Retired{ frameNumber, VK_NULL_HANDLE, *computeRebuild.compute.pipeline });
+        *computeRebuild.compute.pipeline = computeRebuild.pipeline;
+    }
+
+    printf("Reloaded %zu shader modules, rebuilt %zu passes and %zu compute pipelines\n",
+        reload.modules.size(), reload.passes.size(), reload.computes.size());
+}
+
+void ShaderHotReload::discard(Reload& reload) {
+    for (ModuleRebuild& moduleRebuild : reload.modules) {
+        if (moduleRebuild.shaderModule != VK_NULL_HANDLE) {
+            vkDestroyShaderModule(device, moduleRebuild.shaderModule, nullptr);
+        }
+    }
+    for (PassRebuild& passRebuild : reload.passes) {
+        if (passRebuild.pipeline != VK_NULL_HANDLE) {
+            vkDestroyPipeline(device, passRebuild.pipeline, nullptr);
+        }
+    }
+    for (ComputeRebuild& computeRebuild : reload.computes) {
+        if (computeRebuild.pipeline != VK_NULL_HANDLE) {
+            vkDestroyPipeline(device, computeRebuild.pipeline, nullptr);
+        }
+    }
+}
+
+/*static*/ bool ShaderHotReload::compile(const ShaderPath& path, std::vector<uint32_t>& spirvCode) {
+    // Same naming as the Shaders target, e.g. forward_unlit.frag.glsl is a fragment shader
+    std::string stage = path.filename.substr(0, path.filename.find_last_of('.'));
+    stage = stage.substr(stage.find_last_of('.') + 1);
+
+    // Written next to the live one first, a failed compile shouldn't wipe the last good SPIR-V
+    std::string outputPath = path.spirvPath + ".reload";
+    std::string command = std::string(GLSLC_PATH) + " -fshader-stage=" + stage + " \"" + path.sourcePath + "\" -o \"" + outputPath + "\"";
+    if (system(command.c_str()) != 0) {
+        printf("Failed compiling %s\n", path.sourcePath.c_str());
+        return false;
+    }
+
+    spirvCode = readFile(outputPath);
+    if (spirvCode.empty()) {
+        printf("Failed reading recompiled SPIRV from %s\n", outputPath.c_str());
+        return false;
+    }
+
+    // Next launch starts from the new code as well
+    std::error_code error;
+    std::filesystem::rename(outputPath, path.spirvPath, error);
+    if (error) {
+        printf("Failed replacing %s: %s\n", path.spirvPath.c_str(), error.message().c_str());
+    }
+
+    return true;
+}
+
+void ShaderHotReload::rebuild(Reload& reload) {
+    reload.success = false;
+
+    for (ModuleRebuild& moduleRebuild : reload.modules) {
+        if (!compile(moduleRebuild.module->path, moduleRebuild.spirvCode)) {
+            return;
+        }
+
+        // Keeps the reflection cache in sync with the new SPIR-V, layouts themselves aren't rebuilt
+        if (!reflectShader(moduleRebuild.spirvCode, moduleRebuild.reflection)) {
+            printf("Failed reflecting %s\n", moduleRebuild.module->path.filename.c_str());
+            return;
+        }
+        std::string reflectionPath = moduleRebuild.module->path.spirvPath + SHADER_REFLECTION_EXTENSION;
+        writeShaderReflection(reflectionPath.c_str(), hashBytes(moduleRebuild.spirvCode.data(), moduleRebuild.spirvCode.size() * sizeof(uint32_t)),
+            moduleRebuild.reflection);
+
+        VkShaderModuleCreateInfo createInfo = {};
+        createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+        createInfo.pNext = nullptr;
+        createInfo.codeSize = moduleRebuild.spirvCode.size() * sizeof(uint32_t);
+        createInfo.pCode = moduleRebuild.spirvCode.data();
+        if (vkCreateShaderModule(device, &createInfo, nullptr, &moduleRebuild.shaderModule) != VK_SUCCESS) {
+            printf("Failed creating a shader module for %s\n", moduleRebuild.module->path.filename.c_str());
+            moduleRebuild.shaderModule = VK_NULL_HANDLE;
+            return;
+        }
+    }
+
+    // Live modules only change in swap(), which waits for us
+    for (PassRebuild& passRebuild : reload.passes) {
+        for (VkPipelineShaderStageCreateInfo& stage : passRebuild.builder.shaderStages) {
+            for (ModuleRebuild& moduleRebuild : reload.modules) {
+                if (stage.module == moduleRebuild.module->module) {
+                    stage.module = moduleRebuild.shaderModule;
+                }
+            }
+        }
+    }
+
+    for (ComputeRebuild& computeRebuild : reload.computes) {
+        for (ModuleRebuild& moduleRebuild : reload.modules) {
+            if (computeRebuild.stage.module == moduleRebuild.module->module) {
+                computeRebuild.stage.module = moduleRebuild.shaderModule;
+            }
+        }
+    }
+
+    std::vector<PipelineCreateInfo> createInfos(reload.passes.size());
+    std::vector<VkGraphicsPipelineCreateInfo> pipelineInfos(reload.passes.size());
+    for (size_t i = 0; i < reload.passes.size(); ++i) {
+        PassRebuild& passRebuild = reload.passes[i];
+        passRebuild.builder.fill(createInfos[i], passRebuild.renderpass, &passRebuild.viewport, &passRebuild.scissor, passRebuild.layout);
+        pipelineInfos[i] = createInfos[i].info;
+    }
+    std::vector<VkPipeline> pipelines(reload.passes.size(), VK_NULL_HANDLE);
+
+    // No pipeline cache, freshly edited shaders won't hit it anyways and the main thread might be merging into it
+    // Zero create infos aren't allowed, e.g. when only compute shaders changed
+    VkResult result = pipelineInfos.empty() ? VK_SUCCESS
+        : vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, pipelineInfos.size(), pipelineInfos.data(), nullptr, pipelines.data());
+    for (size_t i = 0; i < reload.passes.size(); ++i) {
+        reload.passes[i].pipeline = pipelines[i];
+    }
+    if (result != VK_SUCCESS) {
+        printf("Failed recreating some of %zu graphics pipelines\n", pipelineInfos.size());
+        return;
+    }
+
+    for (ComputeRebuild& computeRebuild : reload.computes) {
+        VkComputePipelineCreateInfo pipelineInfo = {};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipelineInfo.pNext = nullptr;
+        pipelineInfo.stage = computeRebuild.stage;
+        pipelineInfo.layout = computeRebuild.compute.info->layout;
+        if (vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &computeRebuild.pipeline) != VK_SUCCESS) {
+            printf("Failed recreating the compute pipeline for %s\n", computeRebuild.compute.info->stages[0].module->path.filename.c_str());
+            computeRebuild.pipeline = VK_NULL_HANDLE;
+            return;
+        }
+    }
+
+    reload.success = true;
+}
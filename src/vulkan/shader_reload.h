@@ -0,0 +1,117 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "vulkan/pipeline_builder.h"
+#include "vulkan/vk_shader.h"
+
+#ifndef GLSLC_PATH
+#define GLSLC_PATH "glslc"
+#endif
+
+struct ThreadPool;
+// Watches the GLSL sources of all loaded shader modules and recompiles them with glslc when they change.
+// Compilation and pipeline creation run on the thread pool, rendering keeps going with the old pipelines
+// until update() swaps the new ones in at the next frame boundary. Graphics pipelines are found through
+// the shader pass cache, compute pipelines live with their users and have to be registered with watchCompute().
+// TODO: layouts are kept as they are, changing bindings or push constants still needs a restart
+struct ShaderHotReload {
+    static constexpr std::chrono::milliseconds POLL_INTERVAL = std::chrono::milliseconds(250);
+
+    VkDevice device;
+    ShaderModuleCache& moduleCache;
+    ShaderPassCache& passCache;
+    ThreadPool& threadPool;
+    // Replaced modules and pipelines might still be used by frames in flight
+    uint32_t framesInFlight;
+
+    struct WatchedSource {
+        ShaderModule* module;
+        std::filesystem::file_time_type lastWrite;
+    };
+    std::vector<WatchedSource> watched;
+    std::chrono::steady_clock::time_point lastPoll;
+
+    // Everything a pipeline gets recreated from. Copied on the calling thread, so that the job doesn't
+    // have to touch the caches
+    struct PassRebuild {
+        ShaderPass* pass;
+        PipelineBuilder builder;
+        VkRenderPass renderpass;
+        VkViewport viewport;
+        VkRect2D scissor;
+        VkPipelineLayout layout;
+
+        VkPipeline pipeline = VK_NULL_HANDLE;
+    };
+
+    // Owned by whoever registered it, which keeps using *pipeline and destroys the latest one
+    struct ComputePipeline {
+        VkPipeline* pipeline;
+        ShaderPassInfo* info;
+    };
+    std::vector<ComputePipeline> computePipelines;
+
+    struct ComputeRebuild {
+        ComputePipeline compute;
+        VkPipelineShaderStageCreateInfo stage;
+
+        VkPipeline pipeline = VK_NULL_HANDLE;
+    };
+
+    struct ModuleRebuild {
+        ShaderModule* module;
+        std::vector<uint32_t> spirvCode;
+        ShaderReflection reflection;
+        VkShaderModule shaderModule = VK_NULL_HANDLE;
+    };
+
+    // Only one reload is in flight at a time. Its pipelines reference the modules of other stages, which
+    // can't be swapped out underneath it
+    struct Reload {
+        std::vector<ModuleRebuild> modules;
+        std::vector<PassRebuild> passes;
+        std::vector<ComputeRebuild> computes;
+        bool success = false;
+    };
+
+    std::mutex mutex;
+    bool reloading = false;
+    // Set by the job once done, guarded by mutex
+    Reload* finishedReload = nullptr;
+
+    struct Retired {
+        uint64_t frame;
+        VkShaderModule module;
+        VkPipeline pipeline;
+    };
+    std::deque<Retired> retired;
+
+    ShaderHotReload(VkDevice device, ShaderModuleCache& moduleCache, ShaderPassCache& passCache, ThreadPool& threadPool, uint32_t framesInFlight)
+        : device(device), moduleCache(moduleCache), passCache(passCache), threadPool(threadPool), framesInFlight(framesInFlight) {}
+
+    // Has to be called at a frame boundary, i.e. before recording anything that binds the passes
+    void update(uint64_t frameNumber);
+    // info is what the pipeline was created from, with its single compute stage
+    void watchCompute(VkPipeline* pipeline, ShaderPassInfo* info);
+    // The thread pool has to be drained by now
+    void deinit();
+
+private:
+    void watchNewModules();
+    std::vector<ShaderModule*> changedModules();
+    void startReload(const std::vector<ShaderModule*>& modules);
+    void swap(Reload& reload, uint64_t frameNumber);
+    // Destroys whatever a failed reload managed to create
+    void discard(Reload& reload);
+
+    static bool compile(const ShaderPath& path, std::vector<uint32_t>& spirvCode);
+    void rebuild(Reload& reload);
+};
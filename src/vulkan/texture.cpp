@@ -8,7 +8,28 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#include "vulkan/bindless.h"
 #include "vulkan/engine.h"
+#include "vulkan/samplers.h"
+#include "vulkan/upload.h"
+
+/*static*/ bool TextureCache::decode(const std::string& path, DecodedImage& image) {
+    int channels;
+    image.pixels = stbi_load(path.c_str(), &image.width, &image.height, &channels, STBI_rgb_alpha);
+    if (!image.pixels) {
+        printf("Failed to load texture file %s\n", path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*static*/ void TextureCache::freeDecoded(DecodedImage& image) {
+    if (image.pixels) {
+        stbi_image_free(image.pixels);
+        image.pixels = nullptr;
+    }
+}
 
 CacheLoadResult<Texture> TextureCache::load(std::string path, bool generateMips) {
     auto textureFromCache = cache.find(path);
@@ -19,26 +40,36 @@ CacheLoadResult<Texture> TextureCache::load(std::string path, bool generateMips)
         //printf("Loading new texture %s\n", path.c_str());
     }
 
-    int width;
-    int height;
-    int channels;
-    stbi_uc* pixels = stbi_load(path.c_str(), &width, &height, &channels, STBI_rgb_alpha);
+    DecodedImage image;
+    if (!decode(path, image)) {
+        return CacheLoadResult<Texture>(false, nullptr);
+    }
 
-    int mipCount = floor(log2((double)std::min(width, height))) + 1;
+    return create(path, image, generateMips);
+}
 
-    if (!pixels) {
-        printf("Failed to load texture file %s\n", path.c_str());
+CacheLoadResult<Texture> TextureCache::create(std::string path, DecodedImage& image, bool generateMips) {
+    auto textureFromCache = cache.find(path);
+    if (textureFromCache != cache.end()) {
+        freeDecoded(image);
+        return CacheLoadResult<Texture>(true, &textureFromCache->second);
+    }
+
+    if (!image.pixels) {
         return CacheLoadResult<Texture>(false, nullptr);
     }
 
+    int width = image.width;
+    int height = image.height;
+    int mipCount = floor(log2((double)std::min(width, height))) + 1;
+
     // TODO: different image formats depending on how many channels
     VkDeviceSize imageSize = width * height * 4 * 1; // 1 byte per channel
     VkFormat imageFormat = VK_FORMAT_R8G8B8A8_SRGB;
 
-    AllocatedBuffer cpuImageBuffer = backend.createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
-    backend.uploadData((void*)pixels, imageSize, 0, cpuImageBuffer.allocation);
+    StagingAllocation staging = backend.uploads->stage(image.pixels, imageSize);
 
-    stbi_image_free(pixels);
+    freeDecoded(image);
 
     Texture& texture = cache[path];
     texture.mipCount = mipCount;
@@ -57,7 +88,9 @@ CacheLoadResult<Texture> TextureCache::load(std::string path, bool generateMips)
     vmaCreateImage(backend.allocator, &imgCreateInfo, &imgAllocInfo, &texture.image.image,
         &texture.image.allocation, nullptr);
 
-    backend.immediateBlockingSubmit([&](VkCommandBuffer cmd) {
+    {
+        VkCommandBuffer cmd = backend.uploads->commandBuffer();
+
         VkImageMemoryBarrier imageMemoryBarrierForTransfer = imageMemoryBarrier(VK_IMAGE_LAYOUT_UNDEFINED,
             VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, texture.image.image, 0, VK_ACCESS_TRANSFER_WRITE_BIT, mipCount);
 
@@ -65,7 +98,7 @@ CacheLoadResult<Texture> TextureCache::load(std::string path, bool generateMips)
             0, nullptr, 1, &imageMemoryBarrierForTransfer);
 
         VkBufferImageCopy copyRegion = {};
-        copyRegion.bufferOffset = 0;
+        copyRegion.bufferOffset = staging.offset;
         copyRegion.bufferRowLength = 0;
         copyRegion.bufferImageHeight = 0;
 
@@ -75,7 +108,12 @@ CacheLoadResult<Texture> TextureCache::load(std::string path, bool generateMips)
         copyRegion.imageSubresource.layerCount = 1;
         copyRegion.imageExtent = texture.image.extent;
 
-        vkCmdCopyBufferToImage(cmd, cpuImageBuffer.buffer, texture.image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
+        vkCmdCopyBufferToImage(cmd, staging.buffer, texture.image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
+
+        // Blits need the graphics queue
+        backend.uploads->releaseImage(texture.image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipCount,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT);
+        cmd = backend.uploads->graphicsCommandBuffer();
 
         // Mip generation
         VkImageMemoryBarrier finalFormatTransitionBarrier = imageMemoryBarrier(VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
@@ -112,13 +150,14 @@ CacheLoadResult<Texture> TextureCache::load(std::string path, bool generateMips)
         finalFormatTransitionBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
         finalFormatTransitionBarrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
         vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &finalFormatTransitionBarrier);
-    });
+    }
+    // Not to be sampled before this retires
+    texture.uploadTicket = backend.uploads->currentTicket();
 
     backend.deinitQueue.enqueue([=]() {
         //LOG_CALL(vmaDestroyImage(backend.allocator, texture.image.image, texture.image.allocation));
         vmaDestroyImage(backend.allocator, texture.image.image, texture.image.allocation);
     });
-    vmaDestroyBuffer(backend.allocator, cpuImageBuffer.buffer, cpuImageBuffer.allocation);
 
     VkImageViewCreateInfo imageViewInfo = imageViewCreateInfo(VK_FORMAT_R8G8B8A8_SRGB, texture.image.image, VK_IMAGE_ASPECT_COLOR_BIT, mipCount);
     vkCreateImageView(backend.device, &imageViewInfo, nullptr, &texture.view);
@@ -131,25 +170,31 @@ CacheLoadResult<Texture> TextureCache::load(std::string path, bool generateMips)
     return CacheLoadResult<Texture>(true, &texture);
 }
 
-CacheLoadResult<SampledTexture> TextureCache::load(std::string path, VkSamplerCreateInfo _) {
-    CacheLoadResult<Texture> texture = load(path);
+CacheLoadResult<SampledTexture> TextureCache::load(std::string path, VkSamplerCreateInfo sampler) {
+    return sampled(load(path), sampler);
+}
+
+CacheLoadResult<SampledTexture> TextureCache::create(std::string path, DecodedImage& image, VkSamplerCreateInfo sampler) {
+    return sampled(create(path, image), sampler);
+}
+
+CacheLoadResult<SampledTexture> TextureCache::sampled(CacheLoadResult<Texture> texture, VkSamplerCreateInfo samplerInfo) {
     if (!texture.success) {
         return CacheLoadResult<SampledTexture>(false, nullptr);
     }
 
-    // TODO: memleak, but it's fine for now
-    CacheLoadResult<SampledTexture> result(true, nullptr);
-    result.data = new SampledTexture();
-    result.data->texture = texture.data;
-
-    // TODO: cache samplers
-    VkSamplerCreateInfo samplerInfo = samplerCreateInfo(VK_FILTER_NEAREST, VK_SAMPLER_ADDRESS_MODE_REPEAT, (float)texture.data->mipCount - 1);
-    vkCreateSampler(backend.device, &samplerInfo, nullptr, &result.data->sampler);
+    // Equal infos share a sampler, so every texture and sampler pair takes up a single bindless slot
+    VkSampler sampler = *backend.samplerCache->load(samplerInfo).data;
+    auto& textureSamplers = sampledCache[texture.data];
+    auto sampledFromCache = textureSamplers.find(sampler);
+    if (sampledFromCache != textureSamplers.end()) {
+        return CacheLoadResult<SampledTexture>(true, &sampledFromCache->second);
+    }
 
-    backend.deinitQueue.enqueue([&]() {
-        vkDestroySampler(backend.device, result.data->sampler, nullptr);
-        delete result.data;
-    });
+    SampledTexture& sampledTexture = textureSamplers[sampler];
+    sampledTexture.texture = texture.data;
+    sampledTexture.sampler = sampler;
+    sampledTexture.bindlessIndex = backend.bindless->registerTexture(texture.data->view, sampler);
 
-    return result;
+    return CacheLoadResult<SampledTexture>(true, &sampledTexture);
 }
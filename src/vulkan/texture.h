@@ -5,6 +5,7 @@
 
 #include "vulkan/types.h"
 #include "vulkan/cache.h"
+#include "vulkan/upload.h"
 
 struct VulkanBackend;
 bool loadFromFile(VulkanBackend& backend, const char* path, AllocatedImage& image);
@@ -14,22 +15,46 @@ struct Texture {
     VkImageView view;
 
     uint32_t mipCount;
+
+    UploadTicket uploadTicket = 0;
 };
 
 struct SampledTexture {
     Texture* texture;
     VkSampler sampler;
+    // Slot in the bindless texture array
+    uint32_t bindlessIndex;
+};
+
+// RGBA8 pixels straight from the file
+struct DecodedImage {
+    unsigned char* pixels = nullptr;
+    int width = 0;
+    int height = 0;
 };
 
 struct TextureCache {
     VulkanBackend& backend;
     std::unordered_map<std::string, Texture> cache;
+    // Per texture, keyed by the sampler cache's samplers
+    std::unordered_map<Texture*, std::unordered_map<VkSampler, SampledTexture>> sampledCache;
 
     TextureCache(VulkanBackend& backend) : backend(backend) {}
 
-    // TODO: separately cache AllocatedImages, VkImageViews and VkSamplers and combine them
-    // as needed.
+    // Thread safe, doesn't touch the cache. Lets file I/O and decoding happen off the main thread
+    static bool decode(const std::string& path, DecodedImage& image);
+    static void freeDecoded(DecodedImage& image);
+
     // TODO: more ergonomic mip options
     CacheLoadResult<Texture> load(std::string path, bool generateMips = true);
+    // Samplers come from the sampler cache. The same texture with an equal sampler comes out as the same
+    // SampledTexture, registered with the bindless array once
     CacheLoadResult<SampledTexture> load(std::string path, VkSamplerCreateInfo sampler);
+    // Like load(), but from already decoded pixels. Takes ownership of the pixels. A failed decode
+    // (no pixels) fails the same way load() would
+    CacheLoadResult<Texture> create(std::string path, DecodedImage& image, bool generateMips = true);
+    CacheLoadResult<SampledTexture> create(std::string path, DecodedImage& image, VkSamplerCreateInfo sampler);
+
+private:
+    CacheLoadResult<SampledTexture> sampled(CacheLoadResult<Texture> texture, VkSamplerCreateInfo sampler);
 };
@@ -0,0 +1,100 @@
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include "vulkan/thread_pool.h"
+
+ThreadPool::ThreadPool(uint32_t workerCount) {
+    if (workerCount == 0) {
+        uint32_t hardwareThreads = std::thread::hardware_concurrency();
+        workerCount = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+    }
+
+    workers.reserve(workerCount);
+    for (uint32_t i = 0; i < workerCount; ++i) {
+        workers.emplace_back([this]() { workerLoop(); });
+    }
+}
+
+void ThreadPool::enqueue(std::function<void()>&& job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+    jobAvailable.notify_one();
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)>& func) {
+    if (count == 0) {
+        return;
+    }
+
+    // Helpers may only get picked up after everything is done already, so the shared state has
+    // to outlive this call. func itself is only touched while there's work left, i.e. while we
+    // are still waiting below
+    struct ParallelForState {
+        std::atomic<size_t> nextIndex = 0;
+        size_t finished = 0;
+        std::mutex mutex;
+        std::condition_variable allFinished;
+    };
+    auto state = std::make_shared<ParallelForState>();
+    const std::function<void(size_t)>* funcPtr = &func;
+
+    auto work = [state, funcPtr, count]() {
+        size_t finished = 0;
+        for (size_t i = state->nextIndex++; i < count; i = state->nextIndex++) {
+            (*funcPtr)(i);
+            ++finished;
+        }
+
+        if (finished > 0) {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->finished += finished;
+            if (state->finished == count) {
+                state->allFinished.notify_all();
+            }
+        }
+    };
+
+    size_t helperCount = std::min(workers.size(), count - 1);
+    for (size_t i = 0; i < helperCount; ++i) {
+        enqueue(work);
+    }
+    work();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->allFinished.wait(lock, [&]() { return state->finished == count; });
+}
+
+void ThreadPool::deinit() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    jobAvailable.notify_all();
+
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+}
+
+void ThreadPool::workerLoop() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobAvailable.wait(lock, [&]() { return stopping || !jobs.empty(); });
+            // Drain whatever is left before shutting down
+            if (jobs.empty()) {
+                return;
+            }
+
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        job();
+    }
+}
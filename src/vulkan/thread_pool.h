@@ -0,0 +1,33 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads pulling jobs off a shared queue
+struct ThreadPool {
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable jobAvailable;
+    std::deque<std::function<void()>> jobs;
+    bool stopping = false;
+
+    // 0 picks one worker per hardware thread, minus the one the caller is running on
+    ThreadPool(uint32_t workerCount = 0);
+
+    void enqueue(std::function<void()>&& job);
+
+    // Runs func(i) for every i in [0, count) and blocks until all of them finished. The calling
+    // thread works through indices too, so this is safe to call from within a job
+    void parallelFor(size_t count, const std::function<void(size_t)>& func);
+
+    void deinit();
+
+private:
+    void workerLoop();
+};
@@ -0,0 +1,258 @@
+#include <string.h>
+
+#include "vulkan/engine.h"
+#include "vulkan/upload.h"
+#include "vulkan/vk_init_helpers.h"
+
+static uint64_t alignUp(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+void UploadQueue::init() {
+    stagingBuffer = backend.createBuffer(STAGING_RING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+    VK_CHECK(vmaMapMemory(backend.allocator, stagingBuffer.allocation, (void**)&stagingData));
+
+    separateTransferQueue = backend.transferQueueFamily != backend.graphicsQueueFamily;
+
+    VkCommandPoolCreateInfo cmdPoolInfo = commandPoolCreateInfo(backend.transferQueueFamily, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+    VkCommandPoolCreateInfo graphicsCmdPoolInfo = commandPoolCreateInfo(backend.graphicsQueueFamily, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+    VkFenceCreateInfo fenceInfo = fenceCreateInfo(0);
+    VkSemaphoreCreateInfo semaphoreInfo = semaphoreCreateInfo(0);
+    for (UploadBatch& batch : batches) {
+        VK_CHECK(vkCreateCommandPool(backend.device, &cmdPoolInfo, nullptr, &batch.cmdPool));
+        VkCommandBufferAllocateInfo cmdAllocInfo = commandBufferAllocateInfo(1, VK_COMMAND_BUFFER_LEVEL_PRIMARY, batch.cmdPool);
+        VK_CHECK(vkAllocateCommandBuffers(backend.device, &cmdAllocInfo, &batch.cmd));
+
+        if (separateTransferQueue) {
+            VK_CHECK(vkCreateCommandPool(backend.device, &graphicsCmdPoolInfo, nullptr, &batch.graphicsCmdPool));
+            VkCommandBufferAllocateInfo graphicsCmdAllocInfo = commandBufferAllocateInfo(1, VK_COMMAND_BUFFER_LEVEL_PRIMARY, batch.graphicsCmdPool);
+            VK_CHECK(vkAllocateCommandBuffers(backend.device, &graphicsCmdAllocInfo, &batch.graphicsCmd));
+
+            VK_CHECK(vkCreateSemaphore(backend.device, &semaphoreInfo, nullptr, &batch.transferDone));
+        } else {
+            batch.graphicsCmdPool = VK_NULL_HANDLE;
+            batch.graphicsCmd = batch.cmd;
+            batch.transferDone = VK_NULL_HANDLE;
+        }
+
+        VK_CHECK(vkCreateFence(backend.device, &fenceInfo, nullptr, &batch.fence));
+    }
+}
+
+void UploadQueue::deinit() {
+    // Whatever is still being recorded might reference resources that are gone by now, drop it
+    UploadBatch& recording = batches[recordingBatch];
+    if (recording.recording) {
+        VK_CHECK(vkEndCommandBuffer(recording.cmd));
+        if (separateTransferQueue) {
+            VK_CHECK(vkEndCommandBuffer(recording.graphicsCmd));
+        }
+        recording.recording = false;
+
+        for (auto& func : recording.onRetire) {
+            func();
+        }
+        recording.onRetire.clear();
+    }
+
+    while (!inFlightBatches.empty()) {
+        retireOldest();
+    }
+
+    for (UploadBatch& batch : batches) {
+        vkDestroyFence(backend.device, batch.fence, nullptr);
+        vkDestroyCommandPool(backend.device, batch.cmdPool, nullptr);
+        if (separateTransferQueue) {
+            vkDestroySemaphore(backend.device, batch.transferDone, nullptr);
+            vkDestroyCommandPool(backend.device, batch.graphicsCmdPool, nullptr);
+        }
+    }
+
+    vmaUnmapMemory(backend.allocator, stagingBuffer.allocation);
+    vmaDestroyBuffer(backend.allocator, stagingBuffer.buffer, stagingBuffer.allocation);
+}
+
+StagingAllocation UploadQueue::stage(VkDeviceSize size, VkDeviceSize alignment) {
+    // Staged data belongs to the batch being recorded, so make sure there is one
+    begin();
+
+    // Would starve the ring. Give it its own buffer that lives until the batch retires
+    if (size > STAGING_RING_SIZE / 2) {
+        AllocatedBuffer buffer = backend.createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+        char* data;
+        VK_CHECK(vmaMapMemory(backend.allocator, buffer.allocation, (void**)&data));
+
+        VmaAllocator allocator = backend.allocator;
+        batches[recordingBatch].onRetire.push_back([=]() {
+            vmaUnmapMemory(allocator, buffer.allocation);
+            vmaDestroyBuffer(allocator, buffer.buffer, buffer.allocation);
+        });
+
+        return StagingAllocation{ buffer.buffer, 0, data };
+    }
+
+    while (true) {
+        uint64_t offset = alignUp(stagingHead, alignment);
+        uint64_t ringOffset = offset % STAGING_RING_SIZE;
+        // Allocations never wrap around, skip to the start of the ring instead
+        if (ringOffset + size > STAGING_RING_SIZE) {
+            offset += STAGING_RING_SIZE - ringOffset;
+            ringOffset = 0;
+        }
+
+        if (offset + size - stagingTail <= STAGING_RING_SIZE) {
+            stagingHead = offset + size;
+            return StagingAllocation{ stagingBuffer.buffer, ringOffset, stagingData + ringOffset };
+        }
+
+        // Ring is full. Push out what we've got and wait for the oldest batch to free up space
+        // TODO: track this, if it happens regularly the ring is too small
+        submit();
+        retireOldest();
+        begin();
+    }
+}
+
+StagingAllocation UploadQueue::stage(const void* data, VkDeviceSize size, VkDeviceSize alignment) {
+    StagingAllocation allocation = stage(size, alignment);
+    memcpy(allocation.data, data, size);
+
+    return allocation;
+}
+
+void UploadQueue::begin() {
+    UploadBatch& batch = batches[recordingBatch];
+    if (batch.recording) {
+        return;
+    }
+
+    // Batches are reused round-robin, so if this one is still in flight it's the oldest one
+    while (batch.inFlight) {
+        retireOldest();
+    }
+
+    VkCommandBufferBeginInfo beginInfo = commandBufferBeginInfo(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    VK_CHECK(vkBeginCommandBuffer(batch.cmd, &beginInfo));
+    if (separateTransferQueue) {
+        VK_CHECK(vkBeginCommandBuffer(batch.graphicsCmd, &beginInfo));
+    }
+    batch.recording = true;
+}
+
+VkCommandBuffer UploadQueue::commandBuffer() {
+    begin();
+    return batches[recordingBatch].cmd;
+}
+
+VkCommandBuffer UploadQueue::graphicsCommandBuffer() {
+    begin();
+    return batches[recordingBatch].graphicsCmd;
+}
+
+void UploadQueue::releaseImage(VkImage image, VkImageLayout layout, uint32_t mipCount, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+    if (!separateTransferQueue) {
+        return;
+    }
+
+    VkImageMemoryBarrier barrier = imageMemoryBarrier(layout, layout, image, VK_ACCESS_TRANSFER_WRITE_BIT, 0, mipCount);
+    barrier.srcQueueFamilyIndex = backend.transferQueueFamily;
+    barrier.dstQueueFamilyIndex = backend.graphicsQueueFamily;
+    vkCmdPipelineBarrier(commandBuffer(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = dstAccess;
+    vkCmdPipelineBarrier(graphicsCommandBuffer(), VK_PIPELINE_STAGE_TRANSFER_BIT, dstStage,
+        0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+UploadTicket UploadQueue::uploadBuffer(const void* data, VkDeviceSize size, VkBuffer dstBuffer, VkDeviceSize dstOffset) {
+    StagingAllocation staging = stage(data, size);
+
+    VkBufferCopy copy = {};
+    copy.srcOffset = staging.offset;
+    copy.dstOffset = dstOffset;
+    copy.size = size;
+    vkCmdCopyBuffer(commandBuffer(), staging.buffer, dstBuffer, 1, &copy);
+
+    return currentTicket();
+}
+
+void UploadQueue::submit() {
+    UploadBatch& batch = batches[recordingBatch];
+    if (!batch.recording) {
+        return;
+    }
+
+    // Submission order takes care of the rest -- anything submitted to the queue after this batch
+    // sees the uploaded data
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(batch.graphicsCmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    if (separateTransferQueue) {
+        VK_CHECK(vkEndCommandBuffer(batch.cmd));
+
+        VkSubmitInfo transferSubmit = submitInfo(&batch.cmd);
+        transferSubmit.signalSemaphoreCount = 1;
+        transferSubmit.pSignalSemaphores = &batch.transferDone;
+        VK_CHECK(vkQueueSubmit(backend.transferQueue, 1, &transferSubmit, VK_NULL_HANDLE));
+    }
+
+    VK_CHECK(vkEndCommandBuffer(batch.graphicsCmd));
+
+    VkSubmitInfo submit = submitInfo(&batch.graphicsCmd);
+    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    if (separateTransferQueue) {
+        submit.waitSemaphoreCount = 1;
+        submit.pWaitSemaphores = &batch.transferDone;
+        submit.pWaitDstStageMask = &waitStage;
+    }
+    VK_CHECK(vkQueueSubmit(backend.graphicsQueue, 1, &submit, batch.fence));
+
+    batch.ticket = nextTicket++;
+    batch.stagingEnd = stagingHead;
+    batch.recording = false;
+    batch.inFlight = true;
+
+    inFlightBatches.push_back(recordingBatch);
+    recordingBatch = (recordingBatch + 1) % BATCH_COUNT;
+}
+
+void UploadQueue::poll() {
+    while (!inFlightBatches.empty() && vkGetFenceStatus(backend.device, batches[inFlightBatches.front()].fence) == VK_SUCCESS) {
+        retireOldest();
+    }
+}
+
+void UploadQueue::flush() {
+    submit();
+    while (!inFlightBatches.empty()) {
+        retireOldest();
+    }
+}
+
+void UploadQueue::retireOldest() {
+    UploadBatch& batch = batches[inFlightBatches.front()];
+    inFlightBatches.pop_front();
+
+    VK_CHECK(vkWaitForFences(backend.device, 1, &batch.fence, true, UINT64_MAX));
+    VK_CHECK(vkResetFences(backend.device, 1, &batch.fence));
+    VK_CHECK(vkResetCommandPool(backend.device, batch.cmdPool, 0));
+    if (separateTransferQueue) {
+        VK_CHECK(vkResetCommandPool(backend.device, batch.graphicsCmdPool, 0));
+    }
+
+    for (auto& func : batch.onRetire) {
+        func();
+    }
+    batch.onRetire.clear();
+    batch.inFlight = false;
+
+    retiredTicket = batch.ticket;
+    stagingTail = batch.stagingEnd;
+}
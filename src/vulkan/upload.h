@@ -0,0 +1,108 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <stdint.h>
+#include <vector>
+
+#include "vulkan/types.h"
+
+// Identifies the batch an upload was recorded into. Batches retire in submission order, so an
+// upload is complete once its ticket is <= UploadQueue::retiredTicket. 0 is always complete
+typedef uint64_t UploadTicket;
+
+struct StagingAllocation {
+    VkBuffer buffer;
+    VkDeviceSize offset;
+    char* data;
+};
+
+struct UploadBatch {
+    // Copies, on the transfer queue
+    VkCommandPool cmdPool;
+    VkCommandBuffer cmd;
+    // Ownership acquires and whatever else needs the graphics queue (e.g. mip blits). Same as cmd
+    // without a separate transfer queue
+    VkCommandPool graphicsCmdPool;
+    VkCommandBuffer graphicsCmd;
+    VkSemaphore transferDone;
+    // Signaled by the last submission of the batch
+    VkFence fence;
+
+    UploadTicket ticket;
+    bool recording = false;
+    bool inFlight = false;
+
+    // Staging ring position once this batch retires
+    uint64_t stagingEnd;
+    // e.g. freeing oversized staging buffers
+    std::vector<std::function<void()>> onRetire;
+};
+
+struct VulkanBackend;
+// Batches all uploads of a frame into a single command buffer, fed from a persistently mapped
+// staging ring. Nothing ever waits on the GPU unless the ring or all batches run out -- callers
+// keep the ticket and check isRetired() before using the resource.
+// Copies run on the backend's transfer queue. If that's a separate queue family, uploaded images
+// have to be handed over to the graphics queue with releaseImage(). Buffers get written range by range
+// while other ranges are in use, which exclusive ownership can't express -- they have to be created
+// shared between both families instead, see VulkanBackend::createBuffer()
+struct UploadQueue {
+    static constexpr VkDeviceSize STAGING_RING_SIZE = 64 * 1024 * 1024;
+    static constexpr uint32_t BATCH_COUNT = 4;
+
+    VulkanBackend& backend;
+
+    AllocatedBuffer stagingBuffer;
+    char* stagingData;
+    // Monotonic byte counters, ring offset is counter % STAGING_RING_SIZE. Everything in
+    // [stagingTail, stagingHead) might still be read by the GPU
+    uint64_t stagingHead = 0;
+    uint64_t stagingTail = 0;
+
+    UploadBatch batches[BATCH_COUNT];
+    uint32_t recordingBatch = 0;
+    // Indices into batches, oldest first
+    std::deque<uint32_t> inFlightBatches;
+
+    bool separateTransferQueue;
+
+    UploadTicket nextTicket = 1;
+    UploadTicket retiredTicket = 0;
+
+    UploadQueue(VulkanBackend& backend) : backend(backend) {}
+
+    void init();
+    void deinit();
+
+    // Reserves staging memory for the batch currently being recorded. Might block if the ring is
+    // full of in-flight uploads
+    StagingAllocation stage(VkDeviceSize size, VkDeviceSize alignment = 16);
+    StagingAllocation stage(const void* data, VkDeviceSize size, VkDeviceSize alignment = 16);
+
+    // Command buffers of the batch being recorded, begun on first use. Transfer commands only go
+    // into commandBuffer(), graphicsCommandBuffer() executes after all of them
+    VkCommandBuffer commandBuffer();
+    VkCommandBuffer graphicsCommandBuffer();
+    UploadTicket currentTicket() const { return nextTicket; }
+
+    // Queue family ownership transfer from the transfer to the graphics queue, no-op if they're the
+    // same. Has to follow the last write to the image in commandBuffer(). Keeps the image in layout
+    void releaseImage(VkImage image, VkImageLayout layout, uint32_t mipCount, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess);
+
+    // Copy into a vertex/index buffer range. The buffer has to be shared with the transfer queue
+    UploadTicket uploadBuffer(const void* data, VkDeviceSize size, VkBuffer dstBuffer, VkDeviceSize dstOffset);
+
+    // Submits the batch being recorded, if there is anything in it
+    void submit();
+    // Retires all finished batches without blocking
+    void poll();
+    // Submits and blocks until everything retired
+    void flush();
+
+    bool isRetired(UploadTicket ticket) const { return ticket <= retiredTicket; }
+
+private:
+    void begin();
+    void retireOldest();
+};
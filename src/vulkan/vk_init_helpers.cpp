@@ -16,7 +16,9 @@ VkPipelineShaderStageCreateInfo shaderStageCreateInfo(VkShaderStageFlagBits stag
 }
 
 VkPipelineShaderStageCreateInfo shaderStageCreateInfo(ShaderStage& shaderStage) {
-    return shaderStageCreateInfo(shaderStage.flags, shaderStage.module->module);
+    VkPipelineShaderStageCreateInfo info = shaderStageCreateInfo(shaderStage.flags, shaderStage.module->module);
+    info.pSpecializationInfo = shaderStage.specialization();
+    return info;
 }
 
 VkPipelineVertexInputStateCreateInfo vertexInputStateCreateInfo() {
@@ -1,11 +1,12 @@
+#include <algorithm>
 #include <cassert>
 #include <fstream>
 #include <optional>
 
-#include "spirv_reflect.h"
-
 #include "vulkan/descriptors.h"
+#include "vulkan/hash.h"
 #include "vulkan/material.h"
+#include "vulkan/thread_pool.h"
 #include "vulkan/vk_shader.h"
 #include "vulkan/vk_init_helpers.h"
 
@@ -39,9 +40,24 @@ CacheLoadResult<ShaderModule> ShaderModuleCache::load(ShaderPath path) {
         return CacheLoadResult<ShaderModule>(false, nullptr);
     }
 
+    // Reflection is only redone for changed SPIR-V
+    ShaderReflection reflection;
+    uint64_t spirvHash = hashBytes(spirvCode.data(), spirvCode.size() * sizeof(uint32_t));
+    std::string reflectionPath = path.spirvPath + SHADER_REFLECTION_EXTENSION;
+    if (!loadShaderReflection(reflectionPath.c_str(), spirvHash, reflection)) {
+        if (!reflectShader(spirvCode, reflection)) {
+            printf("Failed reflecting %s\n", path.filename.c_str());
+            return CacheLoadResult<ShaderModule>(false, nullptr);
+        }
+        if (!writeShaderReflection(reflectionPath.c_str(), spirvHash, reflection)) {
+            printf("Failed writing shader reflection %s\n", reflectionPath.c_str());
+        }
+    }
+
     cache.emplace(path, ShaderModule(path));
     ShaderModule& module = cache.at(path);
     module.spirvCode = std::move(spirvCode);
+    module.reflection = std::move(reflection);
     // TODO: add source code here for debugging
     
     VkShaderModuleCreateInfo createInfo = {};
@@ -82,59 +98,27 @@ CacheLoadResult<ShaderPassInfo> ShaderPassCache::loadInfo(ShaderStageCreateInfos
             return CacheLoadResult<ShaderPassInfo>(false, nullptr);
         }
 
-        passInfo.stages.push_back(ShaderStage(moduleResult.data, stageInfos.stages[i].stage));
+        passInfo.stages.push_back(ShaderStage(moduleResult.data, stageInfos.stages[i].stage, stageInfos.stages[i].specializationConstants));
     }
 
     // Generate pipeline layout from reflected shader info
-    struct ReflectedSetLayout {
-        std::vector<ReflectedBinding> bindings;
-        uint8_t setIndex;
-    };
-    std::vector<ReflectedSetLayout> reflectedSetLayouts;
     for (size_t i = 0; i < passInfo.stages.size(); ++i) {
-        ShaderStage& stage = passInfo.stages[i];
-
-        SpvReflectShaderModule reflection;
-        SpvReflectResult result = spvReflectCreateShaderModule(stage.module->spirvCode.size() * sizeof(uint32_t),
-            stage.module->spirvCode.data(), &reflection);
-        assert(result == SPV_REFLECT_RESULT_SUCCESS);
-
-        uint32_t reflectedSetCount = 0;
-        result = spvReflectEnumerateDescriptorSets(&reflection, &reflectedSetCount, nullptr);
-        assert(result == SPV_REFLECT_RESULT_SUCCESS);
-
-        std::vector<SpvReflectDescriptorSet*> reflectedSets(reflectedSetCount);
-        result = spvReflectEnumerateDescriptorSets(&reflection, &reflectedSetCount, reflectedSets.data());
-        assert(result == SPV_REFLECT_RESULT_SUCCESS);
-
-        for (SpvReflectDescriptorSet* reflectedSet : reflectedSets) {
-            if (reflectedSet == nullptr) {
-                continue;
-            }
-
-            assert(reflectedSet->set < MAX_ALLOWED_DESCRIPTOR_SETS);
-
-            ReflectedSetLayout setLayout;
-            setLayout.setIndex = reflectedSet->set;
-
-            // Bindings
-            for (uint32_t bindingIdx = 0; bindingIdx < reflectedSet->binding_count; ++bindingIdx) {
-                SpvReflectDescriptorBinding* reflectedBinding = reflectedSet->bindings[bindingIdx];
+        const ShaderReflection& reflection = passInfo.stages[i].module->reflection;
+        for (const ShaderReflection::Binding& reflectedBinding : reflection.bindings) {
+            assert(reflectedBinding.setIndex < MAX_ALLOWED_DESCRIPTOR_SETS);
+        }
 
-                VkDescriptorSetLayoutBinding binding = descriptorSetLayoutBinding(static_cast<VkDescriptorType>(reflectedBinding->descriptor_type),
-                    reflection.shader_stage, reflectedBinding->binding);
-                // TODO: don't quite understand this yet... Multiple descriptors for arrays?
-                binding.descriptorCount = 1;
-                for (uint32_t dimIdx = 0; dimIdx < reflectedBinding->array.dims_count; ++dimIdx) {
-                    binding.descriptorCount *= reflectedBinding->array.dims[dimIdx];
-                }
-                setLayout.bindings.push_back(ReflectedBinding(std::string(reflectedBinding->name), binding));
+        // Push constants. Stages tend to declare the same block but might only use part of it, so all of
+        // them get merged into a single range visible to every stage that has one
+        for (const VkPushConstantRange& reflectedRange : reflection.pushConstants) {
+            if (passInfo.pushConstants.empty()) {
+                passInfo.pushConstants.push_back(VkPushConstantRange{ 0, reflectedRange.offset, 0 });
             }
-
-            // TODO: Push constants
-
-            // no move?
-            reflectedSetLayouts.push_back(std::move(setLayout));
+            VkPushConstantRange& range = passInfo.pushConstants[0];
+            uint32_t end = std::max(range.offset + range.size, reflectedRange.offset + reflectedRange.size);
+            range.offset = std::min(range.offset, reflectedRange.offset);
+            range.size = end - range.offset;
+            range.stageFlags |= reflectedRange.stageFlags;
         }
     }
 
@@ -143,13 +127,13 @@ CacheLoadResult<ShaderPassInfo> ShaderPassCache::loadInfo(ShaderStageCreateInfos
     std::vector<VkDescriptorSetLayout> mergedSetLayouts;
     for (uint32_t setIdx = 0; setIdx < MAX_ALLOWED_DESCRIPTOR_SETS; ++setIdx) {
         std::vector<ReflectedBinding> mergedBindings;
-        for (ReflectedSetLayout& reflectedLayout : reflectedSetLayouts) {
-            if (setIdx != reflectedLayout.setIndex) {
-                continue;
-            }
-
+        for (const ShaderStage& stage : passInfo.stages) {
             // No need for any binary search or anything. Unlikely to have many bindings anyways
-            for (ReflectedBinding& reflectedBinding : reflectedLayout.bindings) {
+            for (const ShaderReflection::Binding& reflectedBinding : stage.module->reflection.bindings) {
+                if (setIdx != reflectedBinding.setIndex) {
+                    continue;
+                }
+
                 bool alreadyMerged = false;
                 for (ReflectedBinding& mergedBinding : mergedBindings) {
                     if (reflectedBinding.binding.binding != mergedBinding.binding.binding) {
@@ -157,14 +141,12 @@ CacheLoadResult<ShaderPassInfo> ShaderPassCache::loadInfo(ShaderStageCreateInfos
                     }
                     
                     alreadyMerged = true;
-                    mergedBinding.binding.stageFlags |= static_cast<VkShaderStageFlagBits>(reflectedBinding.binding.stageFlags);
-                    mergedBinding.names.insert(mergedBinding.names.end(),
-                        std::make_move_iterator(reflectedBinding.names.begin()),
-                        std::make_move_iterator(reflectedBinding.names.end()));
+                    mergedBinding.binding.stageFlags |= reflectedBinding.binding.stageFlags;
+                    mergedBinding.names.push_back(reflectedBinding.name);
                 }
 
                 if (!alreadyMerged) {
-                    mergedBindings.push_back(reflectedBinding);
+                    mergedBindings.push_back(ReflectedBinding(reflectedBinding.name, reflectedBinding.binding));
                 }
             }
         }
@@ -194,33 +176,156 @@ CacheLoadResult<ShaderPassInfo> ShaderPassCache::loadInfo(ShaderStageCreateInfos
             linearBindings[i] = mergedBindings[i].binding;
         }
 
-        // TODO: add flags?
-        std::optional<VkDescriptorSetLayout> setLayout = descriptorSetLayoutCache.getLayout(linearBindings, mergedBindings.size());
+        std::optional<VkDescriptorSetLayout> setLayout;
+        for (auto& setLayoutOverride : stageInfos.setLayoutOverrides) {
+            if (setLayoutOverride.setIndex == setIdx) {
+                setLayout = setLayoutOverride.layout;
+            }
+        }
+        if (!setLayout) {
+            // TODO: add flags?
+            setLayout = descriptorSetLayoutCache.getLayout(linearBindings, mergedBindings.size());
+        }
         if (setLayout && setLayout.value() != VK_NULL_HANDLE) {
             mergedSetLayouts.push_back(setLayout.value());
         }
         passInfo.descriptorSetLayouts.push_back(ShaderPassInfo::DescriptorSetLayout{ setIdx, setLayout.value(), std::move(mergedBindings) });
     }
 
-    // TODO: there should be a pipeline cache. I believe VK has a built-in one?
-    VkPipelineLayoutCreateInfo layoutInfo = layoutCreateInfo(mergedSetLayouts.data(), mergedSetLayouts.size());
-    vkCreatePipelineLayout(device, &layoutInfo, nullptr, &passInfo.layout);
+    // Passes with the same interface share a layout
+    std::optional<VkPipelineLayout> layout = descriptorSetLayoutCache.getPipelineLayout(mergedSetLayouts.data(), mergedSetLayouts.size(),
+        passInfo.pushConstants.data(), passInfo.pushConstants.size());
+    if (!layout) {
+        printf("Failed creating pipeline layout for pass info 0x%lx\n", stageInfos.hash());
+        // TODO: remove from cache
+        return CacheLoadResult<ShaderPassInfo>(false, nullptr);
+    }
+    passInfo.layout = layout.value();
 
     return CacheLoadResult<ShaderPassInfo>(true, &passInfo);
 }
 
 CacheLoadResult<ShaderPass> ShaderPassCache::loadPass(PassBuildingMaterials& passBuildingMaterials) {
-    auto passFromCache = passCache.find(*passBuildingMaterials.info);
-    if (passFromCache != passCache.end()) {
-        printf("Loading cached pass 0x%lx\n", passBuildingMaterials.info->hash());
-        return CacheLoadResult<ShaderPass>(true, &passFromCache->second);
+    ShaderPass* pass = loadPasses({ &passBuildingMaterials })[0];
+
+    return CacheLoadResult<ShaderPass>(pass != nullptr, pass);
+}
+
+std::vector<ShaderPass*> ShaderPassCache::loadPasses(const std::vector<PassBuildingMaterials*>& passes, ThreadPool* threadPool) {
+    std::vector<ShaderPass*> results(passes.size(), nullptr);
+
+    // Materials tend to share passes, every distinct one is only created once
+    std::vector<PassBuildingMaterials*> newPasses;
+    std::unordered_map<ShaderPassInfo, bool, ShaderPassInfo::Hash> queued;
+    for (size_t i = 0; i < passes.size(); ++i) {
+        auto passFromCache = passCache.find(*passes[i]->info);
+        if (passFromCache != passCache.end()) {
+            printf("Loading cached pass 0x%lx\n", passes[i]->info->hash());
+            results[i] = &passFromCache->second;
+        } else if (queued.emplace(*passes[i]->info, true).second) {
+            printf("Loading new pass 0x%lx\n", passes[i]->info->hash());
+            newPasses.push_back(passes[i]);
+        }
+    }
+
+    if (newPasses.empty()) {
+        return results;
+    }
+
+    // Filled in place, create infos point into themselves
+    std::vector<PipelineCreateInfo> createInfos(newPasses.size());
+    std::vector<VkGraphicsPipelineCreateInfo> pipelineInfos(newPasses.size());
+    for (size_t i = 0; i < newPasses.size(); ++i) {
+        PassBuildingMaterials& pass = *newPasses[i];
+        pass.pipelineBuilder.fill(createInfos[i], pass.renderpass, pass.viewport, pass.scissor, pass.info->layout);
+        pipelineInfos[i] = createInfos[i].info;
+    }
+    std::vector<VkPipeline> pipelines(newPasses.size(), VK_NULL_HANDLE);
+
+    size_t batchCount = 1;
+    if (threadPool != nullptr) {
+        batchCount = std::min(threadPool->workers.size() + 1, (newPasses.size() + MIN_PIPELINES_PER_BATCH - 1) / MIN_PIPELINES_PER_BATCH);
     }
-    printf("Loading new pass 0x%lx\n", passBuildingMaterials.info->hash());
 
-    ShaderPass& pass = passCache[*passBuildingMaterials.info];
-    pass.info = passBuildingMaterials.info;
-    pass.pipeline = passBuildingMaterials.pipelineBuilder.build(device, passBuildingMaterials.renderpass,
-        passBuildingMaterials.viewport, passBuildingMaterials.scissor, passBuildingMaterials.info->layout);
+    if (batchCount <= 1) {
+        if (vkCreateGraphicsPipelines(device, pipelineCache, pipelineInfos.size(), pipelineInfos.data(), nullptr, pipelines.data()) != VK_SUCCESS) {
+            printf("Failed creating some of %zu graphics pipelines\n", pipelineInfos.size());
+        }
+    } else {
+        // Every batch goes into its own pipeline cache so that threads don't contend on the shared one.
+        // They're seeded with its contents to still hit whatever was cached in previous runs, and merged back
+        // once done
+        std::vector<char> seed;
+        if (pipelineCache != VK_NULL_HANDLE) {
+            size_t seedSize = 0;
+            if (vkGetPipelineCacheData(device, pipelineCache, &seedSize, nullptr) == VK_SUCCESS && seedSize > 0) {
+                seed.resize(seedSize);
+                if (vkGetPipelineCacheData(device, pipelineCache, &seedSize, seed.data()) == VK_SUCCESS) {
+                    seed.resize(seedSize);
+                } else {
+                    seed.clear();
+                }
+            }
+        }
+
+        std::vector<VkPipelineCache> batchCaches(batchCount, VK_NULL_HANDLE);
+        threadPool->parallelFor(batchCount, [&](size_t batch) {
+            VkPipelineCacheCreateInfo cacheInfo = {};
+            cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+            cacheInfo.pNext = nullptr;
+            cacheInfo.initialDataSize = seed.size();
+            cacheInfo.pInitialData = seed.empty() ? nullptr : seed.data();
+            if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &batchCaches[batch]) != VK_SUCCESS) {
+                // Uncached is slower, but still works
+                batchCaches[batch] = VK_NULL_HANDLE;
+            }
+
+            size_t begin = pipelineInfos.size() * batch / batchCount;
+            size_t end = pipelineInfos.size() * (batch + 1) / batchCount;
+            if (vkCreateGraphicsPipelines(device, batchCaches[batch], end - begin, pipelineInfos.data() + begin,
+                nullptr, pipelines.data() + begin) != VK_SUCCESS) {
+                printf("Failed creating some of %zu graphics pipelines\n", end - begin);
+            }
+        });
+
+        std::vector<VkPipelineCache> createdCaches;
+        for (VkPipelineCache batchCache : batchCaches) {
+            if (batchCache != VK_NULL_HANDLE) {
+                createdCaches.push_back(batchCache);
+            }
+        }
+        if (pipelineCache != VK_NULL_HANDLE && !createdCaches.empty()) {
+            vkMergePipelineCaches(device, pipelineCache, createdCaches.size(), createdCaches.data());
+        }
+        for (VkPipelineCache batchCache : createdCaches) {
+            vkDestroyPipelineCache(device, batchCache, nullptr);
+        }
+    }
+
+    // Failed pipelines come back as VK_NULL_HANDLE and stay out of the cache
+    for (size_t i = 0; i < newPasses.size(); ++i) {
+        if (pipelines[i] == VK_NULL_HANDLE) {
+            printf("Failed creating pass 0x%lx\n", newPasses[i]->info->hash());
+            continue;
+        }
+
+        ShaderPass& pass = passCache[*newPasses[i]->info];
+        pass.info = newPasses[i]->info;
+        pass.pipeline = pipelines[i];
+        pass.builder = newPasses[i]->pipelineBuilder;
+        pass.renderpass = newPasses[i]->renderpass;
+        pass.viewport = newPasses[i]->viewport;
+        pass.scissor = newPasses[i]->scissor;
+    }
+
+    for (size_t i = 0; i < passes.size(); ++i) {
+        if (results[i] == nullptr) {
+            auto passFromCache = passCache.find(*passes[i]->info);
+            if (passFromCache != passCache.end()) {
+                results[i] = &passFromCache->second;
+            }
+        }
+    }
 
-    return CacheLoadResult<ShaderPass>(true, &pass);
+    return results;
 }
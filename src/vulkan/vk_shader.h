@@ -1,5 +1,9 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
 #include <functional>
 #include <string>
 #include <unordered_map>
@@ -7,10 +11,13 @@
 
 #include "vulkan/vulkan.h"
 #include "vulkan/cache.h"
+#include "vulkan/pipeline_builder.h"
+#include "vulkan/shader_reflection.h"
 
 #define SHADER_SRC_PATH "../src/shaders/"
 #define SHADER_SPIRV_PATH "./shaders/"
 #define SHADER_SPIRV_EXTENSION ".spv"
+#define SHADER_REFLECTION_EXTENSION ".reflect"
 
 #define SHADER_FILENAME_AND_SPIRV_AND_SRC_PATH(filename) filename, SHADER_SPIRV_PATH filename SHADER_SPIRV_EXTENSION, SHADER_SRC_PATH filename
 
@@ -19,7 +26,7 @@ struct ShaderPath {
     std::string spirvPath;
     std::string sourcePath;
 
-    // File timestamps? -> mv ShaderFileInfo
+    // Source timestamps are tracked by ShaderHotReload
 
     ShaderPath(std::string filename, std::string spirvPath, std::string sourcePath) : filename(filename), spirvPath(spirvPath), sourcePath(sourcePath) {}
 
@@ -44,19 +51,82 @@ struct ShaderModule {
 
     const char* sourceCode;
     std::vector<uint32_t> spirvCode;
+    // Either loaded from next to the SPIR-V or reflected on load
+    ShaderReflection reflection;
 
     VkShaderModule module;  
 
     ShaderModule(ShaderPath path) : path(path) {}
 };
 
+struct SpecializationConstant {
+    uint32_t id;
+    // Raw bits. Everything GLSL allows as a specialization constant fits, except for 64 bit types
+    uint32_t value;
+
+    static SpecializationConstant ofBool(uint32_t id, bool value) {
+        return SpecializationConstant{ id, value ? VK_TRUE : VK_FALSE };
+    }
+
+    static SpecializationConstant ofUint(uint32_t id, uint32_t value) {
+        return SpecializationConstant{ id, value };
+    }
+
+    static SpecializationConstant ofInt(uint32_t id, int32_t value) {
+        SpecializationConstant constant{ id, 0 };
+        memcpy(&constant.value, &value, sizeof(value));
+        return constant;
+    }
+
+    static SpecializationConstant ofFloat(uint32_t id, float value) {
+        SpecializationConstant constant{ id, 0 };
+        memcpy(&constant.value, &value, sizeof(value));
+        return constant;
+    }
+
+    bool operator==(const SpecializationConstant& other) const {
+        return id == other.id && value == other.value;
+    }
+};
+
 struct ShaderStage {
     ShaderModule* module;  
     VkShaderStageFlagBits flags;
 
-    ShaderStage(ShaderModule* module, VkShaderStageFlagBits flags) : module(module), flags(flags) {}
+    // Sorted by id
+    std::vector<SpecializationConstant> specializationConstants;
+    std::vector<VkSpecializationMapEntry> specializationEntries;
+    VkSpecializationInfo specializationInfo;
+
+    ShaderStage(ShaderModule* module, VkShaderStageFlagBits flags, std::vector<SpecializationConstant> constants = {})
+        : module(module), flags(flags), specializationConstants(constants) {
+        for (size_t i = 0; i < specializationConstants.size(); ++i) {
+            VkSpecializationMapEntry entry = {};
+            entry.constantID = specializationConstants[i].id;
+            entry.offset = i * sizeof(SpecializationConstant) + offsetof(SpecializationConstant, value);
+            entry.size = sizeof(uint32_t);
+            specializationEntries.push_back(entry);
+        }
+    }
+
+    // For VkPipelineShaderStageCreateInfo, nullptr without any constants. Points into the stage, so it
+    // can't move while pipelines are created from it
+    const VkSpecializationInfo* specialization() {
+        if (specializationConstants.empty()) {
+            return nullptr;
+        }
+
+        specializationInfo.mapEntryCount = specializationEntries.size();
+        specializationInfo.pMapEntries = specializationEntries.data();
+        specializationInfo.dataSize = specializationConstants.size() * sizeof(SpecializationConstant);
+        specializationInfo.pData = specializationConstants.data();
+        return &specializationInfo;
+    }
 };
 
+// SPIR-V words of the file, empty if it couldn't be read
+std::vector<uint32_t> readFile(std::string path);
+
 struct ShaderModuleCache {
     VkDevice device;
     std::unordered_map<ShaderPath, ShaderModule, ShaderPath::Hash> cache;
@@ -84,18 +154,45 @@ struct ShaderPassInfo {
         std::vector<ReflectedBinding> bindings;
     };
     std::vector<DescriptorSetLayout> descriptorSetLayouts;
+    // At most one range, merged across stages
     std::vector<VkPushConstantRange> pushConstants;
 
     VkPipelineLayout layout;
 
+    // Typed per-draw data. T has to match the push constant block of the pass' shaders
+    template<typename T>
+    void push(VkCommandBuffer cmd, const T& data) const {
+        assert(!pushConstants.empty() && pushConstants[0].offset == 0 && sizeof(T) <= pushConstants[0].size);
+        vkCmdPushConstants(cmd, layout, pushConstants[0].stageFlags, 0, sizeof(T), &data);
+    }
+
+    // Layouts are shared between passes with the same interface, so the stages are what tells passes apart
     bool operator==(const ShaderPassInfo& other) const {
-        return layout == other.layout;
+        if (layout != other.layout || stages.size() != other.stages.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < stages.size(); ++i) {
+            if (stages[i].module != other.stages[i].module || stages[i].flags != other.stages[i].flags
+                || stages[i].specializationConstants != other.stages[i].specializationConstants) {
+                return false;
+            }
+        }
+
+        return true;
     }
 
     size_t hash() const {
-        // ShaderPassInfo should be uniquely defined by a layout : different layout - different pass
-        // TODO: this does fuck all until pipeline layouts are cached!!!
-        return (size_t)layout;
+        size_t hash = std::hash<VkPipelineLayout>{}(layout);
+        for (const ShaderStage& stage : stages) {
+            hash = hash * 31 + std::hash<ShaderModule*>{}(stage.module);
+            hash = hash * 31 + std::hash<size_t>{}(stage.flags);
+            for (const SpecializationConstant& constant : stage.specializationConstants) {
+                hash = hash * 31 + std::hash<uint32_t>{}(constant.id);
+                hash = hash * 31 + std::hash<uint32_t>{}(constant.value);
+            }
+        }
+
+        return hash;
     }
 
     struct Hash {
@@ -109,31 +206,56 @@ struct ShaderPass {
     ShaderPassInfo* info;
     VkPipeline pipeline;
 
+    // What the pipeline was created from, so it can be recreated once its shaders change
+    PipelineBuilder builder;
+    VkRenderPass renderpass;
+    VkViewport* viewport;
+    VkRect2D* scissor;
+
     //std::vector<> bindings;
 };
 
 struct DescriptorSetLayoutCache;
 struct PassBuildingMaterials;
+struct ThreadPool;
 struct ShaderPassCache {
+    // Fewer than that per thread isn't worth seeding another pipeline cache for
+    static constexpr size_t MIN_PIPELINES_PER_BATCH = 4;
+
     VkDevice device;
     ShaderModuleCache& moduleCache;
     DescriptorSetLayoutCache& descriptorSetLayoutCache;
+    // Shared by all pipelines created through loadPass
+    VkPipelineCache pipelineCache;
 
     struct ShaderStageCreateInfo {
         ShaderPath path;
         VkShaderStageFlagBits stage;
 
-        // TODO: add specialization constants
+        // Different constants make different passes
+        std::vector<SpecializationConstant> specializationConstants;
 
-        ShaderStageCreateInfo(ShaderPath path, VkShaderStageFlagBits stage) : path(path), stage(stage) {}
+        ShaderStageCreateInfo(ShaderPath path, VkShaderStageFlagBits stage, std::vector<SpecializationConstant> unsortedConstants = {})
+            : path(path), stage(stage) {
+            std::sort(unsortedConstants.begin(), unsortedConstants.end(), [](SpecializationConstant a, SpecializationConstant b) {
+                return a.id < b.id;
+            });
+            specializationConstants = unsortedConstants;
+        }
 
         bool operator==(const ShaderStageCreateInfo& other) const {
-            return path == other.path && stage == other.stage;
+            return path == other.path && stage == other.stage && specializationConstants == other.specializationConstants;
         }
 
         size_t hash() const {
             // Not great but works for now
-            return path.hash() ^ std::hash<size_t>{}(stage);
+            size_t hash = path.hash() ^ std::hash<size_t>{}(stage);
+            for (const SpecializationConstant& constant : specializationConstants) {
+                hash = hash * 31 + std::hash<uint32_t>{}(constant.id);
+                hash = hash * 31 + std::hash<uint32_t>{}(constant.value);
+            }
+
+            return hash;
         }
     };
 
@@ -146,8 +268,16 @@ struct ShaderPassCache {
         };
         std::vector<DescriptorTypeOverride> overrides;
 
+        // Sets whose layout is owned elsewhere instead of being derived from reflection, e.g. the bindless set
+        struct SetLayoutOverride {
+            uint32_t setIndex;
+            VkDescriptorSetLayout layout;
+        };
+        std::vector<SetLayoutOverride> setLayoutOverrides;
+
         ShaderStageCreateInfos(std::vector<ShaderStageCreateInfo> unsortedStages,
-            std::vector<DescriptorTypeOverride> unsortedOverrides = {}) {
+            std::vector<DescriptorTypeOverride> unsortedOverrides = {},
+            std::vector<SetLayoutOverride> unsortedSetLayoutOverrides = {}) {
             std::sort(unsortedStages.begin(), unsortedStages.end(), [](ShaderStageCreateInfo a, ShaderStageCreateInfo b) {
                 return a.stage < b.stage;
             });
@@ -157,10 +287,16 @@ struct ShaderPassCache {
                 return a.bindingName.compare(b.bindingName) < 0;
             });
             overrides = unsortedOverrides;
+
+            std::sort(unsortedSetLayoutOverrides.begin(), unsortedSetLayoutOverrides.end(), [](SetLayoutOverride a, SetLayoutOverride b) {
+                return a.setIndex < b.setIndex;
+            });
+            setLayoutOverrides = unsortedSetLayoutOverrides;
         }
 
         bool operator==(const ShaderStageCreateInfos& other) const {
-            if (stages.size() != other.stages.size() || overrides.size() != other.overrides.size()) {
+            if (stages.size() != other.stages.size() || overrides.size() != other.overrides.size()
+                || setLayoutOverrides.size() != other.setLayoutOverrides.size()) {
                 return false;
             }
             for (size_t i = 0; i < stages.size(); ++i) {
@@ -170,13 +306,20 @@ struct ShaderPassCache {
             }
 
             for (size_t i = 0; i < overrides.size(); ++i) {
-                bool nameMatches = overrides[i].bindingName.compare(other.overrides[i].bindingName) != 0;
-                bool typeMatches = overrides[i].type != other.overrides[i].type;
+                bool nameMatches = overrides[i].bindingName.compare(other.overrides[i].bindingName) == 0;
+                bool typeMatches = overrides[i].type == other.overrides[i].type;
                 if (!nameMatches || !typeMatches) {
                     return false;
                 }
             }
 
+            for (size_t i = 0; i < setLayoutOverrides.size(); ++i) {
+                if (setLayoutOverrides[i].setIndex != other.setLayoutOverrides[i].setIndex
+                    || setLayoutOverrides[i].layout != other.setLayoutOverrides[i].layout) {
+                    return false;
+                }
+            }
+
             return true;
         }
 
@@ -191,6 +334,9 @@ struct ShaderPassCache {
                 hash ^= std::hash<std::string>{}(overrides[i].bindingName);
                 hash ^= std::hash<size_t>{}(overrides[i].type);
             }
+            for (size_t i = 0; i < setLayoutOverrides.size(); ++i) {
+                hash ^= std::hash<VkDescriptorSetLayout>{}(setLayoutOverrides[i].layout) + setLayoutOverrides[i].setIndex;
+            }
 
             return hash;
         }
@@ -205,9 +351,12 @@ struct ShaderPassCache {
     std::unordered_map<ShaderStageCreateInfos, ShaderPassInfo, ShaderStageCreateInfos::Hash> infoCache;
     std::unordered_map<ShaderPassInfo, ShaderPass, ShaderPassInfo::Hash> passCache;
 
-    ShaderPassCache(VkDevice device, ShaderModuleCache& moduleCache, DescriptorSetLayoutCache& descriptorSetLayoutCache) : device(device), moduleCache(moduleCache), descriptorSetLayoutCache(descriptorSetLayoutCache) {}
+    ShaderPassCache(VkDevice device, ShaderModuleCache& moduleCache, DescriptorSetLayoutCache& descriptorSetLayoutCache, VkPipelineCache pipelineCache = VK_NULL_HANDLE) : device(device), moduleCache(moduleCache), descriptorSetLayoutCache(descriptorSetLayoutCache), pipelineCache(pipelineCache) {}
 
     CacheLoadResult<ShaderPassInfo> loadInfo(ShaderStageCreateInfos stageInfos);
     //CacheLoadResult<ShaderPass> loadPass(ShaderStageCreateInfos stageInfos);
     CacheLoadResult<ShaderPass> loadPass(PassBuildingMaterials& passBuildingMaterials);
+    // Creates all passes missing from the cache in as few vkCreateGraphicsPipelines calls as possible,
+    // spread over the thread pool if there is one. Results line up with passes, nullptr if creation failed
+    std::vector<ShaderPass*> loadPasses(const std::vector<PassBuildingMaterials*>& passes, ThreadPool* threadPool = nullptr);
 };